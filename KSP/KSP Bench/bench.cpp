@@ -0,0 +1,957 @@
+#include "bench.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <random>
+
+#include "runtime.h"
+#include "arrays.h"
+#include "batch.h"
+#include "executor.h"
+#include "scheduler.h"
+#include "image.h"
+#include "linker.h"
+#include "vm.h"
+#include "ops.h"
+
+/* Generated into bench_aot.cpp at build time: the aot::emit translation of build_aot_module. */
+bool ksp_bench_aot_bind(ksp::Module& module);
+
+const char* ksp::bench::dispatch_engine_name()
+{
+#if defined(__KSP_THREADED_DISPATCH)
+	return "threaded";
+#else
+	return "switch";
+#endif
+}
+
+static void add_put_mov(ksp::module_info::Function& function, const size_t instructions)
+{
+	namespace info = ksp::opcode::info;
+
+	/* A fixed mix of every PUT/MOV width over two registers.
+	 * The pattern length is prime so the predictor can not learn it as a short loop. */
+	ksp::bytecode::BytecodeBuilder builder;
+	for (size_t i = 0; i < instructions; ++i)
+	{
+		switch ((i * 7) % 11)
+		{
+			case 0: builder.push_instruction(info::PUTB, { 0, i & 0xff }); break;
+			case 1: builder.push_instruction(info::PUTW, { 1, i & 0xffff }); break;
+			case 2: builder.push_instruction(info::PUTL, { 0, i }); break;
+			case 3: builder.push_instruction(info::PUTQ, { 0, i * 0x9e3779b97f4a7c15ULL }); break;
+			case 4: builder.push_instruction(info::MOVB, { 0, 1 }); break;
+			case 5: builder.push_instruction(info::MOVW, { 1, 0 }); break;
+			case 6: builder.push_instruction(info::MOVL, { 0, 1 }); break;
+			case 7: builder.push_instruction(info::MOVQ, { 0, 0 }); break;
+			case 8: builder.push_instruction(info::PUTL, { 1, ~i }); break;
+			case 9: builder.push_instruction(info::MOVL, { 1, 0 }); break;
+			default: builder.push_instruction(info::NOP, {}); break;
+		}
+	}
+	builder.push_instruction(info::HALT, { 0 });
+
+	function.addVariable(ksp::Type::Integer, "r0");
+	function.addVariable(ksp::Type::Integer, "r1");
+	function.addOpcodes(builder.build());
+}
+
+static void build_put_mov(ksp::module_info::Function& function, const size_t instructions)
+{
+	add_put_mov(function, instructions);
+	function.build();
+}
+
+template<typename _Policy>
+static double run_function(ksp::KSP_State& state, const ksp::module_info::Function& function, const size_t iterations)
+{
+	ksp::Module mod;
+
+	ksp::reg_t sink = 0;
+	double ns = ksp::bench::measure_ns([&]() {
+		for (size_t i = 0; i < iterations; ++i)
+			sink ^= ksp::execute<_Policy>(&state, &mod, function);
+	});
+	volatile ksp::reg_t result = sink;
+	(void) result;
+	return ns;
+}
+
+ksp::bench::Result ksp::bench::dispatch_put_mov(const size_t instructions, const size_t iterations)
+{
+	module_info::Function function;
+	build_put_mov(function, instructions);
+
+	KSP_State state;
+	double ns = run_function<policy::Release>(state, function, iterations);
+
+	return { std::string{ "dispatch_put_mov/" } + dispatch_engine_name(), iterations, instructions * iterations, ns };
+}
+
+ksp::bench::Result ksp::bench::profile_put_mov(const size_t instructions, const size_t iterations, const bool cycles, std::ostream* report)
+{
+	module_info::Function function;
+	build_put_mov(function, instructions);
+
+	KSP_State state;
+	state.profile.setCycleSampling(cycles);
+	double ns = run_function<policy::Profile>(state, function, iterations);
+
+	if (report)
+		*report << state.profile;
+
+	return { cycles ? "profile_put_mov/cycles" : "profile_put_mov/counts", iterations, instructions * iterations, ns };
+}
+
+ksp::bench::Result ksp::bench::dispatch_put_mov_pairs(const size_t pairs, const size_t iterations)
+{
+	namespace info = ksp::opcode::info;
+
+	bytecode::BytecodeBuilder builder;
+	for (size_t i = 0; i < pairs; ++i)
+	{
+		const uint64_t reg = i & 1;
+		builder.push_instruction(info::PUTL, { reg, i });
+		builder.push_instruction(info::MOVL, { reg, reg ^ 1 });
+	}
+	builder.push_instruction(info::HALT, { 0 });
+
+	module_info::Function function;
+	function.addVariable(Type::Integer, "r0");
+	function.addVariable(Type::Integer, "r1");
+	function.addOpcodes(builder.build());
+	function.build();
+
+	KSP_State state;
+	double ns = run_function<policy::Release>(state, function, iterations);
+
+	return { "dispatch_put_mov_pairs/fused_" + std::to_string(function.fusionReport().dispatchesRemoved()),
+		iterations, pairs * 2 * iterations, ns };
+}
+
+ksp::bench::Result ksp::bench::executor_throughput(const size_t workers, const size_t invocations, const size_t instructions)
+{
+	Module mod;
+	module_info::Function function;
+	build_put_mov(function, instructions);
+
+	std::vector<Executor::Invocation> batch(invocations, Executor::Invocation{ &function, 0 });
+
+	Executor executor{ mod, workers };
+	executor.run(batch);
+
+	double ns = measure_ns([&]() { executor.run(batch); });
+
+	return { "executor_throughput/" + std::to_string(workers) + "_workers", invocations, invocations, ns };
+}
+
+ksp::bench::Result ksp::bench::short_script_state(const size_t instructions, const size_t iterations, const bool pooled)
+{
+	Module mod;
+	module_info::Function function;
+	build_put_mov(function, instructions);
+
+	KSP_State state;
+	RuntimeStatePool pool;
+	reg_t sink = 0;
+	double ns = measure_ns([&]() {
+		for (size_t i = 0; i < iterations; ++i)
+		{
+			if (pooled)
+			{
+				RuntimeStatePool::Lease lease = pool.acquire();
+				sink ^= execute(&state, &mod, *lease, function);
+			}
+			else
+			{
+				RuntimeState fresh;
+				sink ^= execute(&state, &mod, fresh, function);
+			}
+		}
+	});
+	volatile reg_t result = sink;
+	(void) result;
+
+	return { pooled ? "short_script_state/pooled" : "short_script_state/fresh", iterations, iterations, ns };
+}
+
+ksp::bench::Result ksp::bench::yield_resume(const size_t yields, const size_t iterations)
+{
+	namespace info = ksp::opcode::info;
+
+	bytecode::BytecodeBuilder builder;
+	for (size_t i = 0; i < yields; ++i)
+	{
+		builder.push_instruction(info::PUTL, { 0, i });
+		builder.push_instruction(info::YIELD, { 0 });
+	}
+	builder.push_instruction(info::HALT, { 0 });
+
+	module_info::Function function;
+	function.addVariable(Type::Integer, "r0");
+	function.addOpcodes(builder.build());
+	function.build();
+
+	Module mod;
+	KSP_State state;
+	RuntimeState runtime;
+	reg_t sink = 0;
+	double ns = measure_ns([&]() {
+		for (size_t i = 0; i < iterations; ++i)
+		{
+			sink ^= execute(&state, &mod, runtime, function);
+			while (runtime.suspended())
+				sink ^= resume(&state, &mod, runtime);
+		}
+	});
+	volatile reg_t result = sink;
+	(void) result;
+
+	return { "yield_resume", iterations, yields * iterations, ns };
+}
+
+ksp::bench::Result ksp::bench::scheduler_fibers(const size_t workers, const bool work_stealing, const size_t fibers, const size_t yields)
+{
+	namespace info = ksp::opcode::info;
+
+	/* A short PUT/MOV run between yields, the shape of a script waiting on events. */
+	bytecode::BytecodeBuilder builder;
+	for (size_t i = 0; i < yields; ++i)
+	{
+		for (size_t j = 0; j < 8; ++j)
+		{
+			builder.push_instruction(info::PUTL, { 0, i + j });
+			builder.push_instruction(info::MOVL, { 0, 1 });
+		}
+		builder.push_instruction(info::YIELD, { 1 });
+	}
+	builder.push_instruction(info::HALT, { 1 });
+
+	module_info::Function function;
+	function.addVariable(Type::Integer, "r0");
+	function.addVariable(Type::Integer, "r1");
+	function.addOpcodes(builder.build());
+	function.build();
+
+	Module mod;
+	Scheduler scheduler{ mod, workers, work_stealing ? Scheduler::Queueing::WorkStealing : Scheduler::Queueing::Global };
+
+	/* One untimed round so every worker pool already holds its states. */
+	for (size_t i = 0; i < fibers; ++i)
+		scheduler.spawn(function);
+	scheduler.run();
+	scheduler.clear();
+
+	for (size_t i = 0; i < fibers; ++i)
+		scheduler.spawn(function);
+	double ns = measure_ns([&]() { scheduler.run(); });
+
+	return { std::string{ "scheduler_fibers/" } + (work_stealing ? "stealing_" : "global_") + std::to_string(workers) + "_workers",
+		fibers, fibers * (yields + 1), ns };
+}
+
+ksp::bench::Result ksp::bench::batch_rows(const char* isa, const size_t rows, const size_t instructions)
+{
+	module_info::Function function;
+	build_put_mov(function, instructions);
+
+	if (!isa)
+	{
+		KSP_State state;
+		double ns = run_function<policy::Release>(state, function, rows);
+		return { "batch_rows/execute_per_row", rows, rows, ns };
+	}
+
+	batch::Isa selected = batch::Isa::Scalar;
+	for (const batch::Isa candidate : { batch::Isa::Scalar, batch::Isa::AVX2, batch::Isa::AVX512 })
+		if (std::string{ batch::isa_name(candidate) } == isa)
+			selected = candidate;
+	if (!batch::isa_supported(selected))
+		return { std::string{ "batch_rows/" } + isa + "_unsupported", 0, 0, 0 };
+
+	std::vector<reg_t> in0(rows), in1(rows), out(rows);
+	for (size_t i = 0; i < rows; ++i)
+	{
+		in0[i] = static_cast<reg_t>(i);
+		in1[i] = static_cast<reg_t>(~i);
+	}
+	const reg_t* inputs[] = { in0.data(), in1.data() };
+
+	double ns = measure_ns([&]() { batch::execute(function, inputs, 2, out.data(), rows, selected); });
+	volatile reg_t result = out[rows - 1];
+	(void) result;
+
+	return { std::string{ "batch_rows/" } + isa, rows, rows, ns };
+}
+
+ksp::bench::Result ksp::bench::array_add(const size_t count, const size_t iterations)
+{
+	namespace info = ksp::opcode::info;
+
+	const TypeInfo array = TypeInfo::arrayOf(TypeInfo::Integer, count);
+
+	bytecode::BytecodeBuilder builder;
+	builder.push_instruction(info::AADD, { 0, 0, 1 });
+	builder.push_instruction(info::HALT, { 2 });
+
+	module_info::Function function;
+	function.addVariable(Type{ array }, "acc");
+	function.addVariable(Type{ array }, "step");
+	function.addVariable(Type::Integer, "r");
+	function.addOpcodes(builder.build());
+	function.build();
+
+	KSP_State state;
+	double ns = run_function<policy::Release>(state, function, iterations);
+
+	return { std::string{ "array_add/" } + (arrays::simd() ? "avx2" : "scalar"), iterations, count * iterations, ns };
+}
+
+ksp::bench::Result ksp::bench::call_return(const size_t calls, const size_t iterations, const bool heap)
+{
+	namespace info = ksp::opcode::info;
+
+	Module mod;
+	module_info::Function& caller = mod.content.createNewElement("caller").createFunction();
+	module_info::Function& leaf = mod.content.createNewElement("leaf").createFunction();
+
+	caller.addVariable(Type::Integer, "r");
+	caller.addVariable(Type::Integer, "a");
+	caller.addVariable(Type::Integer, "b");
+	leaf.addParameter(Type::Integer, "a");
+	leaf.addParameter(Type::Integer, "b");
+	if (heap)
+		leaf.addVariable(Type{ TypeInfo::arrayOf(TypeInfo::Integer, 4) }, "scratch");
+	mod.content.buildReferences();
+
+	bytecode::BytecodeBuilder builder;
+	for (size_t i = 0; i < calls; ++i)
+	{
+		builder.push_instruction(info::PUTL, { 2, i });
+		builder.push_instruction(info::CALL, { 1, mod.content.getElement("leaf").offset() });
+	}
+	builder.push_instruction(info::HALT, { 1 });
+	caller.addOpcodes(builder.build());
+
+	builder = {};
+	builder.push_instruction(info::RET, { 1 });
+	leaf.addOpcodes(builder.build());
+	mod.build();
+
+	KSP_State state;
+	RuntimeState runtime;
+	reg_t sink = 0;
+	double ns = measure_ns([&]() {
+		for (size_t i = 0; i < iterations; ++i)
+			sink ^= execute(&state, &mod, runtime, caller);
+	});
+	volatile reg_t result = sink;
+	(void) result;
+
+	return { std::string{ "call_return/" } + (heap ? "copied" : "overlapped"), iterations, calls * iterations, ns };
+}
+
+ksp::bench::Result ksp::bench::tail_call_chain(const size_t depth, const size_t iterations)
+{
+	namespace info = ksp::opcode::info;
+
+	/* Names sort in chain order, so function i gets offset i. */
+	Module mod;
+	std::vector<module_info::Function*> chain;
+	for (size_t i = 0; i <= depth; ++i)
+	{
+		std::string name = std::to_string(i);
+		name.insert(0, 10 - name.size(), '0');
+
+		module_info::Function& function = mod.content.createNewElement("link" + name).createFunction();
+		function.addParameter(Type::Integer, "x");
+		function.addVariable(Type::Integer, "y");
+
+		bytecode::BytecodeBuilder builder;
+		if (i < depth)
+			builder.push_instruction(info::TAILCALL, { 0, i + 1 });
+		else builder.push_instruction(info::RET, { 0 });
+		function.addOpcodes(builder.build());
+		chain.push_back(&function);
+	}
+	mod.build();
+
+	KSP_State state;
+	RuntimeState runtime;
+	reg_t sink = 0;
+	double ns = measure_ns([&]() {
+		for (size_t i = 0; i < iterations; ++i)
+			sink ^= execute(&state, &mod, runtime, *chain.front());
+	});
+	volatile reg_t result = sink;
+	(void) result;
+
+	return { "tail_call_chain", iterations, depth * iterations, ns };
+}
+
+ksp::bench::Result ksp::bench::module_cold_start(const size_t functions, const bool from_image, const size_t iterations)
+{
+	auto name = [](const size_t i) {
+		std::string name = std::to_string(i);
+		return "fn" + name.insert(0, 10 - name.size(), '0');
+	};
+	auto make = [&name, functions](Module& mod) {
+		for (size_t i = 0; i < functions; ++i)
+			add_put_mov(mod.content.createNewElement(name(i)).createFunction(), 32);
+		mod.build();
+	};
+
+	const std::string path = (std::filesystem::temp_directory_path() / "ksp_bench_module.img").string();
+	if (from_image)
+	{
+		Module mod;
+		make(mod);
+		ModuleImage::write(mod, path);
+	}
+
+	/* Ready to run one function, as a request would be. */
+	KSP_State state;
+	reg_t sink = 0;
+	double ns = measure_ns([&]() {
+		for (size_t i = 0; i < iterations; ++i)
+		{
+			if (from_image)
+			{
+				ModuleImage image{ path };
+				sink ^= execute(&state, &image.module(), image.function(name(functions / 2)));
+			}
+			else
+			{
+				Module mod;
+				make(mod);
+				sink ^= execute(&state, &mod, *mod.fastFunctionAccessor[functions / 2]);
+			}
+		}
+	});
+	volatile reg_t result = sink;
+	(void) result;
+
+	if (from_image)
+		std::remove(path.c_str());
+
+	return { std::string{ "module_cold_start/" } + (from_image ? "image/" : "build/") + std::to_string(functions), iterations, iterations, ns };
+}
+
+ksp::bench::Result ksp::bench::module_rebuild(const size_t functions, const size_t constants, const bool incremental, const size_t iterations)
+{
+	auto make = [functions, constants](Module& mod) {
+		for (size_t i = 0; i < constants; ++i)
+			mod.content.createNewElement("k" + std::to_string(i)).createConstantValue(Type::Integer);
+		for (size_t i = 0; i < functions; ++i)
+			add_put_mov(mod.content.createNewElement("fn" + std::to_string(i)).createFunction(), 32);
+	};
+
+	/* An edit of one constant and one function, then the build that makes it runnable. */
+	Module mod;
+	make(mod);
+	mod.build();
+
+	double ns = 0;
+	for (size_t i = 0; i < iterations; ++i)
+	{
+		const std::string constant = "k" + std::to_string(i % constants);
+		if (incremental)
+		{
+			const module_info::ConstantValue* value = mod.content.getElement(constant).createConstantValue(Type::Integer);
+			std::memcpy(value->data(), &i, sizeof(uint32_t));
+			mod.content.getElement("fn" + std::to_string(i % functions)).getFunction()->addOpcode(opcode::NOP);
+			ns += measure_ns([&]() { mod.build(); });
+		}
+		else
+		{
+			Module fresh;
+			make(fresh);
+			ns += measure_ns([&]() { fresh.build(); });
+		}
+	}
+
+	return { std::string{ "module_rebuild/" } + (incremental ? "incremental/" : "full/") + std::to_string(functions) + "+" + std::to_string(constants),
+		iterations, iterations, ns };
+}
+
+ksp::bench::Result ksp::bench::link_modules(const size_t modules, const size_t functions, const size_t workers, const size_t iterations)
+{
+	double ns = 0;
+	for (size_t it = 0; it < iterations; ++it)
+	{
+		/* A 'base' module, defining what every other module imports. */
+		std::vector<std::unique_ptr<Module>> mods;
+		mods.emplace_back(new Module);
+		mods[0]->content.createNewElement("limit").createConstantValue(Type::Integer);
+		add_put_mov(mods[0]->content.createNewElement("helper").createFunction(), 32);
+
+		Linker linker{ workers };
+		linker.add(*mods[0], "base");
+		for (size_t m = 1; m <= modules; ++m)
+		{
+			mods.emplace_back(new Module);
+			module_info::NameTable& content = mods[m]->content;
+			content.createNewElement("limit");
+			content.createNewElement("helper");
+			for (size_t i = 0; i < functions; ++i)
+				add_put_mov(content.createNewElement("fn" + std::to_string(i)).createFunction(), 32);
+			linker.add(*mods[m], "module" + std::to_string(m));
+		}
+
+		ns += measure_ns([&]() { linker.link(); });
+	}
+
+	return { "link_modules/" + std::to_string(modules) + "x" + std::to_string(functions) + "/" + std::to_string(workers) + (workers > 1 ? " workers" : " worker"),
+		iterations, modules * iterations, ns };
+}
+
+ksp::bench::Result ksp::bench::module_lazy_start(const size_t functions, const bool lazy, const size_t iterations)
+{
+	KSP_State state;
+	reg_t sink = 0;
+	size_t built = 0;
+	double ns = 0;
+	for (size_t i = 0; i < iterations; ++i)
+	{
+		Module mod;
+		for (size_t f = 0; f < functions; ++f)
+			add_put_mov(mod.content.createNewElement("fn" + std::to_string(f)).createFunction(), 32);
+
+		ns += measure_ns([&]() {
+			mod.build(lazy);
+			sink ^= execute(&state, &mod, *mod.fastFunctionAccessor[functions / 2]);
+		});
+		built = mod.materializedCount();
+	}
+	volatile reg_t result = sink;
+	(void) result;
+
+	return { std::string{ "module_lazy_start/" } + (lazy ? "lazy/" : "eager/") + std::to_string(functions)
+		+ " (" + std::to_string(built) + " built)", iterations, iterations, ns };
+}
+
+ksp::bench::Result ksp::bench::aot_execute(const bool aot, const size_t iterations)
+{
+	Module mod;
+	build_aot_module(mod);
+	if (aot && !ksp_bench_aot_bind(mod))
+		return { "aot_execute/stale", 0, 0, 0 };
+
+	const module_info::Function& main = *mod.fastFunctionAccessor[mod.content.getElement("main").offset()];
+
+	KSP_State state;
+	RuntimeState runtime;
+	reg_t sink = 0;
+	double ns = measure_ns([&]() {
+		for (size_t i = 0; i < iterations; ++i)
+			sink ^= execute(&state, &mod, runtime, main);
+	});
+	volatile reg_t result = sink;
+	(void) result;
+
+	/* 64 blocks of 16 PUT/MOV, a MOV, a CALL and the leaf's MOV and RET. */
+	return { std::string{ "aot_execute/" } + (aot ? "aot" : "interpreted"), iterations, 64 * 20 * iterations, ns };
+}
+
+ksp::bench::Result ksp::bench::constant_loads(const size_t constants, const size_t distinct, const size_t iterations)
+{
+	static const Type types[] = { Type::Byte, Type::Short, Type::Integer, Type::Long };
+
+	Module mod;
+	for (size_t i = 0; i < constants; ++i)
+	{
+		const Type& type = types[i % 4];
+		const uint64_t value = i % distinct;
+		data_ptr_t data = mod.content.createNewElement("c" + std::to_string(i)).createConstantValue(type)->data();
+		std::memcpy(data, &value, type.size());
+	}
+	mod.build();
+
+	std::vector<size_t> offsets;
+	offsets.reserve(constants);
+	for (const auto& p : mod.content.elements())
+		offsets.push_back(p.second.offset());
+
+	uint64_t sink = 0;
+	double ns = measure_ns([&]() {
+		for (size_t i = 0; i < iterations; ++i)
+			for (const size_t offset : offsets)
+				sink += static_cast<uint8_t>(mod.fastConstantAccessor[offset]);
+	});
+	volatile uint64_t result = sink;
+	(void) result;
+
+	return { "constant_loads/" + std::to_string(constants) + "/" + std::to_string(distinct) + " (" + std::to_string(mod.content.poolSize()) + " B pool)",
+		iterations, constants * iterations, ns };
+}
+
+ksp::bench::Result ksp::bench::name_lookup(const size_t names, const bool frozen, const bool atoms, const size_t iterations)
+{
+	module_info::NameTable table;
+	std::vector<std::string> keys;
+	keys.reserve(names);
+	for (size_t i = 0; i < names; ++i)
+	{
+		keys.push_back("module.symbol_" + std::to_string(i));
+		table.createNewElement(keys.back()).createConstantValue(Type::Integer);
+	}
+	table.buildReferences();
+	std::shuffle(keys.begin(), keys.end(), std::mt19937_64{ 42 });
+	const std::vector<Atom> atomKeys(keys.begin(), keys.end());
+
+	size_t sink = 0;
+	double ns = measure_ns([&]() {
+		for (size_t i = 0; i < iterations; ++i)
+		{
+			if (atoms)
+			{
+				for (const Atom& key : atomKeys)
+					sink += frozen ? table.getElement(key).offset() : table.elements().find(key)->second.offset();
+			}
+			else
+			{
+				for (const std::string& key : keys)
+					sink += frozen ? table.getElement(key).offset() : table.elements().find(key)->second.offset();
+			}
+		}
+	});
+	volatile size_t result = sink;
+	(void) result;
+
+	return { std::string{ "name_lookup/" } + (frozen ? "frozen/" : "map/") + (atoms ? "atom/" : "string/") + std::to_string(names),
+		iterations, names * iterations, ns };
+}
+
+ksp::bench::Result ksp::bench::type_interning(const size_t distinct, const size_t iterations)
+{
+	const TypeInfo& pointer = TypeInfo::pointerOf(TypeInfo::Integer);
+	std::vector<Type> first;
+	for (size_t i = 0; i < distinct; ++i)
+		first.push_back(TypeInfo::arrayOf(pointer, i + 1));
+
+	size_t same = 0;
+	double ns = measure_ns([&]() {
+		for (size_t i = 0; i < iterations; ++i)
+			for (size_t j = 0; j < distinct; ++j)
+				same += Type{ TypeInfo::arrayOf(TypeInfo::pointerOf(TypeInfo::Integer), j + 1) } == first[j];
+	});
+	volatile size_t result = same;
+	(void) result;
+
+	return { "type_interning/" + std::to_string(distinct) + " (" + std::to_string(TypeInfo::internedCount()) + " canonical types)",
+		iterations, distinct * iterations, ns };
+}
+
+ksp::bench::Result ksp::bench::struct_fields(const StructLayout layout, const size_t rounds, const size_t iterations)
+{
+	namespace info = ksp::opcode::info;
+
+	/* Declared order pads every small field up to the Long after it. */
+	const TypeInfo& record = TypeInfo::structOf({
+		{ &TypeInfo::Byte, "tag" },
+		{ &TypeInfo::Long, "id" },
+		{ &TypeInfo::Short, "flags" },
+		{ &TypeInfo::Integer, "count" },
+		{ &TypeInfo::Byte, "state" },
+		{ &TypeInfo::Long, "total" }
+	}, layout);
+	const size_t fields = record.fields().size();
+
+	bytecode::BytecodeBuilder builder;
+	for (size_t i = 0; i < rounds; ++i)
+	{
+		for (size_t f = 0; f < fields; ++f)
+		{
+			builder.push_instruction(info::LDF, { 2, 0, f });
+			builder.push_instruction(info::STF, { 1, 2, f });
+		}
+		builder.push_instruction(info::ACOPY, { 0, 1 });
+	}
+	builder.push_instruction(info::HALT, { 4 });
+
+	module_info::Function function;
+	function.addVariable(Type{ record }, "src");
+	function.addVariable(Type{ record }, "dst");
+	function.addVariable(Type::Long, "value");
+	function.addVariable(Type::Integer, "value_hi");
+	function.addVariable(Type::Integer, "r");
+	function.addOpcodes(builder.build());
+	function.build();
+
+	KSP_State state;
+	double ns = run_function<policy::Release>(state, function, iterations);
+
+	return { std::string{ "struct_fields/" } + (layout == StructLayout::Declared ? "declared" : "minimal_padding")
+		+ " (" + std::to_string(record.size()) + " bytes, " + std::to_string(record.padding()) + " padding)",
+		iterations, rounds * fields * 2 * iterations, ns };
+}
+
+ksp::bench::Result ksp::bench::opcode_dispatch(const opcode_t op, const size_t instructions, const size_t iterations)
+{
+	namespace info = ksp::opcode::info;
+
+	const std::string name = "opcode_dispatch/" + info::find(op)->name();
+
+	/* Small arrays and structs, so that the bulk opcodes weigh their dispatch more than their loops. */
+	const TypeInfo& array = TypeInfo::arrayOf(TypeInfo::Integer, 4);
+	const TypeInfo& record = TypeInfo::structOf({ { &TypeInfo::Integer, "count" }, { &TypeInfo::Long, "total" } });
+
+	bytecode::BytecodeBuilder builder;
+	const size_t count = op == opcode::HALT ? 0 : instructions;
+	for (size_t i = 0; i < count; ++i)
+	{
+		switch (op)
+		{
+			case opcode::NOP: builder.push_instruction(info::NOP, {}); break;
+			case opcode::PUTB: builder.push_instruction(info::PUTB, { 0, i & 0xff }); break;
+			case opcode::PUTW: builder.push_instruction(info::PUTW, { 0, i & 0xffff }); break;
+			case opcode::PUTL: builder.push_instruction(info::PUTL, { 0, i }); break;
+			case opcode::PUTQ: builder.push_instruction(info::PUTQ, { 0, i * 0x9e3779b97f4a7c15ULL }); break;
+			case opcode::MOVB: builder.push_instruction(info::MOVB, { 0, 2 }); break;
+			case opcode::MOVW: builder.push_instruction(info::MOVW, { 0, 2 }); break;
+			case opcode::MOVL: builder.push_instruction(info::MOVL, { 0, 2 }); break;
+			case opcode::MOVQ: builder.push_instruction(info::MOVQ, { 0, 2 }); break;
+			case opcode::ACOPY: builder.push_instruction(info::ACOPY, { 4, 5 }); break;
+			case opcode::AFILL: builder.push_instruction(info::AFILL, { 4, 0 }); break;
+			case opcode::ACMP: builder.push_instruction(info::ACMP, { 0, 4, 5 }); break;
+			case opcode::AADD: builder.push_instruction(info::AADD, { 4, 5, 6 }); break;
+			case opcode::AMUL: builder.push_instruction(info::AMUL, { 4, 5, 6 }); break;
+			case opcode::AMIN: builder.push_instruction(info::AMIN, { 4, 5, 6 }); break;
+			case opcode::AMAX: builder.push_instruction(info::AMAX, { 4, 5, 6 }); break;
+			case opcode::LDF: builder.push_instruction(info::LDF, { 0, 7, 1 }); break;
+			case opcode::STF: builder.push_instruction(info::STF, { 7, 0, 1 }); break;
+			case opcode::PUTMOVB: builder.push_instruction(info::PUTMOVB, { 0, 2, i & 0xff }); break;
+			case opcode::PUTMOVW: builder.push_instruction(info::PUTMOVW, { 0, 2, i & 0xffff }); break;
+			case opcode::PUTMOVL: builder.push_instruction(info::PUTMOVL, { 0, 2, i }); break;
+			case opcode::PUTMOVQ: builder.push_instruction(info::PUTMOVQ, { 0, 2, i * 0x9e3779b97f4a7c15ULL }); break;
+			default: return { name, 0, 0, 0 };
+		}
+	}
+	builder.push_instruction(info::HALT, { 0 });
+
+	module_info::Function function;
+	function.addVariable(Type::Long, "a");
+	function.addVariable(Type::Integer, "a_hi");
+	function.addVariable(Type::Long, "b");
+	function.addVariable(Type::Integer, "b_hi");
+	function.addVariable(Type{ array }, "x");
+	function.addVariable(Type{ array }, "y");
+	function.addVariable(Type{ array }, "z");
+	function.addVariable(Type{ record }, "s");
+	function.addOpcodes(builder.build());
+	function.build();
+
+	KSP_State state;
+	double ns = run_function<policy::Release>(state, function, iterations);
+
+	return { name, iterations, (count > 0 ? count : 1) * iterations, ns };
+}
+
+ksp::bench::Result ksp::bench::runtime_state_construction(const size_t iterations)
+{
+	uintptr_t sink = 0;
+	double ns = measure_ns([&]() {
+		for (size_t i = 0; i < iterations; ++i)
+		{
+			RuntimeState runtime;
+			sink ^= reinterpret_cast<uintptr_t>(runtime.data);
+		}
+	});
+	volatile uintptr_t result = sink;
+	(void) result;
+
+	return { "runtime_state_construction", iterations, iterations, ns };
+}
+
+ksp::bench::Result ksp::bench::call_info_push(const size_t depth, const uint8_t registers, const size_t iterations)
+{
+	RuntimeState runtime;
+	size_t sink = 0;
+	double ns = measure_ns([&]() {
+		for (size_t i = 0; i < iterations; ++i)
+		{
+			for (size_t d = 0; d < depth; ++d)
+				runtime.push_call_info(registers, 0);
+			sink += static_cast<size_t>(runtime.ci - runtime.calls_base);
+			runtime.reset();
+		}
+	});
+	volatile size_t result = sink;
+	(void) result;
+
+	return { "call_info_push/" + std::to_string(depth) + "x" + std::to_string(registers) + " registers", iterations, depth * iterations, ns };
+}
+
+ksp::bench::Result ksp::bench::type_equality(const size_t types, const bool interned, const size_t iterations)
+{
+	std::vector<const TypeInfo*> canonical;
+	for (size_t i = 0; i < types; ++i)
+	{
+		canonical.push_back(&TypeInfo::structOf({
+			{ &TypeInfo::Integer, "id" },
+			{ &TypeInfo::arrayOf(TypeInfo::pointerOf(TypeInfo::Long), i + 1), "items" },
+			{ &TypeInfo::Byte, "tag" }
+		}));
+	}
+
+	/* Interned, both sides are the canonical instance; otherwise each side is a copy of its own. */
+	std::vector<TypeInfo> left, right;
+	if (!interned)
+	{
+		for (const TypeInfo* type : canonical)
+		{
+			left.push_back(*type);
+			right.push_back(*type);
+		}
+	}
+
+	size_t same = 0;
+	double ns = measure_ns([&]() {
+		for (size_t i = 0; i < iterations; ++i)
+		{
+			for (size_t t = 0; t < types; ++t)
+				same += interned ? *canonical[t] == *canonical[t] : left[t] == right[t];
+		}
+	});
+	volatile size_t result = same;
+	(void) result;
+
+	return { std::string{ "type_equality/" } + (interned ? "interned/" : "copies/") + std::to_string(types), iterations, types * iterations, ns };
+}
+
+std::vector<ksp::bench::Case> ksp::bench::micro_cases()
+{
+	std::vector<Case> cases;
+	for (size_t op = 0; op < opcode::count; ++op)
+	{
+		switch (op)
+		{
+			case opcode::YIELD:
+			case opcode::CALL:
+			case opcode::TAILCALL:
+			case opcode::RET:
+				continue;
+		}
+		const opcode_t code = static_cast<opcode_t>(op);
+		const size_t instructions = code == opcode::HALT ? 1 : 1000;
+		cases.push_back({ "opcode_dispatch/" + opcode::info::find(code)->name(),
+			[code, instructions]() { return opcode_dispatch(code, instructions, 2000000 / instructions); } });
+	}
+	cases.push_back({ "opcode_dispatch/YIELD", []() { return yield_resume(100, 2000); } });
+	cases.push_back({ "opcode_dispatch/CALL+RET", []() { return call_return(1000, 2000, false); } });
+	cases.push_back({ "opcode_dispatch/TAILCALL", []() { return tail_call_chain(1000, 200); } });
+
+	cases.push_back({ "runtime_state_construction", []() { return runtime_state_construction(2000); } });
+	cases.push_back({ "call_info_push", []() { return call_info_push(64, 16, 20000); } });
+
+	for (const size_t names : { 1000, 100000 })
+	{
+		cases.push_back({ "name_lookup/string/" + std::to_string(names), [names]() { return name_lookup(names, true, false, 1000000 / names); } });
+		cases.push_back({ "name_lookup/atom/" + std::to_string(names), [names]() { return name_lookup(names, true, true, 1000000 / names); } });
+	}
+
+	cases.push_back({ "type_equality/interned", []() { return type_equality(64, true, 20000); } });
+	cases.push_back({ "type_equality/copies", []() { return type_equality(64, false, 20000); } });
+	return cases;
+}
+
+void ksp::bench::print(std::ostream& os, const Result& result)
+{
+	os << result.name
+		<< ": " << result.iterations << " iterations, "
+		<< result.operations << " ops, "
+		<< (result.total_ns / 1e6) << " ms, "
+		<< result.ns_per_op() << " ns/op" << std::endl;
+}
+
+void ksp::bench::write_json(std::ostream& os, const std::vector<Result>& results)
+{
+	auto quoted = [](const std::string& text) {
+		std::string out{ "\"" };
+		for (const char c : text)
+		{
+			if (c == '"' || c == '\\')
+				out += '\\';
+			out += c;
+		}
+		return out + "\"";
+	};
+
+	os << "{" << std::endl;
+	os << "\t\"engine\": " << quoted(dispatch_engine_name()) << "," << std::endl;
+	os << "\t\"results\": [" << std::endl;
+	for (size_t i = 0; i < results.size(); ++i)
+	{
+		const Result& result = results[i];
+		os << "\t\t{ \"name\": " << quoted(result.name)
+			<< ", \"iterations\": " << result.iterations
+			<< ", \"operations\": " << result.operations
+			<< ", \"total_ns\": " << result.total_ns
+			<< ", \"ns_per_op\": " << result.ns_per_op()
+			<< " }" << (i + 1 < results.size() ? "," : "") << std::endl;
+	}
+	os << "\t]" << std::endl;
+	os << "}" << std::endl;
+}
+
+int ksp::bench::run_all(std::ostream& os)
+{
+	print(os, dispatch_put_mov(1000, 20000));
+	print(os, dispatch_put_mov(100000, 200));
+	print(os, dispatch_put_mov_pairs(500, 20000));
+	print(os, profile_put_mov(1000, 2000, false, nullptr));
+	print(os, profile_put_mov(1000, 2000, true, &os));
+	print(os, short_script_state(20, 20000, false));
+	print(os, short_script_state(20, 20000, true));
+	print(os, yield_resume(100, 2000));
+	print(os, array_add(4096, 20000));
+	print(os, call_return(1000, 2000, false));
+	print(os, call_return(1000, 2000, true));
+	print(os, tail_call_chain(100000, 20));
+	print(os, aot_execute(false, 20000));
+	print(os, aot_execute(true, 20000));
+	print(os, constant_loads(100000, 100000, 200));
+	print(os, constant_loads(100000, 100, 200));
+	for (const size_t names : { 1000, 100000, 1000000 })
+	{
+		print(os, name_lookup(names, false, false, 1000000 / names));
+		print(os, name_lookup(names, true, false, 1000000 / names));
+		print(os, name_lookup(names, true, true, 1000000 / names));
+	}
+	print(os, type_interning(1000, 1000));
+	print(os, struct_fields(StructLayout::Declared, 100, 20000));
+	print(os, struct_fields(StructLayout::MinimalPadding, 100, 20000));
+	print(os, module_cold_start(1000, false, 20));
+	print(os, module_cold_start(1000, true, 20));
+	print(os, module_cold_start(100000, false, 2));
+	print(os, module_cold_start(100000, true, 2));
+	print(os, module_rebuild(10000, 10000, false, 10));
+	print(os, module_rebuild(10000, 10000, true, 10));
+	print(os, link_modules(256, 100, 1, 5));
+	print(os, link_modules(256, 100, std::thread::hardware_concurrency(), 5));
+	print(os, module_lazy_start(10000, false, 10));
+	print(os, module_lazy_start(10000, true, 10));
+	print(os, batch_rows(nullptr, 1000000, 64));
+	print(os, batch_rows("scalar", 1000000, 64));
+	print(os, batch_rows("avx2", 1000000, 64));
+	print(os, batch_rows("avx512", 1000000, 64));
+
+	const size_t cores = std::thread::hardware_concurrency() > 0 ? std::thread::hardware_concurrency() : 1;
+	for (size_t workers = 1; ; workers *= 2)
+	{
+		print(os, executor_throughput(workers < cores ? workers : cores, 200000, 100));
+		if (workers >= cores)
+			break;
+	}
+
+	for (const size_t workers : { 1, 4, 16 })
+	{
+		print(os, scheduler_fibers(workers, false, 256, 64));
+		print(os, scheduler_fibers(workers, true, 256, 64));
+	}
+	return 0;
+}
@@ -0,0 +1,159 @@
+#pragma once
+
+#include "support.h"
+#include "bench_module.h"
+
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace ksp
+{
+	struct Module;
+	enum class StructLayout;
+
+	namespace bench
+	{
+		struct Result
+		{
+			std::string name;
+			size_t      iterations;
+			size_t      operations;
+			double      total_ns;
+
+			inline double ns_per_op() const { return operations > 0 ? total_ns / operations : 0; }
+		};
+
+		/* A benchmark to run later, named before it runs so that suites can be filtered. */
+		struct Case
+		{
+			std::string name;
+			std::function<Result()> run;
+		};
+
+		template<typename _Fn>
+		double measure_ns(_Fn&& fn)
+		{
+			auto start = std::chrono::steady_clock::now();
+			fn();
+			auto end = std::chrono::steady_clock::now();
+			return static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+		}
+
+		const char* dispatch_engine_name();
+
+		/* Runs a built Function of 'instructions' PUT/MOV opcodes 'iterations' times through ksp::execute. */
+		Result dispatch_put_mov(const size_t instructions, const size_t iterations);
+
+		/* dispatch_put_mov under policy::Profile; the opcode report is written to 'report' if given. */
+		Result profile_put_mov(const size_t instructions, const size_t iterations, const bool cycles, std::ostream* report);
+
+		/* Same as dispatch_put_mov over PUTL/MOVL pairs that bytecode::fuse turns into PUTMOVL; ops counts the unfused opcodes. */
+		Result dispatch_put_mov_pairs(const size_t pairs, const size_t iterations);
+
+		/* Invocations of a 'instructions' long PUT/MOV function through an Executor; ops counts invocations. */
+		Result executor_throughput(const size_t workers, const size_t invocations, const size_t instructions);
+
+		/* Short 'instructions' long executions, each on its own RuntimeState: a fresh one per call, or one leased from a RuntimeStatePool. */
+		Result short_script_state(const size_t instructions, const size_t iterations, const bool pooled);
+
+		/* A function YIELDing in a loop of 'yields' steps, resumed until it halts; ops counts resumes. */
+		Result yield_resume(const size_t yields, const size_t iterations);
+
+		/* 'fibers' fibers of a function YIELDing 'yields' times, run by a Scheduler; ops counts slices. */
+		Result scheduler_fibers(const size_t workers, const bool work_stealing, const size_t fibers, const size_t yields);
+
+		/* 'rows' rows of an 'instructions' long PUT/MOV function through batch::execute, or through one execute per row when 'isa' is null; ops counts rows. */
+		Result batch_rows(const char* isa, const size_t rows, const size_t instructions);
+
+		/* One AADD over arrays of 'count' Integer elements per call; ops counts elements. */
+		Result array_add(const size_t count, const size_t iterations);
+
+		/* A function CALLing a two parameter leaf 'calls' times; the leaf has a frame heap when 'heap', so its arguments are copied instead of overlapped. ops counts calls. */
+		Result call_return(const size_t calls, const size_t iterations, const bool heap);
+
+		/* A chain of 'depth' functions, each TAILCALLing the next; ops counts tail calls. */
+		Result tail_call_chain(const size_t depth, const size_t iterations);
+
+		/* Time until one function of a 'functions' function module can run: building the Module, or opening its ModuleImage; ops counts modules. */
+		Result module_cold_start(const size_t functions, const bool from_image, const size_t iterations);
+
+		/*
+		 * Builds a module of 'functions' PUT/MOV functions and 'constants' constants after one
+		 * constant was defined again and one function got one more opcode, incrementally, or builds the whole
+		 * module from scratch; ops counts builds.
+		 */
+		Result module_rebuild(const size_t functions, const size_t constants, const bool incremental, const size_t iterations);
+
+		/*
+		 * Links 'modules' modules of 'functions' PUT/MOV functions each, all importing from one
+		 * base module, with a Linker of 'workers' workers; ops counts modules.
+		 */
+		Result link_modules(const size_t modules, const size_t functions, const size_t workers, const size_t iterations);
+
+		/*
+		 * Builds a module of 'functions' PUT/MOV functions, eagerly or leaving stubs, and runs one
+		 * of them; ops counts modules. The name reports how many functions were built.
+		 */
+		Result module_lazy_start(const size_t functions, const bool lazy, const size_t iterations);
+
+		/* 'main' of build_aot_module through ksp::execute, interpreted or bound to its aot::emit translation; ops counts instructions. */
+		Result aot_execute(const bool aot, const size_t iterations);
+
+		/*
+		 * Loads every constant of a module of 'constants' Byte, Short, Integer and Long constants
+		 * holding 'distinct' values each, in name order; ops counts loads. The name reports the pool size.
+		 */
+		Result constant_loads(const size_t constants, const size_t distinct, const size_t iterations);
+
+		/*
+		 * Looks up every name of a 'names' name table, in random order, through the frozen table
+		 * or the construction map, by string or by interned Atom; ops counts lookups.
+		 */
+		Result name_lookup(const size_t names, const bool frozen, const bool atoms, const size_t iterations);
+
+		/*
+		 * Creates the types 'distinct' arrays of pointers to Integer, over and over, the way
+		 * a compiler meets the same types again; ops counts arrayOf calls, each also comparing its result.
+		 */
+		Result type_interning(const size_t distinct, const size_t iterations);
+
+		/*
+		 * Copies every field of a six field struct laid out by 'layout' into a second struct
+		 * with LDF and STF, then the whole struct back with ACOPY, 'rounds' times per execution;
+		 * ops counts field loads and stores. The name reports the struct size and padding.
+		 */
+		Result struct_fields(const StructLayout layout, const size_t rounds, const size_t iterations);
+
+		/*
+		 * Runs a function of 'instructions' copies of 'op' through ksp::execute; ops counts opcodes.
+		 * HALT runs alone, so it measures one execute. YIELD, CALL, TAILCALL and RET change frames
+		 * and are measured by yield_resume, call_return and tail_call_chain: they report no ops.
+		 */
+		Result opcode_dispatch(const opcode_t op, const size_t instructions, const size_t iterations);
+
+		/* Constructs and destroys a default RuntimeState, reserving and releasing its stacks; ops counts states. */
+		Result runtime_state_construction(const size_t iterations);
+
+		/* Pushes 'depth' frames of 'registers' registers on one RuntimeState, then resets it; ops counts pushes. */
+		Result call_info_push(const size_t depth, const uint8_t registers, const size_t iterations);
+
+		/*
+		 * Compares 'types' pairs of equal struct types: canonical instances, equal by address, or
+		 * copies of them, compared member by member; ops counts comparisons.
+		 */
+		Result type_equality(const size_t types, const bool interned, const size_t iterations);
+
+		/* The VM microbenchmarks: every opcode, RuntimeState, frames, name lookups and type equality. */
+		std::vector<Case> micro_cases();
+
+		void print(std::ostream& os, const Result& result);
+
+		/* Writes 'results' as one JSON document, one result per line, to compare runs of different builds. */
+		void write_json(std::ostream& os, const std::vector<Result>& results);
+
+		int run_all(std::ostream& os);
+	}
+}
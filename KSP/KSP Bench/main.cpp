@@ -0,0 +1,219 @@
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "bench.h"
+
+extern "C"
+{
+#include "support/buffer.h"
+#include "support/map.h"
+}
+
+/*
+ * Microbenchmarks of the VM and of the KSP Core support library.
+ *
+ *   ksp_bench [--json] [--filter <text>] [--repeat <n>] [--baseline <file>]
+ *   ksp_bench --all
+ *
+ * --all runs the whole suite of ksp::bench::run_all, with its larger sizes, as text.
+ * --json writes the results as JSON instead of text; --filter runs only the benchmarks whose
+ * name contains <text>; --repeat runs each one <n> times (3 by default) and keeps the fastest
+ * run; --baseline compares each result with the one of the same name in a JSON file written
+ * before, by another build.
+ */
+
+namespace
+{
+	using ksp::bench::Case;
+	using ksp::bench::Result;
+	using ksp::bench::measure_ns;
+
+	std::vector<std::string> map_keys(const size_t keys)
+	{
+		std::vector<std::string> names;
+		names.reserve(keys);
+		for (size_t i = 0; i < keys; ++i)
+			names.push_back("module.symbol_" + std::to_string(i));
+		return names;
+	}
+
+	/* Looks up every key of a 'keys' key Map, in random order; ops counts lookups. */
+	Result map_lookup(const size_t keys, const size_t iterations)
+	{
+		std::vector<std::string> names = map_keys(keys);
+		Map* map = map_new();
+		for (size_t i = 0; i < keys; ++i)
+			map_put(map, names[i].c_str(), &names[i]);
+		std::shuffle(names.begin(), names.end(), std::mt19937_64{ 42 });
+
+		size_t found = 0;
+		double ns = measure_ns([&]() {
+			for (size_t i = 0; i < iterations; ++i)
+				for (const std::string& name : names)
+					found += map_get(map, name.c_str()) != nullptr;
+		});
+		volatile size_t result = found;
+		(void) result;
+		map_free(map);
+
+		return { "map_get/" + std::to_string(keys), iterations, keys * iterations, ns };
+	}
+
+	/* Fills an empty Map with 'keys' keys, rehashing as it grows; ops counts insertions. */
+	Result map_insert(const size_t keys, const size_t iterations)
+	{
+		const std::vector<std::string> names = map_keys(keys);
+
+		double ns = 0;
+		for (size_t i = 0; i < iterations; ++i)
+		{
+			Map* map = map_new();
+			ns += measure_ns([&]() {
+				for (const std::string& name : names)
+					map_put(map, name.c_str(), map);
+			});
+			map_free(map);
+		}
+
+		return { "map_put/" + std::to_string(keys), iterations, keys * iterations, ns };
+	}
+
+	/* Appends 'chunk' byte pieces to an empty Buffer until it holds 'bytes' bytes; ops counts appends. */
+	Result buffer_appends(const size_t chunk, const size_t bytes, const size_t iterations)
+	{
+		const std::string piece(chunk, 'k');
+
+		double ns = 0;
+		for (size_t i = 0; i < iterations; ++i)
+		{
+			Buffer buffer;
+			buffer_init(&buffer);
+			ns += measure_ns([&]() {
+				for (size_t len = 0; len < bytes; len += chunk)
+					buffer_append(&buffer, piece.data(), chunk);
+			});
+			std::free(buffer.data);
+		}
+
+		return { "buffer_append/" + std::to_string(chunk) + " bytes", iterations, (bytes + chunk - 1) / chunk * iterations, ns };
+	}
+
+	std::vector<Case> core_cases()
+	{
+		return {
+			{ "map_get/1000", []() { return map_lookup(1000, 1000); } },
+			{ "map_get/100000", []() { return map_lookup(100000, 10); } },
+			{ "map_put/1000", []() { return map_insert(1000, 1000); } },
+			{ "map_put/100000", []() { return map_insert(100000, 10); } },
+			{ "buffer_append/1", []() { return buffer_appends(1, 1 << 20, 20); } },
+			{ "buffer_append/64", []() { return buffer_appends(64, 1 << 20, 200); } },
+			{ "buffer_append/4096", []() { return buffer_appends(4096, 1 << 20, 200); } }
+		};
+	}
+
+	/* The ns_per_op of every result of a file written by --json, by name. */
+	bool read_baseline(const std::string& path, std::map<std::string, double>& baseline)
+	{
+		std::ifstream in{ path };
+		if (!in)
+			return false;
+
+		static const std::string name_key = "\"name\": \"";
+		static const std::string ns_key = "\"ns_per_op\": ";
+		std::string line;
+		while (std::getline(in, line))
+		{
+			size_t at = line.find(name_key);
+			const size_t ns_at = line.find(ns_key);
+			if (at == std::string::npos || ns_at == std::string::npos)
+				continue;
+
+			std::string name;
+			for (at += name_key.size(); at < line.size() && line[at] != '"'; ++at)
+			{
+				if (line[at] == '\\' && at + 1 < line.size())
+					++at;
+				name += line[at];
+			}
+			baseline[name] = std::strtod(line.c_str() + ns_at + ns_key.size(), nullptr);
+		}
+		return true;
+	}
+
+	int usage()
+	{
+		std::cerr << "usage: ksp_bench [--json] [--filter <text>] [--repeat <n>] [--baseline <file>] | --all" << std::endl;
+		return 2;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	bool json = false;
+	std::string filter;
+	size_t repeat = 3;
+	std::string baseline_path;
+	for (int i = 1; i < argc; ++i)
+	{
+		const std::string arg = argv[i];
+		if (arg == "--all" && argc == 2)
+			return ksp::bench::run_all(std::cout);
+		else if (arg == "--json")
+			json = true;
+		else if (arg == "--filter" && i + 1 < argc)
+			filter = argv[++i];
+		else if (arg == "--repeat" && i + 1 < argc && std::atoi(argv[i + 1]) > 0)
+			repeat = static_cast<size_t>(std::atoi(argv[++i]));
+		else if (arg == "--baseline" && i + 1 < argc)
+			baseline_path = argv[++i];
+		else
+			return usage();
+	}
+
+	std::map<std::string, double> baseline;
+	if (!baseline_path.empty() && !read_baseline(baseline_path, baseline))
+	{
+		std::cerr << "ksp_bench: can not read " << baseline_path << std::endl;
+		return 1;
+	}
+
+	std::vector<Case> cases = ksp::bench::micro_cases();
+	for (Case& c : core_cases())
+		cases.push_back(std::move(c));
+
+	std::vector<Result> results;
+	for (const Case& c : cases)
+	{
+		if (!filter.empty() && c.name.find(filter) == std::string::npos)
+			continue;
+
+		Result best = c.run();
+		for (size_t r = 1; r < repeat; ++r)
+		{
+			Result next = c.run();
+			if (next.total_ns < best.total_ns)
+				best = next;
+		}
+		results.push_back(best);
+		if (json)
+			continue;
+
+		ksp::bench::print(std::cout, results.back());
+		auto before = baseline.find(results.back().name);
+		if (before != baseline.end() && before->second > 0)
+		{
+			const double change = (results.back().ns_per_op() / before->second - 1) * 100;
+			std::cout << "    baseline " << before->second << " ns/op, " << (change >= 0 ? "+" : "") << change << "%" << std::endl;
+		}
+	}
+
+	if (json)
+		ksp::bench::write_json(std::cout, results);
+	return 0;
+}
@@ -0,0 +1,123 @@
+#include "checks.h"
+
+#include "aot.h"
+#include "module_spec.h"
+#include "ops.h"
+
+/* Generated into checks_aot.cpp at build time: the aot::emit translation of build_aot_module. */
+bool ksp_checks_aot_bind(ksp::Module& module);
+
+namespace
+{
+	/* The fingerprint of one code over an array and a struct variable, which only their layout tells apart. */
+	uint64_t layout_fingerprint(const ksp::TypeInfo& array, const ksp::TypeInfo& record)
+	{
+		namespace info = ksp::opcode::info;
+
+		ksp::module_info::Function function;
+		function.addVariable(ksp::Type{ array }, "a");
+		function.addVariable(ksp::Type{ record }, "s");
+		function.addVariable(ksp::Type::Integer, "v");
+
+		ksp::bytecode::BytecodeBuilder builder;
+		builder.push_instruction(info::AFILL, { 0, 2 });
+		builder.push_instruction(info::ACMP, { 2, 0, 0 });
+		builder.push_instruction(info::LDF, { 2, 1, 1 });
+		builder.push_instruction(info::STF, { 1, 2, 0 });
+		builder.push_instruction(info::RET, { 2 });
+		function.addOpcodes(builder.build());
+		function.build();
+		return ksp::aot::fingerprint(function);
+	}
+}
+
+size_t ksp::checks::aot(std::ostream& log)
+{
+	Module translated;
+	build_aot_module(translated);
+	if (!ksp_checks_aot_bind(translated))
+	{
+		log << "aot: checks_aot.cpp does not match build_aot_module" << std::endl;
+		return 1;
+	}
+	Module interpreted;
+	build_aot_module(interpreted);
+
+	/* Translated exactly where aot::compilable says so, and with the calls the translation has to get right. */
+	size_t failures = 0;
+	bool translated_calls = false;
+	bool tail_call_to_interpreted = false;
+	const size_t count = translated.content.functionCount();
+	for (size_t i = 0; i < count; ++i)
+	{
+		const module_info::Function& f = *translated.fastFunctionAccessor[i];
+		if ((f.fastAotCode != nullptr) != ksp::aot::compilable(translated, f))
+		{
+			log << "aot: function " << i << (f.fastAotCode ? " is" : " is not") << " translated against aot::compilable" << std::endl;
+			++failures;
+		}
+		for (const bytecode::Instruction* pc = f.fastInstructionAccessor; ; ++pc)
+		{
+			if (pc->op == opcode::CALL || pc->op == opcode::TAILCALL)
+			{
+				const bool callee_translated = translated.fastFunctionAccessor[pc->k]->fastAotCode != nullptr;
+				translated_calls |= f.fastAotCode && callee_translated;
+				tail_call_to_interpreted |= pc->op == opcode::TAILCALL && !callee_translated;
+			}
+			if (pc->op == opcode::HALT || pc->op == opcode::RET || pc->op == opcode::TAILCALL)
+				break;
+		}
+	}
+	if (!translated_calls || !tail_call_to_interpreted)
+	{
+		log << "aot: the module lacks calls between translated functions or TAILCALLs to interpreted ones" << std::endl;
+		++failures;
+	}
+
+	/*
+	 * The same code on the same frame size, with the array shorter or of another kind, or the
+	 * struct fields in another order, would make translated code read the wrong bytes.
+	 */
+	const std::vector<TypeInfo::FunctionParameter> fields = {
+		{ &TypeInfo::Byte, "tag" },
+		{ &TypeInfo::Short, "flags" },
+		{ &TypeInfo::Integer, "count" }
+	};
+	const TypeInfo& declared = TypeInfo::structOf(fields);
+	const uint64_t fingerprints[] = {
+		layout_fingerprint(TypeInfo::arrayOf(TypeInfo::Byte, 8), declared),
+		layout_fingerprint(TypeInfo::arrayOf(TypeInfo::Byte, 7), declared),
+		layout_fingerprint(TypeInfo::arrayOf(TypeInfo::UByte, 8), declared),
+		layout_fingerprint(TypeInfo::arrayOf(TypeInfo::Byte, 8), TypeInfo::structOf(fields, StructLayout::MinimalPadding))
+	};
+	for (size_t i = 1; i < sizeof(fingerprints) / sizeof(*fingerprints); ++i)
+	{
+		if (fingerprints[i] == fingerprints[0])
+		{
+			log << "aot: layout " << i << " has the fingerprint of layout 0" << std::endl;
+			++failures;
+		}
+	}
+
+	KSP_State ksp_state;
+	RuntimeState state;
+	for (size_t i = 0; i < count; ++i)
+	{
+		const std::string name = "f" + std::to_string(i);
+		const std::vector<reg_t> expected = run_to_end(ksp_state, interpreted, state, *interpreted.content.getElement(name).getFunction());
+		try
+		{
+			const std::vector<reg_t> actual = run_to_end(ksp_state, translated, state, *translated.content.getElement(name).getFunction());
+			if (actual == expected)
+				continue;
+			log << "aot: " << name << " returns " << actual.back() << " after " << (actual.size() - 1) << " YIELDs, interpreted "
+				<< expected.back() << " after " << (expected.size() - 1) << std::endl;
+		}
+		catch (const InvalidExecutionState&)
+		{
+			log << "aot: " << name << " could not YIELD" << std::endl;
+		}
+		++failures;
+	}
+	return failures;
+}
@@ -0,0 +1,108 @@
+#include "checks.h"
+
+#include <cstring>
+#include <random>
+
+#include "arrays.h"
+
+namespace
+{
+	using ksp::TypeKind;
+
+	const TypeKind __element_kinds[] = {
+		TypeKind::Byte, TypeKind::Short, TypeKind::Integer, TypeKind::Long,
+		TypeKind::UByte, TypeKind::UShort, TypeKind::UInteger, TypeKind::ULong,
+		TypeKind::Float, TypeKind::Double,
+		TypeKind::Boolean, TypeKind::Character, TypeKind::Pointer
+	};
+
+	/* Random elements; floating point ones are small multiples of 1/4, so no NaN or -0 makes the kernels legitimately differ. */
+	void random_elements(std::mt19937_64& gen, const TypeKind kind, std::vector<uint8_t>& bytes, const size_t count)
+	{
+		const size_t size = ksp::arrays::element_size(kind);
+		bytes.resize(count * size);
+		for (size_t i = 0; i < count; ++i)
+		{
+			const uint64_t bits = gen();
+			if (kind == TypeKind::Float)
+			{
+				const float value = static_cast<float>(static_cast<int>(bits % 2001) - 1000) * 0.25f;
+				std::memcpy(&bytes[i * size], &value, size);
+			}
+			else if (kind == TypeKind::Double)
+			{
+				const double value = static_cast<double>(static_cast<int>(bits % 2001) - 1000) * 0.25;
+				std::memcpy(&bytes[i * size], &value, size);
+			}
+			else std::memcpy(&bytes[i * size], &bits, size);
+		}
+	}
+}
+
+size_t ksp::checks::arrays(const size_t rounds, std::ostream& log, const uint32_t seed)
+{
+	using ksp::arrays::Operation;
+
+	if (!ksp::arrays::simd())
+		return 0;
+
+	static const Operation operations[] = { Operation::Add, Operation::Mul, Operation::Min, Operation::Max };
+	static const char* const names[] = { "add", "mul", "min", "max" };
+
+	std::mt19937_64 gen{ seed };
+	size_t failures = 0;
+	std::vector<uint8_t> a, b, expected, actual;
+	for (size_t round = 0; round < rounds; ++round)
+	{
+		for (const TypeKind kind : __element_kinds)
+		{
+			const size_t size = ksp::arrays::element_size(kind);
+
+			/* Lengths around the vector width and up to several vectors, so that tails are covered too. */
+			const size_t count = gen() % 300;
+			random_elements(gen, kind, a, count);
+			random_elements(gen, kind, b, count);
+			const std::string where = "arrays: kind " + std::to_string(static_cast<int>(kind)) + ", " + std::to_string(count) + " elements";
+
+			for (size_t op = 0; op < sizeof(operations) / sizeof(*operations) && ksp::arrays::arithmetic(kind); ++op)
+			{
+				expected.assign(a.size(), 0);
+				actual.assign(a.size(), 0);
+				ksp::arrays::scalar::binary(operations[op], kind, expected.data(), a.data(), b.data(), count);
+				ksp::arrays::binary(operations[op], kind, actual.data(), a.data(), b.data(), count);
+				if (expected != actual)
+				{
+					log << where << ": " << names[op] << " differs from the scalar kernel" << std::endl;
+					++failures;
+				}
+			}
+
+			/* Equal up to a random element, which the comparison has to find. */
+			b = a;
+			if (count > 0)
+			{
+				random_elements(gen, kind, actual, 1);
+				std::memcpy(&b[(gen() % count) * size], actual.data(), size);
+			}
+			const int want = ksp::arrays::scalar::compare(kind, a.data(), b.data(), count);
+			const int got = ksp::arrays::compare(kind, a.data(), b.data(), count);
+			if (want != got)
+			{
+				log << where << ": compare " << got << ", scalar kernel " << want << std::endl;
+				++failures;
+			}
+
+			const uint64_t value = gen();
+			expected.assign(a.size(), 0);
+			actual.assign(a.size(), 0);
+			ksp::arrays::scalar::fill(kind, expected.data(), value, count);
+			ksp::arrays::fill(kind, actual.data(), value, count);
+			if (expected != actual)
+			{
+				log << where << ": fill differs from the scalar kernel" << std::endl;
+				++failures;
+			}
+		}
+	}
+	return failures;
+}
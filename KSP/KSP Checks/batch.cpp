@@ -0,0 +1,103 @@
+#include "checks.h"
+
+#include <random>
+
+#include "batch.h"
+#include "ops.h"
+#include "runtime.h"
+#include "vm.h"
+
+namespace
+{
+	using ksp::reg_t;
+
+	/* Room for every register a random program can name, plus the high half of a quad in the last one. */
+	constexpr size_t __check_regs = 257;
+
+	/* One row through the interpreter, on a frame holding the row inputs and zeros elsewhere, as batch rows start. */
+	reg_t interpret_row(ksp::RuntimeState& state, const ksp::module_info::Function& function, const std::vector<std::vector<reg_t>>& inputs, const size_t row)
+	{
+		state.push_call_info(function.fastRegisterCount, function.fastExtraStackSize);
+		state.ci->arrays = function.fastArrayOperandAccessor;
+		for (size_t i = 0; i < __check_regs; ++i)
+			state.ci->regs_base[i] = i < inputs.size() ? inputs[i][row] : 0;
+		state.pc = function.fastInstructionAccessor;
+
+		ksp::KSP_State ksp_state;
+		ksp::Module module;
+		const reg_t result = ksp::interpret(&ksp_state, &module, state);
+		state.reset();
+		return result;
+	}
+}
+
+size_t ksp::checks::batch(const size_t programs, const size_t length, const size_t rows, std::ostream& log, const uint32_t seed)
+{
+	namespace info = ksp::opcode::info;
+	using ksp::batch::Isa;
+
+	static const OpcodeInfo* const ops[] = {
+		&info::NOP,
+		&info::PUTB, &info::PUTW, &info::PUTL, &info::PUTQ,
+		&info::MOVB, &info::MOVW, &info::MOVL, &info::MOVQ,
+		&info::PUTMOVB, &info::PUTMOVW, &info::PUTMOVL, &info::PUTMOVQ
+	};
+	static const Isa isas[] = { Isa::Scalar, Isa::AVX2, Isa::AVX512 };
+
+	std::mt19937_64 gen{ seed };
+	size_t failures = 0;
+	for (size_t p = 0; p < programs; ++p)
+	{
+		/* Few registers, so that PUT/MOV pairs also go through bytecode::fuse and inputs get overwritten. */
+		const uint64_t regs = 1 + gen() % 16;
+
+		bytecode::BytecodeBuilder builder;
+		for (size_t i = 0; i < length; ++i)
+		{
+			const OpcodeInfo& op = *ops[gen() % (sizeof(ops) / sizeof(*ops))];
+			std::vector<uint64_t> args;
+			for (size_t a = 0; a < op.args_count(); ++a)
+				args.push_back(op.arg(a).isRegister() ? gen() % regs : gen());
+			builder.push_instruction(op, args);
+		}
+		builder.push_instruction(info::HALT, { gen() % regs });
+
+		module_info::Function function;
+		function.addOpcodes(builder.build());
+		function.build();
+
+		std::vector<std::vector<reg_t>> inputs(static_cast<size_t>(gen() % (regs + 1)), std::vector<reg_t>(rows));
+		std::vector<const reg_t*> columns;
+		for (std::vector<reg_t>& column : inputs)
+		{
+			for (reg_t& value : column)
+				value = static_cast<reg_t>(gen());
+			columns.push_back(column.data());
+		}
+
+		RuntimeState state;
+		std::vector<reg_t> expected(rows);
+		for (size_t r = 0; r < rows; ++r)
+			expected[r] = interpret_row(state, function, inputs, r);
+
+		for (const Isa isa : isas)
+		{
+			if (!ksp::batch::isa_supported(isa))
+				continue;
+
+			std::vector<reg_t> actual(rows);
+			ksp::batch::execute(function, columns.data(), columns.size(), actual.data(), rows, isa);
+			for (size_t r = 0; r < rows; ++r)
+			{
+				if (actual[r] != expected[r])
+				{
+					log << "batch: program " << p << ", " << ksp::batch::isa_name(isa) << " row " << r << " = " << actual[r]
+						<< ", interpreter " << expected[r] << std::endl;
+					++failures;
+					break;
+				}
+			}
+		}
+	}
+	return failures;
+}
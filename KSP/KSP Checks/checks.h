@@ -0,0 +1,72 @@
+#pragma once
+
+#include "support.h"
+
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace ksp
+{
+	/*
+	 * Behavior checks of the VM. Each one runs a feature next to the slower path it stands in
+	 * for (the interpreter, the scalar kernels, the map, a full build...) over random inputs
+	 * drawn from 'seed', writes every mismatch to 'log' and returns their number.
+	 */
+	namespace checks
+	{
+		/* A check to run by name, as "ksp_checks <name>" or as the ctest test of that name. */
+		struct Check
+		{
+			std::string name;
+			std::function<size_t(std::ostream& log)> run;
+		};
+
+		std::vector<Check> all();
+
+		/*
+		 * Random PUT/MOV functions, interpreted and JIT compiled from the same registers; then random
+		 * modules of functions CALLing and TAILCALLing each other, called past __KSP_JIT_THRESHOLD,
+		 * against what they returned while interpreted.
+		 */
+		size_t jit(const size_t programs, const size_t length, const size_t modules, std::ostream& log, const uint32_t seed = 1);
+
+		/* Random PUT/MOV functions over random rows, with every supported Isa and with the interpreter row by row. */
+		size_t batch(const size_t programs, const size_t length, const size_t rows, std::ostream& log, const uint32_t seed = 1);
+
+		/* Every AVX2 array kernel against the scalar one of its kind on random arrays; 0 without AVX2. */
+		size_t arrays(const size_t rounds, std::ostream& log, const uint32_t seed = 1);
+
+		/*
+		 * Random modules written as images and mapped back, against the Module they were written from,
+		 * with the mapped functions also called past __KSP_JIT_THRESHOLD; then images with one record
+		 * field corrupted, which their lookups must reject.
+		 */
+		size_t image(const size_t modules, std::ostream& log, const uint32_t seed = 1);
+
+		/* Frozen NameTable lookups of random present and missing names, against the map of the table. */
+		size_t names(const size_t tables, std::ostream& log, const uint32_t seed = 1);
+
+		/* Random sets of Modules through the Linker, against the errors and attachments their names call for. */
+		size_t link(const size_t rounds, std::ostream& log, const uint32_t seed = 1);
+
+		/*
+		 * Random modules edited 'edits' times and built again incrementally after each edit, against
+		 * the same modules built from scratch.
+		 */
+		size_t rebuild(const size_t modules, const size_t edits, std::ostream& log, const uint32_t seed = 1);
+
+		/*
+		 * Random modules built lazily, some with a function that fails to materialize, against the same
+		 * modules built eagerly.
+		 */
+		size_t lazy(const size_t modules, std::ostream& log, const uint32_t seed = 1);
+
+		/*
+		 * The aot::emit translation of build_aot_module, bound to a fresh build, against the interpreter;
+		 * and aot::fingerprint of functions that only differ in the layout of their variables.
+		 */
+		size_t aot(std::ostream& log);
+	}
+}
@@ -0,0 +1,21 @@
+#include <fstream>
+
+#include "aot.h"
+#include "module_spec.h"
+
+/*
+ *   ksp_checks_emit <file>
+ *
+ * Writes the translation of build_aot_module; the CMake build of KSP Checks runs this.
+ */
+int main(int argc, char** argv)
+{
+	if (argc != 2)
+		return 2;
+
+	ksp::Module module;
+	ksp::checks::build_aot_module(module);
+	std::ofstream out{ argv[1] };
+	ksp::aot::emit(module, out, "ksp_checks_aot_bind");
+	return out ? 0 : 1;
+}
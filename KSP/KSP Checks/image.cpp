@@ -0,0 +1,299 @@
+#include "checks.h"
+
+#include <cstddef>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <random>
+
+#include "image.h"
+#include "module_spec.h"
+#include "ops.h"
+#include "runtime.h"
+#include "vm.h"
+
+namespace
+{
+	using ksp::module_info::Function;
+	using ksp::module_info::NameTable;
+
+	/*
+	 * 'functions' functions of four Integer registers, set to random values and then running
+	 * random PUT/MOV code, each CALLing only functions after it, and 'arr', which adds two Byte
+	 * arrays; plus a constant of every integer type and the Byte array type.
+	 */
+	void random_module(ksp::Module& module, std::mt19937_64& gen, const size_t functions)
+	{
+		namespace info = ksp::opcode::info;
+		using ksp::Type;
+		using ksp::TypeInfo;
+
+		NameTable& table = module.content;
+		const Type bytes = table.createNewElement("ByteArray").createTypeInfo(TypeInfo::arrayOf(TypeInfo::Byte, 1 + gen() % 100));
+
+		const Type constants[] = { Type::Byte, Type::Short, Type::Integer, Type::Long };
+		for (size_t i = 0; i < sizeof(constants) / sizeof(*constants); ++i)
+		{
+			const ksp::module_info::ConstantValue* value = table.createNewElement("c" + std::to_string(i)).createConstantValue(constants[i]);
+			const uint64_t bits = gen();
+			std::memcpy(value->data(), &bits, constants[i].size());
+		}
+
+		Function& arr = table.createNewElement("arr").createFunction();
+		arr.addVariable(bytes, "x");
+		arr.addVariable(bytes, "y");
+		arr.addVariable(Type::Byte, "v");
+		arr.addVariable(Type::Integer, "r");
+
+		std::vector<Function*> fns;
+		for (size_t i = 0; i < functions; ++i)
+		{
+			fns.push_back(&table.createNewElement("f" + std::to_string(i)).createFunction());
+			for (size_t r = 0; r < 4; ++r)
+				fns.back()->addVariable(Type::Integer, "r" + std::to_string(r));
+		}
+		table.buildReferences();
+
+		static const ksp::OpcodeInfo* const ops[] = {
+			&info::NOP, &info::PUTB, &info::PUTW, &info::PUTL, &info::MOVB, &info::MOVW, &info::MOVL
+		};
+		for (size_t i = 0; i < functions; ++i)
+		{
+			ksp::bytecode::BytecodeBuilder builder;
+			for (uint64_t r = 0; r < 4; ++r)
+				builder.push_instruction(info::PUTL, { r, gen() });
+			if (i == 0)
+				builder.push_instruction(info::CALL, { 3, table.getElement("arr").offset() });
+			for (size_t n = 0; n < 16; ++n)
+			{
+				if (i + 1 < functions && gen() % 8 == 0)
+				{
+					builder.push_instruction(info::CALL, { 2, table.getElement("f" + std::to_string(i + 1 + gen() % (functions - i - 1))).offset() });
+					continue;
+				}
+				const ksp::OpcodeInfo& op = *ops[gen() % (sizeof(ops) / sizeof(*ops))];
+				std::vector<uint64_t> args;
+				for (size_t a = 0; a < op.args_count(); ++a)
+					args.push_back(op.arg(a).isRegister() ? gen() % 4 : gen());
+				builder.push_instruction(op, args);
+			}
+			builder.push_instruction(info::RET, { gen() % 4 });
+			fns[i]->addOpcodes(builder.build());
+		}
+
+		ksp::bytecode::BytecodeBuilder builder;
+		builder.push_instruction(info::PUTB, { 2, gen() });
+		builder.push_instruction(info::AFILL, { 0, 2 });
+		builder.push_instruction(info::PUTB, { 2, gen() });
+		builder.push_instruction(info::AFILL, { 1, 2 });
+		builder.push_instruction(info::AADD, { 0, 0, 1 });
+		builder.push_instruction(info::ACMP, { 3, 0, 1 });
+		builder.push_instruction(info::RET, { 3 });
+		arr.addOpcodes(builder.build());
+
+		module.build();
+	}
+
+	/* One field of a valid image overwritten with 'value', and the lookup that must then throw InvalidModuleImage. */
+	struct Corruption
+	{
+		const char* what;
+		size_t at;
+		uint64_t value;
+		size_t width;
+		std::function<void(ksp::ModuleImage&)> lookup;
+	};
+
+	/* The corruptions of the fields that index a section or locate a range in one, for an image of random_module. */
+	std::vector<Corruption> corruptions(const std::string& path)
+	{
+		using namespace ksp::image;
+
+		ksp::ModuleImage image{ path };
+		const Header& header = image.header();
+		const char* const base = reinterpret_cast<const char*>(&header);
+		auto at = [base](const void* record, const size_t field) { return static_cast<size_t>(static_cast<const char*>(record) - base) + field; };
+
+		const NameRecord& f0_name = image.name("f0");
+		const FunctionRecord& f0 = image.functionRecord(f0_name.index);
+		const FunctionRecord& arr = image.functionRecord(image.name("arr").index);
+		const ConstantRecord& c0 = image.constantRecord(image.name("c0").index);
+
+		/* f0 starts with its CALL of arr after setting its registers. */
+		size_t call = 0;
+		const ksp::bytecode::Instruction* const code = reinterpret_cast<const ksp::bytecode::Instruction*>(base + f0.instructions);
+		for (size_t i = 0; i < f0.instruction_count; ++i)
+			if (code[i].op == ksp::opcode::CALL)
+			{
+				call = at(&code[i], offsetof(ksp::bytecode::Instruction, k));
+				break;
+			}
+
+		auto f0_lookup = [](ksp::ModuleImage& i) { i.function("f0"); };
+		auto arr_lookup = [](ksp::ModuleImage& i) { i.function("arr"); };
+		auto c0_lookup = [](ksp::ModuleImage& i) { i.constant("c0"); };
+		return {
+			{ "callee index", header.callees.offset + f0.callees_first * sizeof(uint32_t), 0xffffffffU, 4, f0_lookup },
+			{ "instruction offset", at(&f0, offsetof(FunctionRecord, instructions)), header.size, 8, f0_lookup },
+			{ "code size", at(&f0, offsetof(FunctionRecord, code_size)), 1ULL << 40, 8, f0_lookup },
+			{ "first variable", at(&f0, offsetof(FunctionRecord, variables_first)), 0xfffffff0U, 4, f0_lookup },
+			{ "instruction count", at(&f0, offsetof(FunctionRecord, instruction_count)), 1, 8, f0_lookup },
+			{ "called function", call, 0x7fffffffU, 8, f0_lookup },
+			{ "first array operand", at(&arr, offsetof(FunctionRecord, array_operands_first)), 1ULL << 40, 8, arr_lookup },
+			{ "frame heap size", at(&arr, offsetof(FunctionRecord, extra_stack_size)), 0, 8, arr_lookup },
+			{ "name offset", at(&f0_name, offsetof(NameRecord, name)), 0xfffffff0U, 4, [](ksp::ModuleImage& i) { i.hasName("f0"); } },
+			{ "constant data", at(&c0, offsetof(ConstantRecord, data)), 1ULL << 40, 8, c0_lookup },
+			{ "constant type", at(&c0, offsetof(ConstantRecord, type)), 0xfffffff0U, 4, c0_lookup }
+		};
+	}
+}
+
+size_t ksp::checks::image(const size_t modules, std::ostream& log, const uint32_t seed)
+{
+	using namespace ksp::image;
+
+	const std::string path = (std::filesystem::temp_directory_path() / ("ksp_image_check_" + std::to_string(seed) + ".img")).string();
+
+	std::mt19937_64 gen{ seed };
+	size_t failures = 0;
+	for (size_t m = 0; m < modules; ++m)
+	{
+		Module module;
+		random_module(module, gen, 1 + gen() % 16);
+		ModuleImage::write(module, path);
+		ModuleImage image{ path };
+
+		auto fail = [&log, &failures, m](const std::string& what) {
+			log << "image: module " << m << ": " << what << std::endl;
+			++failures;
+		};
+
+		KSP_State ksp_state;
+		RuntimeState state;
+		for (const auto& p : module.content.elements())
+		{
+			const std::string& name = p.first.str();
+			const NameTable::Element& e = p.second;
+			if (!image.hasName(name))
+			{
+				fail(name + " is missing");
+				continue;
+			}
+
+			const NameRecord& record = image.name(name);
+			if (record.kind != e.kind())
+			{
+				fail(name + " has another kind");
+				continue;
+			}
+
+			switch (e.kind())
+			{
+				case NameTable::Kind::Type:
+					if (image.type(record.index).kind != e.getTypeMeta().kind() || image.type(record.index).size != e.getTypeMeta().size())
+						fail(name + " has another type");
+					break;
+
+				case NameTable::Kind::Constant: {
+					const module_info::ConstantValue& value = *e.getConstantValue();
+					if (std::memcmp(image.constant(name), value.data(), value.type().size()) != 0)
+						fail(name + " has another value");
+					break;
+				}
+
+				case NameTable::Kind::Function: {
+					const Function& built = *e.getFunction();
+					const FunctionRecord& f = image.functionRecord(record.index);
+					const VariableRecord* vars = image.variables(f);
+					for (size_t i = 0; i < built.variableCount(); ++i)
+						if (vars[i].type == no_type || image.type(vars[i].type).kind != built.variable(i).type().kind()
+							|| vars[i].heap_offset != built.variableHeapOffset(i))
+							fail(name + " variable " + std::to_string(i) + " has another type or offset");
+
+					const reg_t expected = execute(&ksp_state, &module, state, built);
+					const reg_t actual = execute(&ksp_state, &image.module(), state, image.function(name));
+					if (expected != actual)
+						fail(name + " returns " + std::to_string(actual) + ", built module " + std::to_string(expected));
+					break;
+				}
+
+				default:
+					break;
+			}
+		}
+	}
+
+	/* Mapped functions reach the JIT too, which must leave those whose calls can YIELD interpreted. */
+	{
+		Module module;
+		const size_t functions = 16;
+		random_calls(module, gen, functions);
+		ModuleImage::write(module, path);
+		ModuleImage image{ path };
+
+		KSP_State ksp_state;
+		RuntimeState state;
+		for (size_t i = 0; i < functions; ++i)
+		{
+			const std::string name = "f" + std::to_string(i);
+			const std::vector<reg_t> expected = run_to_end(ksp_state, module, state, *module.content.getElement(name).getFunction());
+			for (size_t round = 0; round <= __KSP_JIT_THRESHOLD; ++round)
+			{
+				try
+				{
+					if (run_to_end(ksp_state, image.module(), state, image.function(name)) == expected)
+						continue;
+					log << "image: mapped " << name << " returns another value in round " << round << std::endl;
+				}
+				catch (const InvalidExecutionState&)
+				{
+					log << "image: mapped " << name << " could not YIELD in round " << round << std::endl;
+				}
+				++failures;
+				break;
+			}
+		}
+	}
+
+	/* Corrupt records of a valid image: looking them up must throw InvalidModuleImage rather than read outside the mapping. */
+	{
+		Module module;
+		random_module(module, gen, 4);
+		ModuleImage::write(module, path);
+
+		std::vector<char> bytes;
+		{
+			std::ifstream in{ path, std::ios::binary };
+			bytes.assign(std::istreambuf_iterator<char>{ in }, std::istreambuf_iterator<char>{});
+		}
+
+		const std::string corrupt_path = path + ".corrupt";
+		for (const Corruption& c : corruptions(path))
+		{
+			std::vector<char> corrupt = bytes;
+			std::memcpy(corrupt.data() + c.at, &c.value, c.width);
+			{
+				std::ofstream out{ corrupt_path, std::ios::binary | std::ios::trunc };
+				out.write(corrupt.data(), static_cast<std::streamsize>(corrupt.size()));
+			}
+
+			ModuleImage image{ corrupt_path };
+			try
+			{
+				c.lookup(image);
+				log << "image: a corrupt " << c.what << " was accepted" << std::endl;
+				++failures;
+			}
+			catch (const InvalidModuleImage&) {}
+		}
+		std::error_code ignored;
+		std::filesystem::remove(corrupt_path, ignored);
+	}
+
+	std::error_code ignored;
+	std::filesystem::remove(path, ignored);
+	return failures;
+}
+
@@ -0,0 +1,143 @@
+#include "checks.h"
+
+#include <random>
+
+#include "jit.h"
+#include "module_spec.h"
+#include "ops.h"
+#include "runtime.h"
+#include "vm.h"
+
+namespace
+{
+	using ksp::reg_t;
+
+	/* Room for every register an instruction can name, plus the high half of a quad in the last one. */
+	constexpr size_t __check_regs = 257;
+
+	void seed_frame(ksp::RuntimeState& state, const ksp::module_info::Function& function, const uint32_t seed)
+	{
+		state.push_call_info(function.fastRegisterCount, function.fastExtraStackSize);
+		state.ci->arrays = function.fastArrayOperandAccessor;
+		std::mt19937 gen{ seed };
+		for (size_t i = 0; i < __check_regs; ++i)
+			state.ci->regs_base[i] = static_cast<reg_t>(gen());
+	}
+
+	/* Runs 'function' interpreted and compiled on frames seeded alike; false if they differ. */
+	bool differential_check(const ksp::module_info::Function& function, std::ostream& log, const uint32_t seed)
+	{
+		const ksp::native_code_t code = ksp::jit::compile(function);
+		if (!code)
+			return true;
+
+		ksp::KSP_State ksp_state;
+		ksp::Module module;
+
+		ksp::RuntimeState interpreted;
+		seed_frame(interpreted, function, seed);
+		interpreted.pc = function.fastInstructionAccessor;
+		const reg_t expected = ksp::interpret(&ksp_state, &module, interpreted);
+
+		ksp::RuntimeState native;
+		seed_frame(native, function, seed);
+		const reg_t actual = ksp::jit::run(code, native, &ksp_state, &module);
+
+		ksp::jit::release(code);
+
+		bool ok = true;
+		if (expected != actual)
+		{
+			log << "jit: return value " << actual << ", interpreter " << expected << std::endl;
+			ok = false;
+		}
+		for (size_t i = 0; i < __check_regs; ++i)
+		{
+			if (interpreted.ci->regs_base[i] != native.ci->regs_base[i])
+			{
+				log << "jit: reg" << i << " = " << native.ci->regs_base[i]
+					<< ", interpreter " << interpreted.ci->regs_base[i] << std::endl;
+				ok = false;
+			}
+		}
+		return ok;
+	}
+}
+
+size_t ksp::checks::jit(const size_t programs, const size_t length, const size_t modules, std::ostream& log, const uint32_t seed)
+{
+	namespace info = ksp::opcode::info;
+	static const OpcodeInfo* const ops[] = {
+		&info::NOP,
+		&info::PUTB, &info::PUTW, &info::PUTL, &info::PUTQ,
+		&info::MOVB, &info::MOVW, &info::MOVL, &info::MOVQ,
+		&info::PUTMOVB, &info::PUTMOVW, &info::PUTMOVL, &info::PUTMOVQ
+	};
+
+	std::mt19937_64 gen{ seed };
+	size_t failures = 0;
+	for (size_t p = 0; p < programs; ++p)
+	{
+		/* Few registers, so that PUT/MOV pairs also go through bytecode::fuse. */
+		const uint64_t regs = 1 + gen() % 16;
+
+		bytecode::BytecodeBuilder builder;
+		for (size_t i = 0; i < length; ++i)
+		{
+			const OpcodeInfo& op = *ops[gen() % (sizeof(ops) / sizeof(*ops))];
+			std::vector<uint64_t> args;
+			for (size_t a = 0; a < op.args_count(); ++a)
+				args.push_back(op.arg(a).isRegister() ? gen() % regs : gen());
+			builder.push_instruction(op, args);
+		}
+		builder.push_instruction(info::HALT, { gen() % regs });
+
+		module_info::Function function;
+		function.addOpcodes(builder.build());
+		function.build();
+
+		if (!differential_check(function, log, static_cast<uint32_t>(gen())))
+		{
+			log << "jit: program " << p << " differs from the interpreter" << std::endl;
+			++failures;
+		}
+	}
+
+	/* Every function run once, interpreted throughout, then until all that can be are compiled. */
+	for (size_t m = 0; m < modules; ++m)
+	{
+		const size_t functions = 1 + gen() % 8;
+		Module module;
+		checks::random_calls(module, gen, functions);
+
+		KSP_State ksp_state;
+		RuntimeState state;
+		std::vector<std::vector<reg_t>> expected;
+		for (size_t i = 0; i < functions; ++i)
+			expected.push_back(checks::run_to_end(ksp_state, module, state, *module.content.getElement("f" + std::to_string(i)).getFunction()));
+
+		for (size_t round = 0; round <= __KSP_JIT_THRESHOLD; ++round)
+		{
+			for (size_t i = 0; i < functions; ++i)
+			{
+				const std::string what = "jit: module " + std::to_string(m) + ", round " + std::to_string(round) + ": f" + std::to_string(i);
+				try
+				{
+					const std::vector<reg_t> actual = checks::run_to_end(ksp_state, module, state, *module.content.getElement("f" + std::to_string(i)).getFunction());
+					if (actual == expected[i])
+						continue;
+					log << what << " returns " << actual.back() << " after " << (actual.size() - 1) << " YIELDs, interpreted "
+						<< expected[i].back() << " after " << (expected[i].size() - 1) << std::endl;
+				}
+				catch (const InvalidExecutionState&)
+				{
+					log << what << " could not YIELD" << std::endl;
+				}
+				++failures;
+				round = __KSP_JIT_THRESHOLD;
+				break;
+			}
+		}
+	}
+	return failures;
+}
@@ -0,0 +1,133 @@
+#include "checks.h"
+
+#include <algorithm>
+#include <set>
+
+#include "module_spec.h"
+#include "ops.h"
+#include "runtime.h"
+
+namespace
+{
+	/* 'name' and the functions its call reaches, in call order. */
+	std::vector<std::string> call_chain(const ksp::checks::ModuleSpec& spec, std::string name)
+	{
+		std::vector<std::string> chain;
+		for (;;)
+		{
+			chain.push_back(name);
+			auto it = std::find_if(spec.at(name).body.begin(), spec.at(name).body.end(), [](const ksp::checks::Step& step) { return !step.callee.empty(); });
+			if (it == spec.at(name).body.end())
+				return chain;
+			name = it->callee;
+		}
+	}
+}
+
+size_t ksp::checks::lazy(const size_t modules, std::ostream& log, const uint32_t seed)
+{
+	namespace info = opcode::info;
+
+	std::mt19937_64 gen{ seed };
+	size_t failures = 0;
+	for (size_t m = 0; m < modules; ++m)
+	{
+		auto fail = [&log, &failures, m](const std::string& what) {
+			log << "lazy: module " << m << ": " << what << std::endl;
+			++failures;
+		};
+
+		/* "broken" calls function 1000, so that it fails to materialize; later functions may call it. */
+		ModuleSpec spec;
+		const size_t count = 1 + gen() % 24;
+		const size_t broken = gen() % 3 == 0 ? gen() % count : count;
+		for (size_t next = 0; spec.size() < count; ++next)
+		{
+			if (next == broken)
+			{
+				ElementSpec f{ true, nullptr, 0, next, {} };
+				for (uint64_t r = 0; r < 4; ++r)
+					f.body.push_back({ &info::PUTL, { r, gen() }, {} });
+				f.body.push_back({ &info::CALL, { 2, 1000 }, {} });
+				f.body.push_back({ &info::RET, { 0 } , {} });
+				spec["broken"] = f;
+			}
+			else spec["e" + std::to_string(next)] = gen() % 3 ? random_function(gen, spec, next) : random_constant(gen);
+		}
+
+		/* The eager module holds the functions that do not reach "broken"; with them it does not build. */
+		ModuleSpec healthy;
+		std::vector<std::string> functions;
+		for (const auto& p : spec)
+		{
+			if (!p.second.function)
+				healthy.insert(p);
+			else
+			{
+				const std::vector<std::string> chain = call_chain(spec, p.first);
+				if (std::find(chain.begin(), chain.end(), "broken") == chain.end())
+					healthy.insert(p);
+				functions.push_back(p.first);
+			}
+		}
+		Module eager;
+		build_from_scratch(eager, healthy, false);
+		if (broken < count)
+		{
+			Module rejected;
+			try
+			{
+				build_from_scratch(rejected, spec, false);
+				fail("the eager build accepted a call to an unknown function");
+			}
+			catch (const bytecode::InvalidBytecode&) {}
+		}
+
+		Module lazy;
+		try
+		{
+			build_from_scratch(lazy, spec, true);
+		}
+		catch (const bytecode::InvalidBytecode&)
+		{
+			fail("the lazy build checked the calls of a stub");
+			continue;
+		}
+		if (lazy.materializedCount() != 0)
+			fail(std::to_string(lazy.materializedCount()) + " functions materialized before any call");
+
+		KSP_State ksp_state;
+		RuntimeState state;
+		std::set<std::string> materialized;
+		std::shuffle(functions.begin(), functions.end(), gen);
+		for (const std::string& name : functions)
+		{
+			const module_info::Function& function = *lazy.content.getElement(name).getFunction();
+			if (healthy.count(name))
+			{
+				const reg_t actual = execute(&ksp_state, &lazy, state, function);
+				const reg_t expected = execute(&ksp_state, &eager, state, *eager.content.getElement(name).getFunction());
+				if (actual != expected)
+					fail(name + " returns " + std::to_string(actual) + ", " + std::to_string(expected) + " when built eagerly");
+			}
+			else for (size_t call = 0; call < 2; ++call)
+			{
+				RuntimeState failing;
+				try
+				{
+					execute(&ksp_state, &lazy, failing, function);
+					fail(name + " reaches an invalid function but returned");
+				}
+				catch (const bytecode::InvalidBytecode&) {}
+			}
+
+			for (const std::string& reached : call_chain(spec, name))
+				if (reached != "broken")
+					materialized.insert(reached);
+			if (lazy.materializedCount() != materialized.size())
+				fail("after calling " + name + ", " + std::to_string(lazy.materializedCount()) + " functions are materialized instead of " + std::to_string(materialized.size()));
+		}
+	}
+	return failures;
+}
+
@@ -0,0 +1,210 @@
+#include "checks.h"
+
+#include <algorithm>
+#include <cstring>
+#include <random>
+
+#include "linker.h"
+#include "ops.h"
+#include "vm.h"
+
+namespace
+{
+	enum class Definition
+	{
+		None,
+		Import,
+		Constant,
+		Leaf,
+		Caller
+	};
+
+	/* 'name' in 'module' as 'definition'; a Leaf returns its parameter, a Caller calls function 0. */
+	void define(ksp::Module& module, const std::string& name, const Definition definition, const uint32_t value)
+	{
+		namespace info = ksp::opcode::info;
+		using ksp::Type;
+
+		ksp::module_info::NameTable::Element& e = module.content.createNewElement(name);
+		ksp::bytecode::BytecodeBuilder builder;
+		switch (definition)
+		{
+			case Definition::Constant:
+				std::memcpy(e.createConstantValue(Type::Integer)->data(), &value, sizeof(value));
+				break;
+
+			case Definition::Leaf: {
+				ksp::module_info::Function& f = e.createFunction();
+				f.addParameter(Type::Integer, "a");
+				builder.push_instruction(info::RET, { 0 });
+				f.addOpcodes(builder.build());
+				break;
+			}
+
+			case Definition::Caller: {
+				ksp::module_info::Function& f = e.createFunction();
+				f.addVariable(Type::Integer, "r");
+				builder.push_instruction(info::CALL, { 0, 0 });
+				builder.push_instruction(info::HALT, { 0 });
+				f.addOpcodes(builder.build());
+				break;
+			}
+
+			default:
+				break;
+		}
+	}
+}
+
+size_t ksp::checks::link(const size_t rounds, std::ostream& log, const uint32_t seed)
+{
+	typedef module_info::NameTable NameTable;
+
+	std::mt19937_64 gen{ seed };
+	size_t failures = 0;
+	for (size_t round = 0; round < rounds; ++round)
+	{
+		auto fail = [&log, &failures, round](const std::string& what) {
+			log << "link: round " << round << ": " << what << std::endl;
+			++failures;
+		};
+
+		/*
+		 * Half of the rounds define every name once at most and import only the names that are
+		 * defined and make no calls; the other half draw every name of every module at random.
+		 */
+		const bool clean = gen() % 2 == 0;
+		const size_t module_count = 1 + gen() % 8;
+		const size_t name_count = 1 + gen() % 24;
+		std::vector<std::vector<Definition>> definitions(module_count, std::vector<Definition>(name_count, Definition::None));
+		std::vector<std::vector<uint32_t>> values(module_count, std::vector<uint32_t>(name_count, 0));
+		for (size_t n = 0; n < name_count; ++n)
+		{
+			if (clean)
+			{
+				const Definition definition = static_cast<Definition>(gen() % 4);
+				const size_t owner = gen() % module_count;
+				if (definition == Definition::None || definition == Definition::Import)
+					continue;
+				definitions[owner][n] = definition;
+				for (size_t m = 0; m < module_count; ++m)
+					if (m != owner && definition != Definition::Caller && gen() % 2 == 0)
+						definitions[m][n] = Definition::Import;
+			}
+			else for (size_t m = 0; m < module_count; ++m)
+			{
+				const uint64_t draw = gen() % 20;
+				definitions[m][n] = draw < 8 ? Definition::None : draw < 14 ? Definition::Import
+					: draw < 17 ? Definition::Constant : draw < 19 ? Definition::Leaf : Definition::Caller;
+			}
+			for (size_t m = 0; m < module_count; ++m)
+				values[m][n] = static_cast<uint32_t>(gen());
+		}
+
+		/* The errors link() must report, from the definitions alone. */
+		std::vector<std::string> expected;
+		for (size_t m = 0; m < module_count; ++m)
+			for (size_t n = 0; n < name_count; ++n)
+			{
+				if (definitions[m][n] != Definition::Import)
+					continue;
+
+				std::vector<size_t> owners;
+				for (size_t o = 0; o < module_count; ++o)
+					if (definitions[o][n] != Definition::None && definitions[o][n] != Definition::Import)
+						owners.push_back(o);
+
+				const std::string prefix = "m" + std::to_string(m) + ": n" + std::to_string(n);
+				if (owners.empty())
+					expected.push_back(prefix + " (not defined)");
+				else if (owners.size() > 1)
+				{
+					std::string modules;
+					for (const size_t o : owners)
+						modules += (modules.empty() ? "m" : ", m") + std::to_string(o);
+					expected.push_back(prefix + " (defined by " + modules + ")");
+				}
+				else if (definitions[owners.front()][n] == Definition::Caller)
+					expected.push_back(prefix + " (function of m" + std::to_string(owners.front()) + " makes calls)");
+			}
+		std::sort(expected.begin(), expected.end());
+
+		/* A module that resolves but can not build: its CALL names a function that does not exist. */
+		const bool broken = expected.empty() && gen() % 4 == 0;
+
+		std::vector<Module> modules(module_count);
+		Linker linker{ 1 + gen() % 4 };
+		for (size_t m = 0; m < module_count; ++m)
+		{
+			for (size_t n = 0; n < name_count; ++n)
+				if (definitions[m][n] != Definition::None)
+					define(modules[m], "n" + std::to_string(n), definitions[m][n], values[m][n]);
+			if (broken && m == module_count - 1)
+			{
+				module_info::Function& f = modules[m].content.createNewElement("broken").createFunction();
+				f.addVariable(Type::Integer, "r");
+				bytecode::BytecodeBuilder builder;
+				builder.push_instruction(opcode::info::CALL, { 0, 1000 });
+				builder.push_instruction(opcode::info::HALT, { 0 });
+				f.addOpcodes(builder.build());
+			}
+			linker.add(modules[m], "m" + std::to_string(m));
+		}
+
+		try
+		{
+			linker.link();
+			if (!expected.empty())
+				fail("link() did not report " + std::to_string(expected.size()) + " unresolved imports");
+			if (broken)
+				fail("link() did not rethrow the error of the broken module");
+		}
+		catch (const LinkError& e)
+		{
+			std::vector<std::string> actual = e.unresolved();
+			std::sort(actual.begin(), actual.end());
+			if (actual != expected)
+			{
+				fail("link() reported other unresolved imports:");
+				for (const std::string& name : actual)
+					log << "    " << name << std::endl;
+			}
+			bool attached = false;
+			for (const Module& module : modules)
+				for (const auto& p : module.content.elements())
+					attached |= p.second.isExtern();
+			if (attached)
+				fail("link() attached imports before throwing");
+			continue;
+		}
+		catch (const bytecode::InvalidBytecode&)
+		{
+			if (!broken)
+				fail("link() threw InvalidBytecode");
+			continue;
+		}
+
+		for (size_t m = 0; m < module_count; ++m)
+			for (size_t n = 0; n < name_count; ++n)
+			{
+				if (definitions[m][n] != Definition::Import)
+					continue;
+
+				size_t owner = 0;
+				while (definitions[owner][n] == Definition::None || definitions[owner][n] == Definition::Import)
+					++owner;
+
+				const std::string name = "n" + std::to_string(n);
+				const NameTable::Element& e = modules[m].content.getElement(name);
+				const NameTable::Element& definition = modules[owner].content.getElement(name);
+				if (!e.isExtern() || e.kind() != definition.kind())
+					fail("m" + std::to_string(m) + ": " + name + " is not attached to m" + std::to_string(owner));
+				else if (e.kind() == NameTable::Kind::Function && e.getFunction() != definition.getFunction())
+					fail("m" + std::to_string(m) + ": " + name + " is another function than in m" + std::to_string(owner));
+				else if (e.kind() == NameTable::Kind::Constant
+					&& std::memcmp(modules[m].fastConstantAccessor + e.offset(), &values[owner][n], sizeof(uint32_t)) != 0)
+					fail("m" + std::to_string(m) + ": " + name + " has another value than in m" + std::to_string(owner));
+			}
+	}
+	return failures;
+}
@@ -0,0 +1,53 @@
+#include <iostream>
+#include <string>
+
+#include "checks.h"
+
+/*
+ * Behavior checks of the VM.
+ *
+ *   ksp_checks [<name>...]
+ *
+ * Runs the named checks, or all of them, and fails if any finds a mismatch.
+ */
+
+std::vector<ksp::checks::Check> ksp::checks::all()
+{
+	return {
+		{ "jit", [](std::ostream& log) { return jit(1000, 64, 50, log); } },
+		{ "batch", [](std::ostream& log) { return batch(200, 64, 1000, log); } },
+		{ "arrays", [](std::ostream& log) { return arrays(100, log); } },
+		{ "image", [](std::ostream& log) { return image(50, log); } },
+		{ "names", [](std::ostream& log) { return names(200, log); } },
+		{ "link", [](std::ostream& log) { return link(500, log); } },
+		{ "rebuild", [](std::ostream& log) { return rebuild(100, 20, log); } },
+		{ "lazy", [](std::ostream& log) { return lazy(300, log); } },
+		{ "aot", [](std::ostream& log) { return aot(log); } }
+	};
+}
+
+int main(int argc, char** argv)
+{
+	size_t failures = 0;
+	size_t run = 0;
+	for (const ksp::checks::Check& check : ksp::checks::all())
+	{
+		bool selected = argc == 1;
+		for (int i = 1; i < argc; ++i)
+			selected |= check.name == argv[i];
+		if (!selected)
+			continue;
+
+		const size_t mismatches = check.run(std::cout);
+		std::cout << check.name << ": " << (mismatches == 0 ? "ok" : std::to_string(mismatches) + " mismatches") << std::endl;
+		failures += mismatches;
+		++run;
+	}
+
+	if (run == 0)
+	{
+		std::cerr << "usage: ksp_checks [<name>...]" << std::endl;
+		return 2;
+	}
+	return failures == 0 ? 0 : 1;
+}
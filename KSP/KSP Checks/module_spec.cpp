@@ -0,0 +1,150 @@
+#include "module_spec.h"
+
+#include <cstring>
+
+#include "ops.h"
+
+ksp::checks::ElementSpec ksp::checks::random_constant(std::mt19937_64& gen)
+{
+	static const ksp::TypeInfo* const types[] = { &ksp::TypeInfo::Byte, &ksp::TypeInfo::Short, &ksp::TypeInfo::Integer, &ksp::TypeInfo::Long };
+	return { false, types[gen() % 4], gen(), 0, {} };
+}
+
+ksp::checks::ElementSpec ksp::checks::random_function(std::mt19937_64& gen, const ModuleSpec& spec, const size_t rank)
+{
+	namespace info = ksp::opcode::info;
+	static const ksp::OpcodeInfo* const ops[] = {
+		&info::NOP, &info::PUTB, &info::PUTW, &info::PUTL, &info::MOVB, &info::MOVW, &info::MOVL
+	};
+
+	std::vector<std::string> callees;
+	for (const auto& p : spec)
+		if (p.second.function && p.second.rank < rank)
+			callees.push_back(p.first);
+
+	ElementSpec function{ true, nullptr, 0, rank, {} };
+	for (uint64_t r = 0; r < 4; ++r)
+		function.body.push_back({ &info::PUTL, { r, gen() }, {} });
+	const size_t call = callees.empty() ? static_cast<size_t>(-1) : gen() % 8;
+	for (size_t n = 0; n < 8; ++n)
+	{
+		if (n == call)
+			function.body.push_back({ &info::CALL, { 2, 0 }, callees[gen() % callees.size()] });
+		const ksp::OpcodeInfo& op = *ops[gen() % (sizeof(ops) / sizeof(*ops))];
+		std::vector<uint64_t> args;
+		for (size_t a = 0; a < op.args_count(); ++a)
+			args.push_back(op.arg(a).isRegister() ? gen() % 4 : gen());
+		function.body.push_back({ &op, args, {} });
+	}
+	function.body.push_back({ &info::RET, { gen() % 4 }, {} });
+	return function;
+}
+
+void ksp::checks::define(ksp::Module& module, const std::string& name, const ElementSpec& spec)
+{
+	ksp::module_info::NameTable::Element& e = module.content.hasName(name) ? module.content.getElement(name) : module.content.createNewElement(name);
+	if (spec.function)
+	{
+		ksp::module_info::Function& f = e.createFunction();
+		for (size_t r = 0; r < 4; ++r)
+			f.addVariable(ksp::Type::Integer, "r" + std::to_string(r));
+	}
+	else std::memcpy(e.createConstantValue(*spec.type)->data(), &spec.value, spec.type->size());
+}
+
+void ksp::checks::encode(ksp::Module& module, const std::string& name, const ElementSpec& spec)
+{
+	ksp::bytecode::BytecodeBuilder builder;
+	for (const Step& step : spec.body)
+	{
+		std::vector<uint64_t> args = step.args;
+		if (!step.callee.empty())
+			args[1] = module.content.getElement(step.callee).offset();
+		builder.push_instruction(*step.op, args);
+	}
+	module.content.getElement(name).getFunction()->addOpcodes(builder.build());
+}
+
+void ksp::checks::build_from_scratch(ksp::Module& module, const ModuleSpec& spec, const bool lazy)
+{
+	for (const auto& p : spec)
+		define(module, p.first, p.second);
+	module.content.buildReferences();
+	for (const auto& p : spec)
+		if (p.second.function)
+			encode(module, p.first, p.second);
+	module.build(lazy);
+}
+
+void ksp::checks::random_calls(ksp::Module& module, std::mt19937_64& gen, const size_t functions)
+{
+	namespace info = ksp::opcode::info;
+	using ksp::module_info::Function;
+	using ksp::Type;
+
+	ksp::module_info::NameTable& table = module.content;
+	const Type bytes = table.createNewElement("ByteArray").createTypeInfo(ksp::TypeInfo::arrayOf(ksp::TypeInfo::Byte, 1 + gen() % 32));
+
+	std::vector<Function*> fns;
+	std::vector<bool> interpreted;
+	for (size_t i = 0; i < functions; ++i)
+	{
+		fns.push_back(&table.createNewElement("f" + std::to_string(i)).createFunction());
+		for (size_t r = 0; r < 4; ++r)
+			fns.back()->addVariable(Type::Integer, "r" + std::to_string(r));
+		interpreted.push_back(gen() % 3 == 0);
+		if (interpreted.back())
+			fns.back()->addVariable(bytes, "a");
+	}
+	table.buildReferences();
+
+	static const ksp::OpcodeInfo* const ops[] = {
+		&info::NOP, &info::PUTB, &info::PUTW, &info::PUTL, &info::MOVB, &info::MOVW, &info::MOVL
+	};
+	for (size_t i = 0; i < functions; ++i)
+	{
+		auto callee = [&]() { return table.getElement("f" + std::to_string(i + 1 + gen() % (functions - i - 1))).offset(); };
+
+		ksp::bytecode::BytecodeBuilder builder;
+		for (uint64_t r = 0; r < 4; ++r)
+			builder.push_instruction(info::PUTL, { r, gen() });
+		for (size_t n = 0; n < 8; ++n)
+		{
+			if (i + 1 < functions && gen() % 4 == 0)
+				builder.push_instruction(info::CALL, { gen() % 4, callee() });
+			else if (interpreted[i] && gen() % 4 == 0)
+				builder.push_instruction(info::AFILL, { 4, gen() % 4 });
+			else if (gen() % 32 == 0)
+				builder.push_instruction(info::YIELD, { gen() % 4 });
+			else
+			{
+				const ksp::OpcodeInfo& op = *ops[gen() % (sizeof(ops) / sizeof(*ops))];
+				std::vector<uint64_t> args;
+				for (size_t a = 0; a < op.args_count(); ++a)
+					args.push_back(op.arg(a).isRegister() ? gen() % 4 : gen());
+				builder.push_instruction(op, args);
+			}
+		}
+		if (interpreted[i])
+			builder.push_instruction(info::AFILL, { 4, gen() % 4 });
+		if (i + 1 < functions && gen() % 2 == 0)
+			builder.push_instruction(info::TAILCALL, { gen() % 4, callee() });
+		else builder.push_instruction(info::RET, { gen() % 4 });
+		fns[i]->addOpcodes(builder.build());
+	}
+	module.build();
+}
+
+void ksp::checks::build_aot_module(ksp::Module& module)
+{
+	std::mt19937_64 gen{ 1 };
+	random_calls(module, gen, 64);
+}
+
+std::vector<ksp::reg_t> ksp::checks::run_to_end(ksp::KSP_State& ksp_state, const ksp::Module& module, ksp::RuntimeState& state, const ksp::module_info::Function& function)
+{
+	std::vector<ksp::reg_t> values{ ksp::execute(&ksp_state, &module, state, function) };
+	while (state.suspended())
+		values.push_back(ksp::resume(&ksp_state, &module, state));
+	return values;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "runtime.h"
+#include "vm.h"
+
+namespace ksp
+{
+	namespace checks
+	{
+		/* One instruction of a generated function; a CALL names its callee, numbered when encoded. */
+		struct Step
+		{
+			const OpcodeInfo* op;
+			std::vector<uint64_t> args;
+			std::string callee;
+		};
+
+		/*
+		 * A constant, or a function of four Integer registers. A function only calls functions of
+		 * a lower rank, so that every call ends.
+		 */
+		struct ElementSpec
+		{
+			bool function;
+			const TypeInfo* type;
+			uint64_t value;
+			size_t rank;
+			std::vector<Step> body;
+		};
+
+		/* The elements of a random module by name, to build it more than one way. */
+		typedef std::map<std::string, ElementSpec> ModuleSpec;
+
+		ElementSpec random_constant(std::mt19937_64& gen);
+
+		/* Sets the registers, runs random PUT/MOV code around at most one CALL, and returns one register. */
+		ElementSpec random_function(std::mt19937_64& gen, const ModuleSpec& spec, const size_t rank);
+
+		/* Creates or redefines 'name'; the code of a function is added by encode, once the functions are numbered. */
+		void define(Module& module, const std::string& name, const ElementSpec& spec);
+
+		void encode(Module& module, const std::string& name, const ElementSpec& spec);
+
+		void build_from_scratch(Module& module, const ModuleSpec& spec, const bool lazy);
+
+		/*
+		 * Builds 'functions' functions f0, f1... of four Integer registers, set to random values and then
+		 * running random PUT/MOV code, each CALLing or TAILCALLing only functions after it. Some also
+		 * AFILL a Byte array, which keeps them out of the JIT, so that compiled and interpreted code call
+		 * each other both ways; a few YIELD, which keeps their callers interpreted too.
+		 */
+		void random_calls(Module& module, std::mt19937_64& gen, const size_t functions);
+
+		/*
+		 * Builds the module of the aot check, random_calls from a fixed seed. ksp_checks_emit translates
+		 * it into checks_aot.cpp, which the check binds back to it.
+		 */
+		void build_aot_module(Module& module);
+
+		/* The values 'function' YIELDs, resumed until it returns, then the value it returns. */
+		std::vector<reg_t> run_to_end(KSP_State& ksp_state, const Module& module, RuntimeState& state, const module_info::Function& function);
+	}
+}
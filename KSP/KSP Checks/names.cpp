@@ -0,0 +1,96 @@
+#include "checks.h"
+
+#include <random>
+
+#include "vm.h"
+
+namespace
+{
+	/* Short names over a small alphabet, so that many share prefixes and lengths. */
+	std::string random_name(std::mt19937_64& gen)
+	{
+		static const char alphabet[] = "ab_.0";
+		std::string name;
+		for (size_t len = 1 + gen() % 12; len > 0; --len)
+			name += alphabet[gen() % (sizeof(alphabet) - 1)];
+		return name;
+	}
+
+	/* Mismatches between the lookups of 'table' and its map, for 'name'. */
+	size_t check_lookup(const ksp::module_info::NameTable& table, const std::string& name, std::ostream& log)
+	{
+		using ksp::module_info::NameTable;
+
+		auto it = table.elements().find(ksp::Atom{ name });
+		const NameTable::Element* expected = it == table.elements().end() ? nullptr : &it->second;
+
+		const NameTable::Element* by_string = nullptr;
+		const NameTable::Element* by_atom = nullptr;
+		try { by_string = &table.getElement(name); }
+		catch (const NameTable::ElementNotFound&) {}
+		try { by_atom = &table.getElement(ksp::Atom{ name }); }
+		catch (const NameTable::ElementNotFound&) {}
+
+		size_t failures = 0;
+		if (by_string != expected || by_atom != expected)
+		{
+			log << "names: " << (table.frozen() ? "frozen" : "thawed") << " getElement(\"" << name << "\") finds another element than the map" << std::endl;
+			++failures;
+		}
+		if (table.hasName(name) != (expected != nullptr) || table.hasName(ksp::Atom{ name }) != (expected != nullptr))
+		{
+			log << "names: " << (table.frozen() ? "frozen" : "thawed") << " hasName(\"" << name << "\") disagrees with the map" << std::endl;
+			++failures;
+		}
+		return failures;
+	}
+}
+
+size_t ksp::checks::names(const size_t tables, std::ostream& log, const uint32_t seed)
+{
+	using ksp::module_info::NameTable;
+
+	std::mt19937_64 gen{ seed };
+	size_t failures = 0;
+	for (size_t t = 0; t < tables; ++t)
+	{
+		NameTable table;
+		std::vector<std::string> names;
+		for (size_t count = gen() % 2000; names.size() < count; )
+		{
+			std::string name = random_name(gen);
+			if (!table.hasName(name))
+			{
+				table.createNewElement(name);
+				names.push_back(std::move(name));
+			}
+		}
+
+		table.freeze();
+		if (!table.frozen())
+		{
+			log << "names: table " << t << " of " << names.size() << " names did not freeze" << std::endl;
+			++failures;
+		}
+
+		for (const std::string& name : names)
+			failures += check_lookup(table, name, log);
+		for (size_t i = 0; i < 200; ++i)
+			failures += check_lookup(table, random_name(gen), log);
+
+		/* A new element thaws the table; the map answers until the next freeze. */
+		std::string added = random_name(gen);
+		while (table.hasName(added))
+			added = random_name(gen);
+		table.createNewElement(added);
+		failures += check_lookup(table, added, log);
+		for (size_t i = 0; i < 20; ++i)
+			failures += check_lookup(table, names.empty() ? random_name(gen) : names[gen() % names.size()], log);
+
+		table.freeze();
+		failures += check_lookup(table, added, log);
+		for (size_t i = 0; i < 20; ++i)
+			failures += check_lookup(table, random_name(gen), log);
+	}
+	return failures;
+}
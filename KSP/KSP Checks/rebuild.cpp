@@ -0,0 +1,114 @@
+#include "checks.h"
+
+#include <cstring>
+
+#include "module_spec.h"
+#include "runtime.h"
+
+namespace
+{
+	/* Mismatches between the constants and function results of 'module' and 'expected'. */
+	size_t compare_modules(const ksp::Module& module, const ksp::Module& expected, const ksp::checks::ModuleSpec& spec, const std::string& what, std::ostream& log)
+	{
+		ksp::KSP_State ksp_state;
+		ksp::RuntimeState state;
+		size_t failures = 0;
+		for (const auto& p : spec)
+		{
+			const ksp::module_info::NameTable::Element& e = module.content.getElement(p.first);
+			const ksp::module_info::NameTable::Element& x = expected.content.getElement(p.first);
+			if (p.second.function)
+			{
+				const ksp::reg_t actual = ksp::execute(&ksp_state, &module, state, *e.getFunction());
+				const ksp::reg_t result = ksp::execute(&ksp_state, &expected, state, *x.getFunction());
+				if (actual != result)
+				{
+					log << what << ": " << p.first << " returns " << actual << ", " << result << " when built from scratch" << std::endl;
+					++failures;
+				}
+			}
+			else if (std::memcmp(module.fastConstantAccessor + e.offset(), expected.fastConstantAccessor + x.offset(), p.second.type->size()) != 0
+				|| std::memcmp(module.fastConstantAccessor + e.offset(), &p.second.value, p.second.type->size()) != 0)
+			{
+				log << what << ": constant " << p.first << " has another value" << std::endl;
+				++failures;
+			}
+		}
+		return failures;
+	}
+}
+
+size_t ksp::checks::rebuild(const size_t modules, const size_t edits, std::ostream& log, const uint32_t seed)
+{
+	std::mt19937_64 gen{ seed };
+	size_t failures = 0;
+	for (size_t m = 0; m < modules; ++m)
+	{
+		ModuleSpec spec;
+		size_t next = 0;
+		for (size_t count = 1 + gen() % 12; spec.size() < count; ++next)
+			spec["e" + std::to_string(next)] = gen() % 2 ? random_function(gen, spec, next) : random_constant(gen);
+
+		Module module;
+		build_from_scratch(module, spec, false);
+
+		for (size_t edit = 0; edit < edits; ++edit)
+		{
+			/* Redefine a constant, rewrite a function, add either, or make a constant a function. */
+			auto it = spec.begin();
+			std::advance(it, gen() % spec.size());
+			std::string name = it->first;
+			switch (gen() % 4)
+			{
+				case 0:
+					spec[name = "e" + std::to_string(next++)] = random_constant(gen);
+					break;
+				case 1:
+					spec[name = "e" + std::to_string(next)] = random_function(gen, spec, next);
+					++next;
+					break;
+				default:
+					if (it->second.function)
+						it->second = random_function(gen, spec, it->second.rank);
+					else if (gen() % 2)
+						it->second = random_constant(gen);
+					else
+					{
+						it->second = random_function(gen, spec, next);
+						++next;
+					}
+					break;
+			}
+
+			std::map<std::string, size_t> offsets;
+			for (const auto& p : module.content.elements())
+				offsets[p.first.str()] = p.second.offset();
+			const size_t built = module.materializedCount();
+
+			const ElementSpec& edited = spec[name];
+			define(module, name, edited);
+			module.content.buildReferences();
+			if (edited.function)
+				encode(module, name, edited);
+			module.build();
+
+			const std::string what = "rebuild: module " + std::to_string(m) + " edit " + std::to_string(edit);
+			for (const auto& p : offsets)
+				if (p.first != name && module.content.getElement(p.first).offset() != p.second)
+				{
+					log << what << ": " << p.first << " moved from " << p.second << " to " << module.content.getElement(p.first).offset() << std::endl;
+					++failures;
+				}
+			if (module.materializedCount() - built != (edited.function ? 1 : 0))
+			{
+				log << what << ": " << (module.materializedCount() - built) << " functions built again" << std::endl;
+				++failures;
+			}
+
+			Module expected;
+			build_from_scratch(expected, spec, false);
+			failures += compare_modules(module, expected, spec, what, log);
+		}
+	}
+	return failures;
+}
@@ -12,7 +12,7 @@
 
 /* PRIVATE FUNCTIONS */
 
-static void realloc_data(Buffer* b)
+static BOOL realloc_data(Buffer* b)
 {
 	size_t newsize = b->nalloc * 2;
 	char* data = (char*)malloc(newsize);
@@ -23,8 +23,9 @@ static void realloc_data(Buffer* b)
 		b->data = data;
 		b->nalloc = newsize;
 	}
+	return BOOL_TEST(data);
 }
-#define NEED_REALLOC(_Buff, _Amount) if((_Buff)->nalloc <= (_Buff)->len + (_Amount)) realloc_data((_Buff))
+#define NEED_REALLOC(_Buff, _Amount) while((_Buff)->nalloc <= (_Buff)->len + (_Amount)) if(!realloc_data((_Buff))) return (_Buff)
 
 static char* quote(char c)
 {
@@ -98,7 +99,7 @@ Buffer* buffer_printf(Buffer* b, const char* fmt, ...)
 	{
 		int avail = b->nalloc - b->len;
 		va_start(args, fmt);
-		int written = vsnprintf_s(b->data + b->len, avail, _TRUNCATE, fmt, args);
+		int written = vsnprintf(b->data + b->len, avail, fmt, args);
 		va_end(args);
 		if (avail <= written)
 		{
@@ -108,6 +109,7 @@ Buffer* buffer_printf(Buffer* b, const char* fmt, ...)
 		b->len += written;
 		break;
 	}
+	return b;
 }
 
 
@@ -119,7 +121,7 @@ char* vformat(const char* fmt, va_list ap)
 	{
 		int avail = b.nalloc - b.len;
 		va_copy(aq, ap);
-		int written = vsnprintf_s(b.data + b.len, avail, _TRUNCATE, fmt, aq);
+		int written = vsnprintf(b.data + b.len, avail, fmt, aq);
 		va_end(aq);
 		if (avail <= written)
 		{
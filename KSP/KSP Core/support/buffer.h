@@ -1,6 +1,7 @@
 #ifndef KSP_SUPPORT_BUFFER_H
 #define KSP_SUPPORT_BUFFER_H
 
+#include <stdarg.h>
 #include <stdlib.h>
 
 typedef struct
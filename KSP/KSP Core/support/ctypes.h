@@ -1,6 +1,7 @@
 #ifndef KSP_SUPPORT_CTYPES_H
 #define KSP_SUPPORT_CTYPES_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 typedef enum {
@@ -8,6 +9,6 @@ typedef enum {
 	TRUE  = 1
 } BOOL;
 
-#define BOOL_TEST(_Expr) (((BOOL) (_Expr)) != FALSE)
+#define BOOL_TEST(_Expr) ((_Expr) ? TRUE : FALSE)
 
 #endif
@@ -31,9 +31,10 @@ static hash_t hash(const char* str)
 
 static char* copy_key(const char* key)
 {
-	size_t s = strlen(key);
-	char* nk = (char*)calloc(s, sizeof(char));
-	strcpy_s(nk, s, key);
+	size_t s = strlen(key) + 1;
+	char* nk = (char*)malloc(s);
+	if (nk)
+		memcpy(nk, key, s);
 	return nk;
 }
 #define delete_key(_Key) (free(_Key))
@@ -41,7 +42,8 @@ static char* copy_key(const char* key)
 static void delete_map_keys(char** keys, size_t size)
 {
 	for (size_t i = 0; i < size; ++i)
-		delete_key(keys[i]);
+		if (keys[i] != GRAVESTONE)
+			delete_key(keys[i]);
 	free(keys);
 }
 
@@ -49,7 +51,7 @@ static void do_init_map(Map* map, Map* parent, size_t size)
 {
 	map->parent = parent;
 	map->key = (char**)calloc(size, sizeof(char*));
-	map->val = (value_t**)calloc(size, sizeof(value_t*));
+	map->val = (void**)calloc(size, sizeof(void*));
 	map->size = size;
 	map->nelem = 0;
 	map->nused = 0;
@@ -60,7 +62,7 @@ static void maybe_rehash(Map* map)
 	if (!map->key)
 	{
 		map->key = (char**)calloc(INIT_SIZE, sizeof(char*));
-		map->val = (value_t**)calloc(INIT_SIZE, sizeof(value_t*));
+		map->val = (void**)calloc(INIT_SIZE, sizeof(void*));
 		map->size = INIT_SIZE;
 		return;
 	}
@@ -70,7 +72,7 @@ static void maybe_rehash(Map* map)
 
 	size_t newsize = map->nelem < map->size * 0.35f ? map->size : map->size * 2;
 	char** newkey = (char**)calloc(newsize, sizeof(char*));
-	void** newval = (value_t**)calloc(newsize, sizeof(value_t*));
+	void** newval = (void**)calloc(newsize, sizeof(void*));
 	size_t mask = newsize - 1;
 
 	for (size_t i = 0; i < map->size; ++i)
@@ -86,10 +88,12 @@ static void maybe_rehash(Map* map)
 
 			newkey[h] = map->key[i];
 			newval[h] = map->val[i];
+			break;
 		}
 	}
 
-	delete_map_keys(map->key, map->size);
+	// The keys moved to the new table //
+	free(map->key);
 	free(map->val);
 	map->key = newkey;
 	map->val = newval;
@@ -97,7 +101,7 @@ static void maybe_rehash(Map* map)
 	map->nused = map->nelem;
 }
 
-static void* map_get_nostack(Map* map, const char* key)
+static void* map_get_nostack(const Map* map, const char* key)
 {
 	if (!map->key)
 		return NULL;
@@ -129,6 +133,16 @@ Map* map_new_parent(Map* parent)
 	return map;
 }
 
+void map_free(Map* map)
+{
+	if (!map)
+		return;
+	if (map->key)
+		delete_map_keys(map->key, map->size);
+	free(map->val);
+	free(map);
+}
+
 void* map_get(const Map* map, const char* key)
 {
 	void* val = map_get_nostack(map, key);
@@ -147,19 +161,19 @@ BOOL map_put(Map* map, const char* key, void* value)
 		const char* k = map->key[i];
 		if (!k || k == GRAVESTONE)
 		{
-			map->key[i] = key;
+			map->key[i] = copy_key(key);
 			map->val[i] = value;
 			++map->nelem;
 
 			if (!k)
 				++map->nused;
-			return;
+			return TRUE;
 		}
 
-		if (!strcmp(key, k) != 0)
+		if (strcmp(key, k) == 0)
 		{
 			map->val[i] = value;
-			return;
+			return FALSE;
 		}
 	}
 }
@@ -20,6 +20,7 @@ inline void map_init(Map* map) { map_init_parent(map, NULL); }
 
 Map* map_new();
 Map* map_new_parent(Map* parent);
+void map_free(Map* map);
 
 void* map_get(const Map* map, const char* key);
 inline BOOL map_has(const Map* map, const char* key) { return BOOL_TEST(map_get(map, key)); }
@@ -33,4 +34,4 @@ BOOL map_erase(Map* map, const char* key);
 size_t map_len(const Map* map);
 
 
-#endif KSP_SUPPORT_MAP_H
\ No newline at end of file
+#endif
\ No newline at end of file
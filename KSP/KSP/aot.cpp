@@ -0,0 +1,326 @@
+#include "aot.h"
+
+#include <sstream>
+
+#include "vm.h"
+#include "ops.h"
+#include "arrays.h"
+
+namespace
+{
+	using ksp::bytecode::Instruction;
+	using ksp::module_info::Function;
+
+	std::string fn_symbol(const size_t index)
+	{
+		return "__ksp_aot_fn" + std::to_string(index);
+	}
+
+	std::string hex(const uint64_t value)
+	{
+		std::ostringstream os;
+		os << "0x" << std::hex << value << "ULL";
+		return os.str();
+	}
+
+	/* Masks a value the way REG_SET_BYTE/WORD/LONG do. */
+	std::string masked(const ksp::opcode_t op, const std::string& value)
+	{
+		switch (op)
+		{
+			case ksp::opcode::PUTB: case ksp::opcode::MOVB: case ksp::opcode::PUTMOVB: return "static_cast<ksp::reg_t>(" + value + ") & 0xffU";
+			case ksp::opcode::PUTW: case ksp::opcode::MOVW: case ksp::opcode::PUTMOVW: return "static_cast<ksp::reg_t>(" + value + ") & 0xffffU";
+			default: return "static_cast<ksp::reg_t>(" + value + ")";
+		}
+	}
+
+	std::string reg(const unsigned index) { return "r[" + std::to_string(index) + "]"; }
+	std::string heap(const uint32_t offset) { return "heap + " + std::to_string(offset); }
+
+	class FunctionEmitter
+	{
+	private:
+		const ksp::Module& _module;
+		std::ostream& _out;
+		const ksp::bytecode::ArrayOperands* _arrays;
+
+	public:
+		FunctionEmitter(const ksp::Module& module, std::ostream& out) :
+			_module{ module },
+			_out{ out },
+			_arrays{ nullptr }
+		{}
+
+		void emit(const size_t index)
+		{
+			const Function& f = *_module.fastFunctionAccessor[index];
+			_arrays = f.fastArrayOperandAccessor;
+
+			_out << "static ksp::reg_t " << fn_symbol(index) << "(ksp::RuntimeState& state, ksp::KSP_State* ksp_state, const ksp::Module* module)\n{\n";
+			_out << "\tksp::CallInfo* const ci = state.ci;\n";
+			_out << "\tksp::reg_t* const r = ci->regs_base;\n";
+			_out << "\tchar* const heap = ci->heap_base;\n";
+			_out << "\t(void) r; (void) heap; (void) ksp_state; (void) module;\n\n";
+
+			for (const Instruction* pc = f.fastInstructionAccessor; ; ++pc)
+				if (!instruction(*pc))
+					break;
+
+			_out << "}\n\n";
+		}
+
+	private:
+		void line(const std::string& code) { _out << '\t' << code << '\n'; }
+
+		/* Emits one instruction; false after the last one that can run. */
+		bool instruction(const Instruction& in)
+		{
+			namespace op = ksp::opcode;
+
+			switch (in.op)
+			{
+				case op::NOP:
+					return true;
+
+				case op::PUTB: case op::PUTW: case op::PUTL:
+					line(reg(in.a) + " = " + masked(in.op, hex(in.k)) + ";");
+					return true;
+				case op::PUTQ:
+					line("ksp::aot::set_quad(r + " + std::to_string(in.a) + ", " + hex(in.k) + ");");
+					return true;
+
+				case op::MOVB: case op::MOVW: case op::MOVL:
+					line(reg(in.b) + " = " + masked(in.op, reg(in.a)) + ";");
+					return true;
+				case op::MOVQ:
+					line("ksp::aot::set_quad(r + " + std::to_string(in.b) + ", ksp::aot::get_quad(r + " + std::to_string(in.a) + "));");
+					return true;
+
+				case op::PUTMOVB: case op::PUTMOVW: case op::PUTMOVL:
+					line(reg(in.a) + " = " + masked(in.op, hex(in.k)) + ";");
+					line(reg(in.b) + " = " + reg(in.a) + ";");
+					return true;
+				case op::PUTMOVQ:
+					line("ksp::aot::set_quad(r + " + std::to_string(in.a) + ", " + hex(in.k) + ");");
+					line("ksp::aot::set_quad(r + " + std::to_string(in.b) + ", " + hex(in.k) + ");");
+					return true;
+
+				case op::ACOPY: case op::AFILL: case op::ACMP:
+				case op::AADD: case op::AMUL: case op::AMIN: case op::AMAX:
+					array(in);
+					return true;
+
+				case op::LDF: case op::STF:
+					field(in);
+					return true;
+
+				case op::CALL:
+					call(in);
+					return true;
+
+				case op::TAILCALL:
+					tail_call(in);
+					return false;
+
+				case op::RET:
+					line("return " + reg(in.a) + ";");
+					return false;
+
+				default: /* HALT */
+					line("state.status = ksp::ExecutionStatus::Finished;");
+					line("return state.rret = " + reg(in.a) + ";");
+					return false;
+			}
+		}
+
+		void array(const Instruction& in)
+		{
+			namespace op = ksp::opcode;
+
+			const ksp::bytecode::ArrayOperands& ops = _arrays[in.k];
+			const std::string kind = "static_cast<ksp::TypeKind>(" + std::to_string(static_cast<int>(ops.kind)) + ")";
+			const size_t element = ksp::arrays::element_size(ops.kind);
+
+			switch (in.op)
+			{
+				case op::ACOPY:
+					line("ksp::arrays::copy(" + heap(ops.dst) + ", " + heap(ops.src0) + ", " + std::to_string(ops.count * element) + ");");
+					break;
+				case op::AFILL: {
+					const std::string value = element > sizeof(ksp::reg_t) ? "ksp::aot::get_quad(r + " + std::to_string(ops.src0) + ")" : reg(ops.src0);
+					line("ksp::arrays::fill(" + kind + ", " + heap(ops.dst) + ", " + value + ", " + std::to_string(ops.count) + ");");
+				} break;
+				case op::ACMP:
+					line(reg(ops.dst) + " = static_cast<ksp::reg_t>(ksp::arrays::compare(" + kind + ", " + heap(ops.src0) + ", " + heap(ops.src1) + ", " + std::to_string(ops.count) + "));");
+					break;
+				default: {
+					static const char* const names[] = { "Add", "Mul", "Min", "Max" };
+					line("ksp::arrays::binary(ksp::arrays::Operation::" + std::string{ names[in.op - op::AADD] } + ", " + kind + ", "
+						+ heap(ops.dst) + ", " + heap(ops.src0) + ", " + heap(ops.src1) + ", " + std::to_string(ops.count) + ");");
+				} break;
+			}
+		}
+
+		/* k and c hold the heap offset and the width of the field once built. */
+		void field(const Instruction& in)
+		{
+			const std::string type = in.c == 1 ? "uint8_t" : in.c == 2 ? "uint16_t" : in.c == 4 ? "uint32_t" : "uint64_t";
+			const std::string ptr = "reinterpret_cast<" + type + "*>(" + heap(static_cast<uint32_t>(in.k)) + ")";
+
+			if (in.op == ksp::opcode::LDF)
+			{
+				if (in.c == 8)
+					line("ksp::aot::set_quad(r + " + std::to_string(in.a) + ", *" + ptr + ");");
+				else line(reg(in.a) + " = *" + ptr + ";");
+			}
+			else
+			{
+				if (in.c == 8)
+					line("*" + ptr + " = ksp::aot::get_quad(r + " + std::to_string(in.b) + ");");
+				else line("*" + ptr + " = static_cast<" + type + ">(" + reg(in.b) + ");");
+			}
+		}
+
+		/* The value of running callee 'index' on the frame just pushed. */
+		std::string invoke(const size_t index) const
+		{
+			if (ksp::aot::compilable(_module, *_module.fastFunctionAccessor[index]))
+				return fn_symbol(index) + "(state, ksp_state, module)";
+			return "ksp::aot::call_interpreted(state, ksp_state, module, *module->fastFunctionAccessor[" + std::to_string(index) + "])";
+		}
+
+		/* Same frames as the CALL handler: a window over the arguments unless the callee has a heap. */
+		void call(const Instruction& in)
+		{
+			const Function& callee = *_module.fastFunctionAccessor[in.k];
+			const std::string args = "r + " + std::to_string(in.a);
+
+			line("{");
+			if (callee.fastExtraStackSize == 0)
+				line("\tstate.push_call_window(" + args + ", " + std::to_string(callee.fastRegisterCount) + ");");
+			else
+			{
+				line("\tstate.push_call_info(" + std::to_string(callee.fastRegisterCount) + ", " + std::to_string(callee.fastExtraStackSize) + ");");
+				line("\tstd::memcpy(state.ci->regs_base, " + args + ", " + std::to_string(callee.fastParameterCount * sizeof(ksp::reg_t)) + ");");
+			}
+			line("\tconst ksp::reg_t value = " + invoke(static_cast<size_t>(in.k)) + ";");
+			line("\tif (state.status != ksp::ExecutionStatus::Running)");
+			line("\t\treturn value;");
+			line("\tstate.ci = ci;");
+			line("\t" + reg(in.a) + " = value;");
+			line("}");
+		}
+
+		/* Reuses the frame like the TAILCALL handler; the C++ compiler is left to turn the call into a jump. */
+		void tail_call(const Instruction& in)
+		{
+			const Function& callee = *_module.fastFunctionAccessor[in.k];
+
+			line("state.reuse_call_info(" + std::to_string(callee.fastRegisterCount) + ", " + std::to_string(callee.fastExtraStackSize) + ");");
+			line("std::memmove(state.ci->regs_base, r + " + std::to_string(in.a) + ", " + std::to_string(callee.fastParameterCount * sizeof(ksp::reg_t)) + ");");
+			line("return " + invoke(static_cast<size_t>(in.k)) + ";");
+		}
+	};
+}
+
+bool ksp::aot::compilable(const Module& module, const module_info::Function& function)
+{
+	function.materialize();
+	return function.fastInstructionAccessor && !function.reachesYield(module);
+}
+
+uint64_t ksp::aot::fingerprint(const module_info::Function& function)
+{
+	function.materialize();
+
+	/*
+	 * FNV-1a over the frame shape and everything the translation bakes in: the decoded code up to
+	 * its end, with the field offsets and widths build() resolved into LDF and STF, and the array
+	 * operands of the bulk instructions.
+	 */
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	auto mix = [&hash](const uint64_t value) {
+		for (size_t i = 0; i < sizeof(value); ++i)
+		{
+			hash ^= (value >> (i * 8)) & 0xffU;
+			hash *= 0x100000001b3ULL;
+		}
+	};
+
+	mix(function.fastRegisterCount);
+	mix(function.fastParameterCount);
+	mix(function.fastExtraStackSize);
+	for (const bytecode::Instruction* pc = function.fastInstructionAccessor; pc; ++pc)
+	{
+		mix(pc->op);
+		mix(pc->a);
+		mix(pc->b);
+		mix(pc->c);
+		mix(pc->k);
+		if (pc->op >= opcode::ACOPY && pc->op <= opcode::AMAX)
+		{
+			const bytecode::ArrayOperands& ops = function.fastArrayOperandAccessor[pc->k];
+			mix(ops.dst);
+			mix(ops.src0);
+			mix(ops.src1);
+			mix(ops.count);
+			mix(static_cast<uint64_t>(ops.kind));
+		}
+		if (pc->op == opcode::HALT || pc->op == opcode::RET || pc->op == opcode::TAILCALL)
+			break;
+	}
+	return hash;
+}
+
+void ksp::aot::emit(const Module& module, std::ostream& out, const std::string& symbol)
+{
+	const size_t count = module.content.functionCount();
+	for (size_t i = 0; i < count; ++i)
+		module.fastFunctionAccessor[i]->materialize();
+
+	std::vector<std::string> names(count);
+	for (const auto& p : module.content.elements())
+		if (p.second.kind() == module_info::NameTable::Kind::Function)
+			names[p.second.offset()] = p.first;
+
+	out << "/* Generated by ksp::aot::emit. Do not edit; regenerate it from the module instead. */\n\n";
+	out << "#include <cstring>\n\n";
+	out << "#include \"aot.h\"\n";
+	out << "#include \"arrays.h\"\n";
+	out << "#include \"runtime.h\"\n";
+	out << "#include \"vm.h\"\n\n";
+
+	for (size_t i = 0; i < count; ++i)
+		if (compilable(module, *module.fastFunctionAccessor[i]))
+			out << "static ksp::reg_t " << fn_symbol(i) << "(ksp::RuntimeState& state, ksp::KSP_State* ksp_state, const ksp::Module* module);\n";
+	out << "\n";
+
+	FunctionEmitter emitter{ module, out };
+	for (size_t i = 0; i < count; ++i)
+	{
+		if (!compilable(module, *module.fastFunctionAccessor[i]))
+			continue;
+		out << "/* " << names[i] << " */\n";
+		emitter.emit(i);
+	}
+
+	out << "bool " << symbol << "(ksp::Module& module)\n{\n";
+	out << "\tstatic const uint64_t fingerprints[] = {";
+	for (size_t i = 0; i < count; ++i)
+		out << (i % 4 == 0 ? "\n\t\t" : " ") << hex(fingerprint(*module.fastFunctionAccessor[i])) << ",";
+	out << "\n\t\t0\n\t};\n";
+	out << "\tstatic const ksp::aot_code_t code[] = {";
+	for (size_t i = 0; i < count; ++i)
+		out << "\n\t\t" << (compilable(module, *module.fastFunctionAccessor[i]) ? "&" + fn_symbol(i) : std::string{ "nullptr" }) << ",";
+	out << "\n\t\tnullptr\n\t};\n\n";
+
+	out << "\tif (module.content.functionCount() != " << count << ")\n";
+	out << "\t\treturn false;\n";
+	out << "\tfor (size_t i = 0; i < " << count << "; ++i)\n";
+	out << "\t\tif (ksp::aot::fingerprint(*module.fastFunctionAccessor[i]) != fingerprints[i])\n";
+	out << "\t\t\treturn false;\n";
+	out << "\tfor (size_t i = 0; i < " << count << "; ++i)\n";
+	out << "\t\tmodule.fastFunctionAccessor[i]->fastAotCode = code[i];\n";
+	out << "\treturn true;\n";
+	out << "}\n";
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "support.h"
+
+#include <cstring>
+#include <iostream>
+#include <string>
+
+namespace ksp
+{
+	struct RuntimeState;
+	struct KSP_State;
+	struct Module;
+
+	namespace module_info
+	{
+		class Function;
+	}
+
+	/*
+	 * Ahead-of-time compiled Function. Runs on the frame already pushed in state.ci, the
+	 * same frame the interpreter would use, and returns the value of its RET or HALT.
+	 * A HALT also leaves state.status Finished so that callers stop too.
+	 */
+	typedef reg_t (*aot_code_t)(RuntimeState& state, KSP_State* ksp_state, const Module* module);
+
+	/*
+	 * Translation of a built Module into C++, to compile with the program instead of
+	 * interpreting at run time. Translated and interpreted functions share the CallInfo
+	 * frame layout, so each can CALL the other: the interpreter enters a Function through
+	 * its fastAotCode, and translated code runs callees it has no code for through
+	 * call_interpreted.
+	 */
+	namespace aot
+	{
+		/*
+		 * False for functions whose calls can reach a YIELD in 'module' (see Function::reachesYield):
+		 * C++ code can not suspend, so those stay interpreted.
+		 */
+		bool compilable(const Module& module, const module_info::Function& function);
+
+		/*
+		 * Hash of the code of 'function' and of the frame layout its variables give it, checked
+		 * when binding translated code to it.
+		 */
+		uint64_t fingerprint(const module_info::Function& function);
+
+		/*
+		 * Writes a translation unit defining `bool <symbol>(ksp::Module& module)`. Called on
+		 * a Module built from the same code, after Module::build, it sets the fastAotCode of
+		 * every translated function; it returns false, binding nothing, if the code differs.
+		 */
+		void emit(const Module& module, std::ostream& out, const std::string& symbol);
+
+		/*
+		 * Interprets 'function' on the frame translated code has pushed for it, until its
+		 * RET or a HALT. Throws InvalidExecutionState, dropping the execution, if it YIELDs.
+		 */
+		reg_t call_interpreted(RuntimeState& state, KSP_State* ksp_state, const Module* module, const module_info::Function& function);
+
+		/* Quad register access for translated code. */
+		inline uint64_t get_quad(const reg_t* reg)
+		{
+			uint64_t value;
+			std::memcpy(&value, reg, sizeof(value));
+			return value;
+		}
+		inline void set_quad(reg_t* reg, const uint64_t value)
+		{
+			std::memcpy(reg, &value, sizeof(value));
+		}
+	}
+}
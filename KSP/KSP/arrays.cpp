@@ -0,0 +1,414 @@
+#include "arrays.h"
+
+#include <cstring>
+#include <type_traits>
+
+#include "batch.h"
+
+#if defined(__KSP_ARRAY_SIMD)
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <immintrin.h>
+#endif
+#endif
+
+using ksp::TypeKind;
+using ksp::arrays::Operation;
+
+namespace
+{
+	constexpr size_t kind_count = static_cast<size_t>(TypeKind::Function) + 1;
+	constexpr size_t operation_count = static_cast<size_t>(Operation::Max) + 1;
+
+	typedef void (*binary_kernel_t)(void* dst, const void* a, const void* b, const size_t count);
+	typedef int (*compare_kernel_t)(const void* a, const void* b, const size_t count);
+	typedef void (*fill_kernel_t)(void* dst, const uint64_t value, const size_t count);
+
+	/* Integer arithmetic goes through unsigned types of at least 32 bits, so it wraps instead of overflowing. */
+	template<typename _Ty>
+	using wrap_t = std::conditional_t<(sizeof(_Ty) < sizeof(uint32_t)), uint32_t, std::make_unsigned_t<_Ty>>;
+
+	/* Unsigned type with the size of _Ty; fills copy register bits, they do not convert values. */
+	template<typename _Ty>
+	using bits_t = std::conditional_t<sizeof(_Ty) == 1, uint8_t,
+		std::conditional_t<sizeof(_Ty) == 2, uint16_t,
+		std::conditional_t<sizeof(_Ty) == 4, uint32_t, uint64_t>>>;
+
+	struct Add
+	{
+		template<typename _Ty>
+		static inline _Ty apply(const _Ty a, const _Ty b)
+		{
+			if constexpr (std::is_floating_point_v<_Ty>)
+				return a + b;
+			else return static_cast<_Ty>(static_cast<wrap_t<_Ty>>(a) + static_cast<wrap_t<_Ty>>(b));
+		}
+	};
+
+	struct Mul
+	{
+		template<typename _Ty>
+		static inline _Ty apply(const _Ty a, const _Ty b)
+		{
+			if constexpr (std::is_floating_point_v<_Ty>)
+				return a * b;
+			else return static_cast<_Ty>(static_cast<wrap_t<_Ty>>(a) * static_cast<wrap_t<_Ty>>(b));
+		}
+	};
+
+	/* Same operand order as the SSE/AVX min and max, so both paths agree on NaNs. */
+	struct Min
+	{
+		template<typename _Ty>
+		static inline _Ty apply(const _Ty a, const _Ty b) { return a < b ? a : b; }
+	};
+
+	struct Max
+	{
+		template<typename _Ty>
+		static inline _Ty apply(const _Ty a, const _Ty b) { return a > b ? a : b; }
+	};
+
+	template<typename _Ty>
+	inline _Ty load_element(const void* base, const size_t index)
+	{
+		_Ty value;
+		std::memcpy(&value, static_cast<const uint8_t*>(base) + index * sizeof(_Ty), sizeof(_Ty));
+		return value;
+	}
+
+	template<typename _Ty>
+	inline void store_element(void* base, const size_t index, const _Ty value)
+	{
+		std::memcpy(static_cast<uint8_t*>(base) + index * sizeof(_Ty), &value, sizeof(_Ty));
+	}
+
+	template<typename _Ty>
+	inline int compare_element(const void* a, const void* b, const size_t index)
+	{
+		const _Ty x = load_element<_Ty>(a, index);
+		const _Ty y = load_element<_Ty>(b, index);
+		return x < y ? -1 : (y < x ? 1 : 0);
+	}
+
+
+
+	// Scalar kernels, also the tails of the vector ones //
+
+	template<typename _Ty, typename _Op>
+	void binary_scalar(void* dst, const void* a, const void* b, const size_t count)
+	{
+		for (size_t i = 0; i < count; ++i)
+			store_element<_Ty>(dst, i, _Op::apply(load_element<_Ty>(a, i), load_element<_Ty>(b, i)));
+	}
+
+	template<typename _Ty>
+	int compare_scalar(const void* a, const void* b, const size_t count)
+	{
+		for (size_t i = 0; i < count; ++i)
+			if (const int r = compare_element<_Ty>(a, b, i))
+				return r;
+		return 0;
+	}
+
+	template<typename _Ty>
+	void fill_scalar(void* dst, const uint64_t value, const size_t count)
+	{
+		const _Ty element = static_cast<_Ty>(value);
+		for (size_t i = 0; i < count; ++i)
+			store_element<_Ty>(dst, i, element);
+	}
+
+
+
+	// AVX2 kernels //
+
+#if defined(__KSP_ARRAY_SIMD)
+	/* One 256-bit operation per (element type, Operation) pair that has an AVX2 instruction. */
+	template<typename _Ty, typename _Op>
+	struct Avx2Op
+	{
+		static constexpr bool available = false;
+	};
+
+#define __KSP_AVX2_OP(_Type, _Op, _Expr) \
+	template<> struct Avx2Op<_Type, _Op> \
+	{ \
+		static constexpr bool available = true; \
+		__KSP_TARGET("avx2") static inline __m256i apply(const __m256i a, const __m256i b) { return _Expr; } \
+	}
+#define __PS(_Expr) _mm256_castps_si256(_Expr)
+#define __PD(_Expr) _mm256_castpd_si256(_Expr)
+#define __A_PS _mm256_castsi256_ps(a)
+#define __B_PS _mm256_castsi256_ps(b)
+#define __A_PD _mm256_castsi256_pd(a)
+#define __B_PD _mm256_castsi256_pd(b)
+
+	__KSP_AVX2_OP(int8_t, Add, _mm256_add_epi8(a, b));
+	__KSP_AVX2_OP(int8_t, Min, _mm256_min_epi8(a, b));
+	__KSP_AVX2_OP(int8_t, Max, _mm256_max_epi8(a, b));
+	__KSP_AVX2_OP(uint8_t, Add, _mm256_add_epi8(a, b));
+	__KSP_AVX2_OP(uint8_t, Min, _mm256_min_epu8(a, b));
+	__KSP_AVX2_OP(uint8_t, Max, _mm256_max_epu8(a, b));
+
+	__KSP_AVX2_OP(int16_t, Add, _mm256_add_epi16(a, b));
+	__KSP_AVX2_OP(int16_t, Mul, _mm256_mullo_epi16(a, b));
+	__KSP_AVX2_OP(int16_t, Min, _mm256_min_epi16(a, b));
+	__KSP_AVX2_OP(int16_t, Max, _mm256_max_epi16(a, b));
+	__KSP_AVX2_OP(uint16_t, Add, _mm256_add_epi16(a, b));
+	__KSP_AVX2_OP(uint16_t, Mul, _mm256_mullo_epi16(a, b));
+	__KSP_AVX2_OP(uint16_t, Min, _mm256_min_epu16(a, b));
+	__KSP_AVX2_OP(uint16_t, Max, _mm256_max_epu16(a, b));
+
+	__KSP_AVX2_OP(int32_t, Add, _mm256_add_epi32(a, b));
+	__KSP_AVX2_OP(int32_t, Mul, _mm256_mullo_epi32(a, b));
+	__KSP_AVX2_OP(int32_t, Min, _mm256_min_epi32(a, b));
+	__KSP_AVX2_OP(int32_t, Max, _mm256_max_epi32(a, b));
+	__KSP_AVX2_OP(uint32_t, Add, _mm256_add_epi32(a, b));
+	__KSP_AVX2_OP(uint32_t, Mul, _mm256_mullo_epi32(a, b));
+	__KSP_AVX2_OP(uint32_t, Min, _mm256_min_epu32(a, b));
+	__KSP_AVX2_OP(uint32_t, Max, _mm256_max_epu32(a, b));
+
+	__KSP_AVX2_OP(int64_t, Add, _mm256_add_epi64(a, b));
+	__KSP_AVX2_OP(uint64_t, Add, _mm256_add_epi64(a, b));
+
+	__KSP_AVX2_OP(float, Add, __PS(_mm256_add_ps(__A_PS, __B_PS)));
+	__KSP_AVX2_OP(float, Mul, __PS(_mm256_mul_ps(__A_PS, __B_PS)));
+	__KSP_AVX2_OP(float, Min, __PS(_mm256_min_ps(__A_PS, __B_PS)));
+	__KSP_AVX2_OP(float, Max, __PS(_mm256_max_ps(__A_PS, __B_PS)));
+	__KSP_AVX2_OP(double, Add, __PD(_mm256_add_pd(__A_PD, __B_PD)));
+	__KSP_AVX2_OP(double, Mul, __PD(_mm256_mul_pd(__A_PD, __B_PD)));
+	__KSP_AVX2_OP(double, Min, __PD(_mm256_min_pd(__A_PD, __B_PD)));
+	__KSP_AVX2_OP(double, Max, __PD(_mm256_max_pd(__A_PD, __B_PD)));
+
+#undef __B_PD
+#undef __A_PD
+#undef __B_PS
+#undef __A_PS
+#undef __PD
+#undef __PS
+#undef __KSP_AVX2_OP
+
+	inline unsigned lowest_bit(const uint32_t mask)
+	{
+#if defined(_MSC_VER)
+		unsigned long index;
+		_BitScanForward(&index, mask);
+		return static_cast<unsigned>(index);
+#else
+		return static_cast<unsigned>(__builtin_ctz(mask));
+#endif
+	}
+
+	template<typename _Ty, typename _Op>
+	__KSP_TARGET("avx2") __KSP_FLATTEN void binary_avx2(void* dst, const void* a, const void* b, const size_t count)
+	{
+		constexpr size_t lanes = sizeof(__m256i) / sizeof(_Ty);
+		uint8_t* const d = static_cast<uint8_t*>(dst);
+		const uint8_t* const x = static_cast<const uint8_t*>(a);
+		const uint8_t* const y = static_cast<const uint8_t*>(b);
+
+		size_t i = 0;
+		for (; i + lanes <= count; i += lanes)
+		{
+			const __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(x + i * sizeof(_Ty)));
+			const __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(y + i * sizeof(_Ty)));
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(d + i * sizeof(_Ty)), Avx2Op<_Ty, _Op>::apply(va, vb));
+		}
+		binary_scalar<_Ty, _Op>(d + i * sizeof(_Ty), x + i * sizeof(_Ty), y + i * sizeof(_Ty), count - i);
+	}
+
+	/* Finds differing bytes 32 at a time; only the element holding the first one is compared by value. */
+	template<typename _Ty>
+	__KSP_TARGET("avx2") __KSP_FLATTEN int compare_avx2(const void* a, const void* b, const size_t count)
+	{
+		const uint8_t* const x = static_cast<const uint8_t*>(a);
+		const uint8_t* const y = static_cast<const uint8_t*>(b);
+		const size_t bytes = count * sizeof(_Ty);
+
+		size_t i = 0;
+		while (i + sizeof(__m256i) <= bytes)
+		{
+			const __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(x + i));
+			const __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(y + i));
+			const uint32_t diff = ~static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb)));
+			if (!diff)
+			{
+				i += sizeof(__m256i);
+				continue;
+			}
+
+			/* Elements can differ in bits but be equal in value (0.0 and -0.0): keep scanning after them. */
+			const size_t element = (i + lowest_bit(diff)) / sizeof(_Ty);
+			if (const int r = compare_element<_Ty>(a, b, element))
+				return r;
+			i = (element + 1) * sizeof(_Ty);
+		}
+		return compare_scalar<_Ty>(x + i, y + i, count - i / sizeof(_Ty));
+	}
+
+	template<typename _Ty>
+	__KSP_TARGET("avx2") __KSP_FLATTEN void fill_avx2(void* dst, const uint64_t value, const size_t count)
+	{
+		constexpr size_t lanes = sizeof(__m256i) / sizeof(_Ty);
+		uint8_t* const d = static_cast<uint8_t*>(dst);
+
+		__m256i v;
+		if constexpr (sizeof(_Ty) == 1)
+			v = _mm256_set1_epi8(static_cast<char>(value));
+		else if constexpr (sizeof(_Ty) == 2)
+			v = _mm256_set1_epi16(static_cast<short>(value));
+		else if constexpr (sizeof(_Ty) == 4)
+			v = _mm256_set1_epi32(static_cast<int>(value));
+		else v = _mm256_set1_epi64x(static_cast<long long>(value));
+
+		size_t i = 0;
+		for (; i + lanes <= count; i += lanes)
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(d + i * sizeof(_Ty)), v);
+		fill_scalar<_Ty>(d + i * sizeof(_Ty), value, count - i);
+	}
+#endif
+
+
+
+	struct Kernels
+	{
+		bool simd;
+		size_t sizes[kind_count];
+		binary_kernel_t binary[operation_count][kind_count];
+		compare_kernel_t compare[kind_count];
+		fill_kernel_t fill[kind_count];
+	};
+
+	template<typename _Ty, typename _Op>
+	binary_kernel_t pick_binary(const bool simd)
+	{
+#if defined(__KSP_ARRAY_SIMD)
+		if constexpr (Avx2Op<_Ty, _Op>::available)
+		{
+			if (simd)
+				return &binary_avx2<_Ty, _Op>;
+		}
+#endif
+		return &binary_scalar<_Ty, _Op>;
+	}
+
+	template<typename _Ty>
+	void set_storage(Kernels& k, const TypeKind kind)
+	{
+		const size_t idx = static_cast<size_t>(kind);
+		k.sizes[idx] = sizeof(_Ty);
+		k.compare[idx] = &compare_scalar<_Ty>;
+		k.fill[idx] = &fill_scalar<bits_t<_Ty>>;
+#if defined(__KSP_ARRAY_SIMD)
+		if (k.simd)
+		{
+			k.compare[idx] = &compare_avx2<_Ty>;
+			k.fill[idx] = &fill_avx2<bits_t<_Ty>>;
+		}
+#endif
+	}
+
+	template<typename _Ty>
+	void set_numeric(Kernels& k, const TypeKind kind)
+	{
+		set_storage<_Ty>(k, kind);
+
+		const size_t idx = static_cast<size_t>(kind);
+		k.binary[static_cast<size_t>(Operation::Add)][idx] = pick_binary<_Ty, Add>(k.simd);
+		k.binary[static_cast<size_t>(Operation::Mul)][idx] = pick_binary<_Ty, Mul>(k.simd);
+		k.binary[static_cast<size_t>(Operation::Min)][idx] = pick_binary<_Ty, Min>(k.simd);
+		k.binary[static_cast<size_t>(Operation::Max)][idx] = pick_binary<_Ty, Max>(k.simd);
+	}
+
+	Kernels make_kernels(const bool simd)
+	{
+		Kernels k{};
+		k.simd = simd;
+		set_numeric<int8_t>(k, TypeKind::Byte);
+		set_numeric<int16_t>(k, TypeKind::Short);
+		set_numeric<int32_t>(k, TypeKind::Integer);
+		set_numeric<int64_t>(k, TypeKind::Long);
+		set_numeric<uint8_t>(k, TypeKind::UByte);
+		set_numeric<uint16_t>(k, TypeKind::UShort);
+		set_numeric<uint32_t>(k, TypeKind::UInteger);
+		set_numeric<uint64_t>(k, TypeKind::ULong);
+		set_numeric<float>(k, TypeKind::Float);
+		set_numeric<double>(k, TypeKind::Double);
+
+		set_storage<uint8_t>(k, TypeKind::Boolean);
+		set_storage<uint16_t>(k, TypeKind::Character);
+		set_storage<uintptr_t>(k, TypeKind::Pointer);
+		return k;
+	}
+
+	const Kernels& kernels()
+	{
+#if defined(__KSP_ARRAY_SIMD)
+		static const Kernels table = make_kernels(ksp::batch::isa_supported(ksp::batch::Isa::AVX2));
+#else
+		static const Kernels table = make_kernels(false);
+#endif
+		return table;
+	}
+
+	const Kernels& scalar_kernels()
+	{
+		static const Kernels table = make_kernels(false);
+		return table;
+	}
+}
+
+size_t ksp::arrays::element_size(const TypeKind kind)
+{
+	const size_t idx = static_cast<size_t>(kind);
+	return idx < kind_count ? kernels().sizes[idx] : 0;
+}
+
+bool ksp::arrays::arithmetic(const TypeKind kind)
+{
+	const size_t idx = static_cast<size_t>(kind);
+	return idx < kind_count && kernels().binary[0][idx] != nullptr;
+}
+
+bool ksp::arrays::simd()
+{
+	return kernels().simd;
+}
+
+void ksp::arrays::copy(void* dst, const void* src, const size_t bytes)
+{
+	/* The C library copy already uses the widest vectors available. */
+	std::memmove(dst, src, bytes);
+}
+
+void ksp::arrays::fill(const TypeKind kind, void* dst, const uint64_t value, const size_t count)
+{
+	kernels().fill[static_cast<size_t>(kind)](dst, value, count);
+}
+
+int ksp::arrays::compare(const TypeKind kind, const void* a, const void* b, const size_t count)
+{
+	return kernels().compare[static_cast<size_t>(kind)](a, b, count);
+}
+
+void ksp::arrays::binary(const Operation op, const TypeKind kind, void* dst, const void* a, const void* b, const size_t count)
+{
+	kernels().binary[static_cast<size_t>(op)][static_cast<size_t>(kind)](dst, a, b, count);
+}
+
+void ksp::arrays::scalar::fill(const TypeKind kind, void* dst, const uint64_t value, const size_t count)
+{
+	scalar_kernels().fill[static_cast<size_t>(kind)](dst, value, count);
+}
+
+int ksp::arrays::scalar::compare(const TypeKind kind, const void* a, const void* b, const size_t count)
+{
+	return scalar_kernels().compare[static_cast<size_t>(kind)](a, b, count);
+}
+
+void ksp::arrays::scalar::binary(const Operation op, const TypeKind kind, void* dst, const void* a, const void* b, const size_t count)
+{
+	scalar_kernels().binary[static_cast<size_t>(op)][static_cast<size_t>(kind)](dst, a, b, count);
+}
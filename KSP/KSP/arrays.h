@@ -0,0 +1,56 @@
+#pragma once
+
+#include "support.h"
+#include "types.h"
+
+/* AVX2 array kernels for x86-64, used when the CPU has it. Define __KSP_NO_ARRAY_SIMD to keep only the scalar ones. */
+#if !defined(__KSP_NO_ARRAY_SIMD) && (defined(__x86_64__) || defined(_M_X64))
+#define __KSP_ARRAY_SIMD
+#endif
+
+namespace ksp
+{
+	/*
+	 * Kernels behind the bulk array opcodes. Element types are given by the component
+	 * TypeKind of the arrays; Boolean, Character and Pointer elements are handled as the
+	 * unsigned integers of their size. Integer arithmetic wraps around.
+	 */
+	namespace arrays
+	{
+		enum class Operation
+		{
+			Add,
+			Mul,
+			Min,
+			Max
+		};
+
+		/* Size of one element of 'kind', or 0 for kinds that can not be array elements here. */
+		size_t element_size(const TypeKind kind);
+
+		/* True for the numeric kinds accepted by binary(). */
+		bool arithmetic(const TypeKind kind);
+
+		/* True when the AVX2 kernels are in use. */
+		bool simd();
+
+		void copy(void* dst, const void* src, const size_t bytes);
+
+		/* Stores the low element_size(kind) bytes of 'value' in every element. */
+		void fill(const TypeKind kind, void* dst, const uint64_t value, const size_t count);
+
+		/* Lexicographic comparison by element value: -1, 0 or 1. */
+		int compare(const TypeKind kind, const void* a, const void* b, const size_t count);
+
+		/* dst[i] = a[i] op b[i]. 'dst' may be 'a' or 'b'. */
+		void binary(const Operation op, const TypeKind kind, void* dst, const void* a, const void* b, const size_t count);
+
+		/* The portable kernels, in use when simd() is false: those the AVX2 ones must match. */
+		namespace scalar
+		{
+			void fill(const TypeKind kind, void* dst, const uint64_t value, const size_t count);
+			int compare(const TypeKind kind, const void* a, const void* b, const size_t count);
+			void binary(const Operation op, const TypeKind kind, void* dst, const void* a, const void* b, const size_t count);
+		}
+	}
+}
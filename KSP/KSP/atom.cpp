@@ -0,0 +1,112 @@
+#include "atom.h"
+
+#include <mutex>
+#include <stdexcept>
+#include <string_view>
+#include <unordered_map>
+
+std::atomic<ksp::atoms::Entry*> ksp::atoms::chunks[ksp::atoms::max_chunks];
+
+namespace
+{
+	using namespace ksp::atoms;
+
+	/*
+	 * Interns strings into the chunks. Readers index them without locking: an id only
+	 * reaches other threads after its entry has been written, and chunks never move.
+	 * The empty string, id 0, is interned as soon as the table exists.
+	 */
+	class AtomTable
+	{
+	private:
+		std::mutex _mutex;
+		std::unordered_map<std::string_view, uint32_t> _ids;
+		std::atomic<uint32_t> _count;
+
+	public:
+		AtomTable() :
+			_mutex{},
+			_ids{},
+			_count{ 0 }
+		{
+			intern({});
+		}
+		AtomTable(const AtomTable&) = delete;
+
+		inline size_t count() const { return _count.load(std::memory_order_acquire); }
+
+		uint32_t intern(const std::string& str)
+		{
+			std::lock_guard<std::mutex> lock{ _mutex };
+
+			auto it = _ids.find(str);
+			if (it != _ids.end())
+				return it->second;
+
+			const uint32_t id = _count.load(std::memory_order_relaxed);
+			if ((id >> chunk_bits) >= max_chunks)
+				throw std::length_error{ "Too many atoms" };
+
+			Entry* chunk = chunks[id >> chunk_bits].load(std::memory_order_relaxed);
+			if (!chunk)
+			{
+				chunk = new Entry[chunk_size];
+				chunks[id >> chunk_bits].store(chunk, std::memory_order_release);
+			}
+
+			Entry& e = chunk[id & (chunk_size - 1)];
+			e.str = str;
+			e.hash = ksp::Atom::hash_of(str);
+			_ids.emplace(std::string_view{ e.str }, id);
+			_count.store(id + 1, std::memory_order_release);
+			return id;
+		}
+
+		bool find(const std::string& str, uint32_t& id)
+		{
+			std::lock_guard<std::mutex> lock{ _mutex };
+
+			auto it = _ids.find(str);
+			if (it == _ids.end())
+				return false;
+			id = it->second;
+			return true;
+		}
+	};
+
+	AtomTable& atom_table()
+	{
+		static AtomTable table;
+		return table;
+	}
+}
+
+ksp::Atom::Atom() :
+	_id{ 0 }
+{
+	atom_table();
+}
+ksp::Atom::Atom(const std::string& str) :
+	_id{ atom_table().intern(str) }
+{}
+ksp::Atom::Atom(const char* str) :
+	Atom{ std::string{ str } }
+{}
+
+uint64_t ksp::Atom::hash_of(const std::string& str)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (const char c : str)
+		hash = (hash ^ static_cast<uint8_t>(c)) * 0x100000001b3ULL;
+	return hash;
+}
+
+bool ksp::Atom::find(const std::string& str, Atom& atom)
+{
+	return atom_table().find(str, atom._id);
+}
+
+size_t ksp::Atom::count()
+{
+	return atom_table().count();
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include "support.h"
+
+#include <atomic>
+#include <functional>
+#include <string>
+
+namespace ksp
+{
+	namespace atoms
+	{
+		struct Entry
+		{
+			std::string str;
+			uint64_t hash;
+		};
+
+		constexpr size_t chunk_bits = 12;
+		constexpr size_t chunk_size = size_t{ 1 } << chunk_bits;
+		constexpr size_t max_chunks = size_t{ 1 } << 16;
+
+		/* Entries by id, in chunks that never move; chunk i holds ids [i * chunk_size, (i + 1) * chunk_size). */
+		extern std::atomic<Entry*> chunks[max_chunks];
+
+		inline const Entry& entry(const uint32_t id) { return chunks[id >> chunk_bits].load(std::memory_order_acquire)[id & (chunk_size - 1)]; }
+	}
+
+	/*
+	 * Interned identifier. Every distinct string is stored once, in a process wide table,
+	 * and an Atom is the 32 bit index of its entry, so copying, comparing and hashing atoms
+	 * are O(1). Creating an Atom takes a lock the first time a string is seen; reading one
+	 * never does. Atoms are never freed.
+	 */
+	class Atom
+	{
+	private:
+		uint32_t _id;
+
+	public:
+		/* The empty string. */
+		Atom();
+		Atom(const std::string& str);
+		Atom(const char* str);
+
+		inline uint32_t id() const { return _id; }
+
+		inline const std::string& str() const { return atoms::entry(_id).str; }
+		inline operator const std::string& () const { return str(); }
+
+		/* hash_of(str()), computed once when the string was interned. */
+		inline uint64_t hash() const { return atoms::entry(_id).hash; }
+
+		inline bool empty() const { return _id == 0; }
+
+		inline bool operator== (const Atom& atom) const { return _id == atom._id; }
+		inline bool operator!= (const Atom& atom) const { return _id != atom._id; }
+
+		/* FNV-1a of the bytes of 'str'. */
+		static uint64_t hash_of(const std::string& str);
+
+		/* Looks 'str' up without interning it. Returns false if no Atom of it exists. */
+		static bool find(const std::string& str, Atom& atom);
+
+		/* Number of distinct strings interned so far, the empty one included. */
+		static size_t count();
+
+		/* Orders atoms, and strings, by their characters; for containers iterated in name order. */
+		struct NameLess
+		{
+			typedef void is_transparent;
+
+			inline bool operator() (const Atom& a0, const Atom& a1) const { return a0 != a1 && a0.str() < a1.str(); }
+			inline bool operator() (const Atom& a0, const std::string& s1) const { return a0.str() < s1; }
+			inline bool operator() (const std::string& s0, const Atom& a1) const { return s0 < a1.str(); }
+		};
+	};
+}
+
+namespace std
+{
+	template<>
+	struct hash<ksp::Atom>
+	{
+		inline size_t operator() (const ksp::Atom& atom) const { return static_cast<size_t>(atom.hash()); }
+	};
+}
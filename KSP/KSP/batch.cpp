@@ -0,0 +1,340 @@
+#include "batch.h"
+
+#include <cstring>
+
+#include "vm.h"
+#include "ops.h"
+
+#if defined(__KSP_BATCH_SIMD)
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <immintrin.h>
+#endif
+#endif
+
+using ksp::reg_t;
+using ksp::bytecode::Instruction;
+
+namespace
+{
+	/* Register rows of one block: row r holds register r of __KSP_BATCH_BLOCK consecutive rows. */
+	inline reg_t* row(reg_t* regs, const size_t reg) { return regs + reg * __KSP_BATCH_BLOCK; }
+
+	/*
+	 * The row kernels of one instruction set; run_block is written once against this interface.
+	 * Vectors never leave a kernel, so that no function built without the ISA passes one around.
+	 */
+	struct ScalarLanes
+	{
+		static inline void put(reg_t* dst, const reg_t value)
+		{
+			for (size_t i = 0; i < __KSP_BATCH_BLOCK; ++i)
+				dst[i] = value;
+		}
+
+		static inline void mov(reg_t* dst, const reg_t* src, const reg_t mask)
+		{
+			for (size_t i = 0; i < __KSP_BATCH_BLOCK; ++i)
+				dst[i] = src[i] & mask;
+		}
+
+		/* Quads span two rows; both halves of a lane are loaded before storing, as the scalar 64-bit copy does. */
+		static inline void movq(reg_t* dlo, reg_t* dhi, const reg_t* slo, const reg_t* shi)
+		{
+			for (size_t i = 0; i < __KSP_BATCH_BLOCK; ++i)
+			{
+				const reg_t lo = slo[i];
+				const reg_t hi = shi[i];
+				dlo[i] = lo;
+				dhi[i] = hi;
+			}
+		}
+	};
+
+#if defined(__KSP_BATCH_SIMD)
+	struct Avx2Lanes
+	{
+		__KSP_TARGET("avx2") static inline void put(reg_t* dst, const reg_t value)
+		{
+			const __m256i v = _mm256_set1_epi32(static_cast<int>(value));
+			for (size_t i = 0; i < __KSP_BATCH_BLOCK; i += 8)
+				_mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), v);
+		}
+
+		__KSP_TARGET("avx2") static inline void mov(reg_t* dst, const reg_t* src, const reg_t mask)
+		{
+			const __m256i m = _mm256_set1_epi32(static_cast<int>(mask));
+			for (size_t i = 0; i < __KSP_BATCH_BLOCK; i += 8)
+				_mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_and_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i)), m));
+		}
+
+		__KSP_TARGET("avx2") static inline void movq(reg_t* dlo, reg_t* dhi, const reg_t* slo, const reg_t* shi)
+		{
+			for (size_t i = 0; i < __KSP_BATCH_BLOCK; i += 8)
+			{
+				const __m256i lo = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(slo + i));
+				const __m256i hi = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(shi + i));
+				_mm256_storeu_si256(reinterpret_cast<__m256i*>(dlo + i), lo);
+				_mm256_storeu_si256(reinterpret_cast<__m256i*>(dhi + i), hi);
+			}
+		}
+	};
+
+	struct Avx512Lanes
+	{
+		__KSP_TARGET("avx512f") static inline void put(reg_t* dst, const reg_t value)
+		{
+			const __m512i v = _mm512_set1_epi32(static_cast<int>(value));
+			for (size_t i = 0; i < __KSP_BATCH_BLOCK; i += 16)
+				_mm512_storeu_si512(dst + i, v);
+		}
+
+		__KSP_TARGET("avx512f") static inline void mov(reg_t* dst, const reg_t* src, const reg_t mask)
+		{
+			const __m512i m = _mm512_set1_epi32(static_cast<int>(mask));
+			for (size_t i = 0; i < __KSP_BATCH_BLOCK; i += 16)
+				_mm512_storeu_si512(dst + i, _mm512_and_si512(_mm512_loadu_si512(src + i), m));
+		}
+
+		__KSP_TARGET("avx512f") static inline void movq(reg_t* dlo, reg_t* dhi, const reg_t* slo, const reg_t* shi)
+		{
+			for (size_t i = 0; i < __KSP_BATCH_BLOCK; i += 16)
+			{
+				const __m512i lo = _mm512_loadu_si512(slo + i);
+				const __m512i hi = _mm512_loadu_si512(shi + i);
+				_mm512_storeu_si512(dlo + i, lo);
+				_mm512_storeu_si512(dhi + i, hi);
+			}
+		}
+	};
+#endif
+
+	static_assert(__KSP_BATCH_BLOCK % 16 == 0, "__KSP_BATCH_BLOCK must be a multiple of every vector width");
+
+	template<typename _Lanes>
+	inline void movq(reg_t* regs, const size_t src, const size_t dst)
+	{
+		_Lanes::movq(row(regs, dst), row(regs, dst + 1), row(regs, src), row(regs, src + 1));
+	}
+
+	template<typename _Lanes>
+	inline void putq(reg_t* regs, const size_t dst, const uint64_t value)
+	{
+		_Lanes::put(row(regs, dst), static_cast<reg_t>(value));
+		_Lanes::put(row(regs, dst + 1), static_cast<reg_t>(value >> 32));
+	}
+
+	/* Runs every instruction over one block and returns the row of the HALT register. */
+	template<typename _Lanes>
+	const reg_t* run_block(const Instruction* pc, reg_t* regs)
+	{
+		namespace op = ksp::opcode;
+
+		for (;; ++pc)
+		{
+			switch (pc->op)
+			{
+				case op::NOP: break;
+
+				case op::PUTB: _Lanes::put(row(regs, pc->a), static_cast<reg_t>(pc->k) & 0xffU); break;
+				case op::PUTW: _Lanes::put(row(regs, pc->a), static_cast<reg_t>(pc->k) & 0xffffU); break;
+				case op::PUTL: _Lanes::put(row(regs, pc->a), static_cast<reg_t>(pc->k)); break;
+				case op::PUTQ: putq<_Lanes>(regs, pc->a, pc->k); break;
+
+				case op::MOVB: _Lanes::mov(row(regs, pc->b), row(regs, pc->a), 0xffU); break;
+				case op::MOVW: _Lanes::mov(row(regs, pc->b), row(regs, pc->a), 0xffffU); break;
+				case op::MOVL: _Lanes::mov(row(regs, pc->b), row(regs, pc->a), 0xffffffffU); break;
+				case op::MOVQ: movq<_Lanes>(regs, pc->a, pc->b); break;
+
+				case op::PUTMOVB:
+					_Lanes::put(row(regs, pc->a), static_cast<reg_t>(pc->k) & 0xffU);
+					_Lanes::put(row(regs, pc->b), static_cast<reg_t>(pc->k) & 0xffU);
+					break;
+				case op::PUTMOVW:
+					_Lanes::put(row(regs, pc->a), static_cast<reg_t>(pc->k) & 0xffffU);
+					_Lanes::put(row(regs, pc->b), static_cast<reg_t>(pc->k) & 0xffffU);
+					break;
+				case op::PUTMOVL:
+					_Lanes::put(row(regs, pc->a), static_cast<reg_t>(pc->k));
+					_Lanes::put(row(regs, pc->b), static_cast<reg_t>(pc->k));
+					break;
+				case op::PUTMOVQ:
+					putq<_Lanes>(regs, pc->a, pc->k);
+					putq<_Lanes>(regs, pc->b, pc->k);
+					break;
+
+				default: /* HALT; supported() let nothing else through */
+					return row(regs, pc->a);
+			}
+		}
+	}
+
+	struct Job
+	{
+		const Instruction* code;
+		size_t registers;
+		const reg_t* const* inputs;
+		size_t input_count;
+		reg_t* outputs;
+		size_t rows;
+	};
+
+	template<typename _Lanes>
+	void run_blocks(const Job& job)
+	{
+		std::vector<reg_t> regs(job.registers * __KSP_BATCH_BLOCK);
+
+		for (size_t base = 0; base < job.rows; base += __KSP_BATCH_BLOCK)
+		{
+			const size_t count = job.rows - base < __KSP_BATCH_BLOCK ? job.rows - base : __KSP_BATCH_BLOCK;
+
+			std::memset(regs.data(), 0, regs.size() * sizeof(reg_t));
+			for (size_t i = 0; i < job.input_count; ++i)
+				std::memcpy(row(regs.data(), i), job.inputs[i] + base, count * sizeof(reg_t));
+
+			const reg_t* result = run_block<_Lanes>(job.code, regs.data());
+			std::memcpy(job.outputs + base, result, count * sizeof(reg_t));
+		}
+	}
+
+	void run_scalar(const Job& job) { run_blocks<ScalarLanes>(job); }
+
+#if defined(__KSP_BATCH_SIMD)
+	/* flatten inlines the whole kernel into the ISA specific entry points, where the intrinsics are allowed. */
+	__KSP_TARGET("avx2") __KSP_FLATTEN void run_avx2(const Job& job) { run_blocks<Avx2Lanes>(job); }
+	__KSP_TARGET("avx512f") __KSP_FLATTEN void run_avx512(const Job& job) { run_blocks<Avx512Lanes>(job); }
+#endif
+
+	bool has_register_operands(const Instruction& inst, size_t& highest)
+	{
+		namespace op = ksp::opcode;
+
+		switch (inst.op)
+		{
+			case op::NOP: return true;
+
+			case op::PUTB: case op::PUTW: case op::PUTL: case op::HALT:
+				highest = ksp::max<size_t>(highest, inst.a);
+				return true;
+			case op::PUTQ:
+				highest = ksp::max<size_t>(highest, inst.a + 1U);
+				return true;
+
+			case op::MOVB: case op::MOVW: case op::MOVL:
+			case op::PUTMOVB: case op::PUTMOVW: case op::PUTMOVL:
+				highest = ksp::max<size_t>(highest, ksp::max(inst.a, inst.b));
+				return true;
+			case op::MOVQ: case op::PUTMOVQ:
+				highest = ksp::max<size_t>(highest, ksp::max(inst.a, inst.b) + 1U);
+				return true;
+
+			default:
+				return false;
+		}
+	}
+
+	/* Rows needed to hold every register the code touches, or 0 if it can not run in batch. */
+	size_t required_registers(const ksp::module_info::Function& function)
+	{
+		function.materialize();
+		const Instruction* pc = function.fastInstructionAccessor;
+		if (!pc)
+			return 0;
+
+		size_t highest = 0;
+		for (;; ++pc)
+		{
+			if (!has_register_operands(*pc, highest))
+				return 0;
+			if (pc->op == ksp::opcode::HALT)
+				return highest + 1;
+		}
+	}
+}
+
+ksp::batch::Isa ksp::batch::best_isa()
+{
+	static const Isa isa = []() {
+		if (isa_supported(Isa::AVX512))
+			return Isa::AVX512;
+		if (isa_supported(Isa::AVX2))
+			return Isa::AVX2;
+		return Isa::Scalar;
+	}();
+	return isa;
+}
+
+bool ksp::batch::isa_supported(const Isa isa)
+{
+	switch (isa)
+	{
+		case Isa::Scalar:
+			return true;
+
+#if defined(__KSP_BATCH_SIMD)
+#if defined(_MSC_VER)
+		case Isa::AVX2:
+		case Isa::AVX512: {
+			int info[4];
+			__cpuid(info, 0);
+			if (info[0] < 7)
+				return false;
+			__cpuid(info, 1);
+			const bool osxsave = (info[2] & (1 << 27)) != 0;
+			if (!osxsave)
+				return false;
+			const unsigned long long xcr0 = _xgetbv(0);
+			__cpuidex(info, 7, 0);
+			if (isa == Isa::AVX2)
+				return (xcr0 & 0x6) == 0x6 && (info[1] & (1 << 5)) != 0;
+			return (xcr0 & 0xe6) == 0xe6 && (info[1] & (1 << 16)) != 0;
+		}
+#else
+		case Isa::AVX2:
+			return __builtin_cpu_supports("avx2");
+		case Isa::AVX512:
+			return __builtin_cpu_supports("avx512f");
+#endif
+#endif
+
+		default:
+			return false;
+	}
+}
+
+const char* ksp::batch::isa_name(const Isa isa)
+{
+	switch (isa)
+	{
+		case Isa::Scalar: return "scalar";
+		case Isa::AVX2: return "avx2";
+		case Isa::AVX512: return "avx512";
+		default: return "unknown";
+	}
+}
+
+bool ksp::batch::supported(const module_info::Function& function)
+{
+	return required_registers(function) > 0;
+}
+
+void ksp::batch::execute(const module_info::Function& function, const reg_t* const* inputs, const size_t input_count,
+	reg_t* outputs, const size_t rows, const Isa isa)
+{
+	const size_t used = required_registers(function);
+	if (used == 0)
+		throw InvalidBatch{ "Function uses opcodes without a batch kernel" };
+	if (!isa_supported(isa))
+		throw InvalidBatch{ std::string{ "ISA not supported by this CPU: " } + isa_name(isa) };
+
+	const Job job = { function.fastInstructionAccessor, max(used, input_count), inputs, input_count, outputs, rows };
+	switch (isa)
+	{
+#if defined(__KSP_BATCH_SIMD)
+		case Isa::AVX512: run_avx512(job); break;
+		case Isa::AVX2: run_avx2(job); break;
+#endif
+		default: run_scalar(job); break;
+	}
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "support.h"
+
+#include <exception>
+#include <string>
+
+/* Rows that go through an instruction together. A multiple of every vector width. */
+#define __KSP_BATCH_BLOCK (256)
+
+/* AVX2 and AVX-512 kernels for x86-64, picked at run time. Define __KSP_NO_BATCH_SIMD to keep only the scalar one. */
+#if !defined(__KSP_NO_BATCH_SIMD) && (defined(__x86_64__) || defined(_M_X64))
+#define __KSP_BATCH_SIMD
+#endif
+
+namespace ksp
+{
+	namespace module_info
+	{
+		class Function;
+	}
+
+	class InvalidBatch : exception
+	{
+	public:
+		inline InvalidBatch(const std::string& msg) :
+			exception{ msg.c_str() }
+		{}
+	};
+
+	/*
+	 * Runs one Function over many independent rows. The register file is kept as
+	 * structure of arrays, one row of __KSP_BATCH_BLOCK lanes per register, so every
+	 * instruction is dispatched once per block and runs as vector operations over 8
+	 * (AVX2) or 16 (AVX-512) lanes at a time.
+	 */
+	namespace batch
+	{
+		enum class Isa
+		{
+			Scalar,
+			AVX2,
+			AVX512
+		};
+
+		/* The widest Isa this CPU supports. */
+		Isa best_isa();
+
+		bool isa_supported(const Isa isa);
+
+		const char* isa_name(const Isa isa);
+
+		/* True when 'function' only uses register opcodes up to its first HALT (no YIELD). */
+		bool supported(const module_info::Function& function);
+
+		/*
+		 * Runs 'function' once per row. Register i of row r starts as inputs[i][r] for
+		 * i < input_count, every other register as 0; outputs[r] receives the value of
+		 * the HALT. Throws InvalidBatch for unsupported functions or an unavailable isa.
+		 */
+		void execute(const module_info::Function& function, const reg_t* const* inputs, const size_t input_count,
+			reg_t* outputs, const size_t rows, const Isa isa = best_isa());
+	}
+}
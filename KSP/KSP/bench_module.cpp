@@ -0,0 +1,39 @@
+#include "bench_module.h"
+
+#include "vm.h"
+#include "ops.h"
+
+void ksp::bench::build_aot_module(Module& mod)
+{
+	namespace info = ksp::opcode::info;
+
+	module_info::Function& main = mod.content.createNewElement("main").createFunction();
+	module_info::Function& leaf = mod.content.createNewElement("leaf").createFunction();
+
+	for (size_t i = 0; i < 4; ++i)
+		main.addVariable(Type::Integer, "r" + std::to_string(i));
+	leaf.addParameter(Type::Integer, "a");
+	leaf.addParameter(Type::Integer, "b");
+	mod.content.buildReferences();
+
+	bytecode::BytecodeBuilder builder;
+	for (size_t i = 0; i < 64; ++i)
+	{
+		for (size_t j = 0; j < 8; ++j)
+		{
+			builder.push_instruction(info::PUTW, { j & 1, i * 8 + j });
+			builder.push_instruction(info::MOVB, { j & 1, (j + 1) & 1 });
+		}
+		builder.push_instruction(info::MOVL, { 0, 3 });
+		builder.push_instruction(info::CALL, { 2, mod.content.getElement("leaf").offset() });
+	}
+	builder.push_instruction(info::HALT, { 2 });
+	main.addOpcodes(builder.build());
+
+	builder = {};
+	builder.push_instruction(info::MOVL, { 1, 0 });
+	builder.push_instruction(info::RET, { 0 });
+	leaf.addOpcodes(builder.build());
+
+	mod.build();
+}
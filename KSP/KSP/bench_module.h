@@ -0,0 +1,16 @@
+#pragma once
+
+namespace ksp
+{
+	struct Module;
+
+	namespace bench
+	{
+		/*
+		 * Builds the module of the aot_execute benchmark: 'main' runs PUT/MOV blocks between CALLs
+		 * of a 'leaf'. The aot-emit command of KSP translates it into bench_aot.cpp, which KSP Bench
+		 * binds back to it.
+		 */
+		void build_aot_module(Module& module);
+	}
+}
@@ -0,0 +1,112 @@
+#include "executor.h"
+
+/* Invocations claimed by a worker at a time, to keep the shared counter off the fast path. */
+#define __KSP_EXECUTOR_CHUNK (64)
+
+ksp::Executor::Executor(const Module& module, const size_t workers) :
+	_module{ module },
+	_workers{},
+	_mutex{},
+	_wake{},
+	_done{},
+	_generation{ 0 },
+	_stop{ false },
+	_batch{ nullptr },
+	_batchSize{ 0 },
+	_next{ 0 },
+	_pending{ 0 },
+	_error{}
+{
+	const size_t count = workers > 0 ? workers : 1;
+	_workers.reserve(count);
+	for (size_t i = 0; i < count; ++i)
+		_workers.emplace_back(new Worker{});
+	for (auto& w : _workers)
+		w->thread = std::thread{ &Executor::_work, this, std::ref(*w) };
+}
+ksp::Executor::~Executor()
+{
+	{
+		std::lock_guard<std::mutex> lock{ _mutex };
+		_stop = true;
+	}
+	_wake.notify_all();
+	for (auto& w : _workers)
+		w->thread.join();
+}
+
+void ksp::Executor::run(std::vector<Invocation>& invocations)
+{
+	if (invocations.empty())
+		return;
+
+	std::unique_lock<std::mutex> lock{ _mutex };
+	_batch = invocations.data();
+	_batchSize = invocations.size();
+	_next.store(0, std::memory_order_relaxed);
+	_pending = _workers.size();
+	++_generation;
+	_wake.notify_all();
+
+	_done.wait(lock, [this]() { return _pending == 0; });
+	_batch = nullptr;
+	_batchSize = 0;
+
+	if (_error)
+	{
+		std::exception_ptr error = _error;
+		_error = nullptr;
+		std::rethrow_exception(error);
+	}
+}
+
+void ksp::Executor::_work(Worker& worker)
+{
+	uint64_t seen = 0;
+	for (;;)
+	{
+		Invocation* batch;
+		size_t size;
+		{
+			std::unique_lock<std::mutex> lock{ _mutex };
+			_wake.wait(lock, [this, seen]() { return _stop || _generation != seen; });
+			if (_stop)
+				return;
+			seen = _generation;
+			batch = _batch;
+			size = _batchSize;
+		}
+
+		for (;;)
+		{
+			const size_t first = _next.fetch_add(__KSP_EXECUTOR_CHUNK, std::memory_order_relaxed);
+			if (first >= size)
+				break;
+
+			const size_t last = first + __KSP_EXECUTOR_CHUNK < size ? first + __KSP_EXECUTOR_CHUNK : size;
+			for (size_t i = first; i < last; ++i)
+			{
+				try
+				{
+					batch[i].result = execute(&worker.ksp_state, &_module, worker.state, *batch[i].function);
+					worker.state.cancel();
+				}
+				catch (...)
+				{
+					/* The state may hold the frames of the failed execution; the batch stops here. */
+					worker.state.reset();
+					_next.store(size, std::memory_order_relaxed);
+
+					std::lock_guard<std::mutex> lock{ _mutex };
+					if (!_error)
+						_error = std::current_exception();
+					break;
+				}
+			}
+		}
+
+		std::lock_guard<std::mutex> lock{ _mutex };
+		if (--_pending == 0)
+			_done.notify_one();
+	}
+}
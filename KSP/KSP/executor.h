@@ -0,0 +1,75 @@
+#pragma once
+
+#include "support.h"
+#include "runtime.h"
+#include "vm.h"
+
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace ksp
+{
+	/*
+	 * Fans independent invocations of one built Module out over a pool of worker
+	 * threads. Every worker owns its RuntimeState and KSP_State; the Module is only
+	 * read (see the thread safety notes of Module). An invocation that YIELDs is
+	 * cancelled there, with the yielded value as its result.
+	 */
+	class Executor
+	{
+	public:
+		struct Invocation
+		{
+			const module_info::Function* function;
+			reg_t result;
+		};
+
+	private:
+		struct Worker
+		{
+			std::thread thread;
+			RuntimeState state;
+			KSP_State ksp_state;
+		};
+
+		const Module& _module;
+		std::vector<std::unique_ptr<Worker>> _workers;
+
+		std::mutex _mutex;
+		std::condition_variable _wake;
+		std::condition_variable _done;
+		uint64_t _generation;
+		bool _stop;
+
+		Invocation* _batch;
+		size_t _batchSize;
+		std::atomic<size_t> _next;
+		size_t _pending;
+		std::exception_ptr _error;
+
+	public:
+		Executor(const Module& module, const size_t workers = std::thread::hardware_concurrency());
+		Executor(const Executor&) = delete;
+		~Executor();
+
+		Executor& operator= (const Executor&) = delete;
+
+		inline size_t workerCount() const { return _workers.size(); }
+
+		/*
+		 * Runs every invocation and blocks until all of them finished. Results are written in place.
+		 * If an invocation throws, the invocations not started yet are skipped and run() rethrows
+		 * the first error once every worker stopped; the results of the batch are then unspecified.
+		 */
+		void run(std::vector<Invocation>& invocations);
+
+		/* The KSP_State of one worker, to read its trace or profile after run(). */
+		inline const KSP_State& workerState(const size_t index) const { return _workers[index]->ksp_state; }
+
+	private:
+		void _work(Worker& worker);
+	};
+}
@@ -0,0 +1,518 @@
+#include "image.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "arrays.h"
+#include "ops.h"
+#include "vmem.h"
+
+namespace
+{
+	const char __image_magic[8] = { 'K', 'S', 'P', 'I', 'M', 'A', 'G', 'E' };
+	const uint32_t __image_byte_order = 0x01020304U;
+
+	using namespace ksp::image;
+	using ksp::TypeInfo;
+	using ksp::module_info::Function;
+	using ksp::module_info::NameTable;
+
+	/* Image under construction: one growing vector of records per section. */
+	class ImageWriter
+	{
+	private:
+		std::vector<TypeRecord> _types;
+		std::vector<TypeParameterRecord> _typeParameters;
+		std::vector<ConstantRecord> _constants;
+		std::vector<char> _constantData;
+		std::vector<NameRecord> _names;
+		std::vector<FunctionRecord> _functions;
+		std::vector<VariableRecord> _variables;
+		std::vector<uint32_t> _callees;
+		std::vector<ksp::bytecode::Instruction> _instructions;
+		std::vector<ksp::bytecode::ArrayOperands> _arrayOperands;
+		std::vector<ksp::opcode_t> _code;
+		std::vector<char> _strings;
+
+		std::unordered_map<const TypeInfo*, uint32_t> _typeIndices;
+		std::unordered_map<ksp::const_data_ptr_t, uint32_t> _constantIndices;
+		std::unordered_map<std::string, String> _stringIndices;
+
+	public:
+		void add(const ksp::Module& module)
+		{
+			const NameTable& table = module.content;
+
+			/* The element map is in name order, so the name records come out sorted. */
+			for (const auto& p : table.elements())
+			{
+				const NameTable::Element& e = p.second;
+				NameRecord record{};
+				record.name = string(p.first);
+				record.kind = e.kind();
+				switch (e.kind())
+				{
+					case NameTable::Kind::Type:
+						record.index = type(&e.getTypeMeta());
+						break;
+					case NameTable::Kind::Constant:
+						record.index = constant(*e.getConstantValue());
+						break;
+					case NameTable::Kind::Function:
+						record.index = static_cast<uint32_t>(e.offset());
+						break;
+					default:
+						continue;
+				}
+				_names.push_back(record);
+			}
+
+			for (size_t i = 0; i < table.functionCount(); ++i)
+				function(*module.fastFunctionAccessor[i]);
+		}
+
+		std::vector<char> layout() const
+		{
+			std::vector<char> out(sizeof(Header));
+			Header header{};
+			std::memcpy(header.magic, __image_magic, sizeof(header.magic));
+			header.version = __KSP_IMAGE_VERSION;
+			header.byte_order = __image_byte_order;
+			header.instruction_size = sizeof(ksp::bytecode::Instruction);
+			header.opcode_count = static_cast<uint32_t>(ksp::opcode::count);
+
+			header.types = append(out, _types);
+			header.type_parameters = append(out, _typeParameters);
+			header.constants = append(out, _constants);
+			header.constant_data = append(out, _constantData);
+			header.names = append(out, _names);
+			header.functions = append(out, _functions);
+			header.variables = append(out, _variables);
+			header.callees = append(out, _callees);
+			header.instructions = append(out, _instructions);
+			header.array_operands = append(out, _arrayOperands);
+			header.code = append(out, _code);
+			header.strings = append(out, _strings);
+			header.size = out.size();
+
+			/* Sections are patched with the code offsets of each function. */
+			FunctionRecord* functions = reinterpret_cast<FunctionRecord*>(out.data() + header.functions.offset);
+			for (size_t i = 0; i < _functions.size(); ++i)
+			{
+				functions[i].instructions += header.instructions.offset;
+				functions[i].code += header.code.offset;
+			}
+
+			std::memcpy(out.data(), &header, sizeof(header));
+			return out;
+		}
+
+	private:
+		template<typename _Ty>
+		static Section append(std::vector<char>& out, const std::vector<_Ty>& records)
+		{
+			out.resize((out.size() + 7) & ~static_cast<size_t>(7));
+			const Section section = { out.size(), records.size() };
+			const char* const data = reinterpret_cast<const char*>(records.data());
+			out.insert(out.end(), data, data + records.size() * sizeof(_Ty));
+			return section;
+		}
+
+		String string(const std::string& str)
+		{
+			auto it = _stringIndices.find(str);
+			if (it != _stringIndices.end())
+				return it->second;
+
+			const String s = { static_cast<uint32_t>(_strings.size()), static_cast<uint32_t>(str.size()) };
+			_strings.insert(_strings.end(), str.begin(), str.end());
+			_stringIndices.emplace(str, s);
+			return s;
+		}
+
+		uint32_t type(const TypeInfo* info)
+		{
+			/* Not isInvalid(): it is also true of Byte, whose kind is 0. */
+			if (!info || info == &TypeInfo::Invalid)
+				return no_type;
+
+			auto it = _typeIndices.find(info);
+			if (it != _typeIndices.end())
+				return it->second;
+
+			const uint32_t index = static_cast<uint32_t>(_types.size());
+			_typeIndices.emplace(info, index);
+			_types.emplace_back();
+
+			TypeRecord record{};
+			record.kind = info->kind();
+			record.size = info->size();
+			record.component = no_type;
+			switch (info->kind())
+			{
+				case ksp::TypeKind::Pointer:
+					record.component = type(info->componentType());
+					break;
+				case ksp::TypeKind::Array:
+					record.component = type(info->componentType());
+					record.element_count = info->elementCount();
+					break;
+				case ksp::TypeKind::Function: {
+					record.component = type(info->returnType());
+					std::vector<TypeParameterRecord> parameters;
+					for (const auto& param : info->parameters())
+						parameters.push_back({ type(param.type), string(param.name), 0, 0 });
+					record.parameters_first = static_cast<uint32_t>(_typeParameters.size());
+					record.parameters_count = static_cast<uint32_t>(parameters.size());
+					_typeParameters.insert(_typeParameters.end(), parameters.begin(), parameters.end());
+				} break;
+				case ksp::TypeKind::Struct: {
+					record.element_count = info->alignment();
+					std::vector<TypeParameterRecord> fields;
+					for (const auto& field : info->fields())
+						fields.push_back({ type(field.type), string(field.name), 0, field.offset });
+					record.parameters_first = static_cast<uint32_t>(_typeParameters.size());
+					record.parameters_count = static_cast<uint32_t>(fields.size());
+					_typeParameters.insert(_typeParameters.end(), fields.begin(), fields.end());
+				} break;
+				default:
+					break;
+			}
+
+			_types[index] = record;
+			return index;
+		}
+
+		/* Constants merged by NameTable::buildReferences share their bytes, and one record. */
+		uint32_t constant(const ksp::module_info::ConstantValue& value)
+		{
+			auto it = _constantIndices.find(value.data());
+			if (it != _constantIndices.end())
+				return it->second;
+
+			ConstantRecord record{};
+			record.type = type(&value.type());
+			record.data = (_constantData.size() + 7) & ~static_cast<uint64_t>(7);
+
+			_constantData.resize(static_cast<size_t>(record.data));
+			_constantData.insert(_constantData.end(), value.data(), value.data() + value.type().size());
+
+			_constants.push_back(record);
+			_constantIndices.emplace(value.data(), static_cast<uint32_t>(_constants.size() - 1));
+			return static_cast<uint32_t>(_constants.size() - 1);
+		}
+
+		void function(const Function& f)
+		{
+			FunctionRecord record{};
+			record.register_count = f.fastRegisterCount;
+			record.parameter_count = f.fastParameterCount;
+			record.return_type = type(&f.returnType());
+			record.extra_stack_size = f.fastExtraStackSize;
+
+			record.variables_first = static_cast<uint32_t>(_variables.size());
+			record.variables_count = f.variableCount();
+			for (size_t i = 0; i < f.variableCount(); ++i)
+			{
+				const Function::VariableInfo& var = f.variable(i);
+				_variables.push_back({ type(&var.type()), string(var.name()), var.isParameter() ? 1U : 0U, f.variableHeapOffset(i) });
+			}
+
+			const std::vector<ksp::bytecode::Instruction>& code = f.instructions();
+			record.instructions = _instructions.size() * sizeof(ksp::bytecode::Instruction);
+			record.instruction_count = code.size();
+			record.callees_first = static_cast<uint32_t>(_callees.size());
+			record.array_operands_first = _arrayOperands.size();
+			_arrayOperands.insert(_arrayOperands.end(), f.arrayOperands().begin(), f.arrayOperands().end());
+			for (const ksp::bytecode::Instruction& in : code)
+			{
+				ksp::bytecode::Instruction out = in;
+				out.handler = nullptr;
+
+				if (in.op == ksp::opcode::CALL || in.op == ksp::opcode::TAILCALL)
+				{
+					const uint32_t callee = static_cast<uint32_t>(in.k);
+					if (std::find(_callees.begin() + record.callees_first, _callees.end(), callee) == _callees.end())
+						_callees.push_back(callee);
+				}
+
+				_instructions.push_back(out);
+			}
+			record.callees_count = static_cast<uint32_t>(_callees.size() - record.callees_first);
+
+			record.code = _code.size();
+			record.code_size = f.opcodeCount();
+			_code.insert(_code.end(), f.opcodes().begin(), f.opcodes().end());
+
+			_functions.push_back(record);
+		}
+	};
+}
+
+
+
+void ksp::ModuleImage::write(const Module& module, const std::string& path)
+{
+	/* An image holds built code, stubs included. */
+	for (size_t i = 0; i < module.content.functionCount(); ++i)
+		module.fastFunctionAccessor[i]->materialize();
+
+	ImageWriter writer;
+	writer.add(module);
+	const std::vector<char> bytes = writer.layout();
+
+	std::ofstream file{ path, std::ios::binary | std::ios::trunc };
+	if (!file)
+		throw InvalidModuleImage{ "can not open " + path + " for writing" };
+	file.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+	if (!file)
+		throw InvalidModuleImage{ "can not write " + path };
+}
+
+ksp::ModuleImage::ModuleImage(const std::string& path) :
+	_base{ nullptr },
+	_size{ 0 },
+	_header{ nullptr },
+	_module{},
+	_functions{ nullptr },
+	_materialized{},
+	_mutex{}
+{
+	_base = reinterpret_cast<const char*>(vmem::map_file(path, _size));
+	if (!_base)
+		throw InvalidModuleImage{ "can not map " + path };
+
+	auto fail = [this, &path](const char* what) {
+		vmem::unmap_file(_base, _size);
+		throw InvalidModuleImage{ path + ": " + what };
+	};
+
+	if (_size < sizeof(image::Header))
+		fail("truncated header");
+	_header = reinterpret_cast<const image::Header*>(_base);
+
+	if (std::memcmp(_header->magic, __image_magic, sizeof(__image_magic)) != 0)
+		fail("not a module image");
+	if (_header->version != __KSP_IMAGE_VERSION)
+		fail("unsupported version");
+	if (_header->byte_order != __image_byte_order)
+		fail("written with another byte order");
+	if (_header->instruction_size != sizeof(bytecode::Instruction) || _header->opcode_count != opcode::count)
+		fail("written by an incompatible build");
+	if (_header->size != _size)
+		fail("size does not match the header");
+
+	const image::Section* const sections = &_header->types;
+	const size_t section_sizes[] = {
+		sizeof(image::TypeRecord), sizeof(image::TypeParameterRecord), sizeof(image::ConstantRecord), 1,
+		sizeof(image::NameRecord), sizeof(image::FunctionRecord), sizeof(image::VariableRecord), sizeof(uint32_t),
+		sizeof(bytecode::Instruction), sizeof(bytecode::ArrayOperands), sizeof(opcode_t), 1
+	};
+	for (size_t i = 0; i < sizeof(section_sizes) / sizeof(*section_sizes); ++i)
+		if (sections[i].offset > _size || sections[i].count > (_size - sections[i].offset) / section_sizes[i])
+			fail("section out of bounds");
+
+	/* Zero pages on demand: only the slots of looked up functions are ever touched. */
+	const size_t count = functionCount();
+	if (count > 0)
+	{
+		_functions = reinterpret_cast<module_info::Function**>(vmem::reserve(count * sizeof(module_info::Function*), 0));
+		if (!_functions)
+			fail("out of memory");
+	}
+	_module.fastFunctionAccessor = _functions;
+}
+ksp::ModuleImage::~ModuleImage()
+{
+	if (_functions)
+		vmem::release(_functions, functionCount() * sizeof(module_info::Function*), 0);
+	vmem::unmap_file(_base, _size);
+}
+
+size_t ksp::ModuleImage::_check(const image::Section& sec, const uint64_t first, const uint64_t count, const char* what) const
+{
+	/* Sections themselves were checked against the mapping when it was opened. */
+	if (first > sec.count || count > sec.count - first)
+		throw InvalidModuleImage{ std::string{ what } + " out of bounds" };
+	return static_cast<size_t>(first);
+}
+
+const ksp::image::FunctionRecord& ksp::ModuleImage::_checkFunction(const size_t index) const
+{
+	const image::FunctionRecord& record = functionRecord(index);
+
+	/* Code offsets are from the start of the image, like sections. */
+	auto code_range = [this](const image::Section& sec, const uint64_t offset, const uint64_t count, const size_t size, const char* what) {
+		if (offset < sec.offset || (offset - sec.offset) % size != 0)
+			throw InvalidModuleImage{ std::string{ what } + " out of bounds" };
+		_check(sec, (offset - sec.offset) / size, count, what);
+	};
+	code_range(_header->instructions, record.instructions, record.instruction_count, sizeof(bytecode::Instruction), "function instructions");
+	code_range(_header->code, record.code, record.code_size, sizeof(opcode_t), "function code");
+	_check(_header->variables, record.variables_first, record.variables_count, "function variables");
+	const uint32_t* const callees = section<uint32_t>(_header->callees) + _check(_header->callees, record.callees_first, record.callees_count, "function callees");
+	for (uint32_t c = 0; c < record.callees_count; ++c)
+		if (callees[c] >= functionCount())
+			throw InvalidModuleImage{ "callee out of bounds" };
+	const size_t operands = _header->array_operands.count - _check(_header->array_operands, record.array_operands_first, 0, "function array operands");
+
+	/* Straight-line code runs to its first HALT, RET or TAILCALL, which must come before the end. */
+	auto heap = [&record](const uint64_t offset, const uint64_t size) {
+		if (offset > record.extra_stack_size || size > record.extra_stack_size - offset)
+			throw InvalidModuleImage{ "operand outside the frame heap" };
+	};
+	const bytecode::Instruction* const code = reinterpret_cast<const bytecode::Instruction*>(_base + record.instructions);
+	for (uint64_t i = 0; ; ++i)
+	{
+		if (i == record.instruction_count)
+			throw InvalidModuleImage{ "function code does not end" };
+
+		const bytecode::Instruction& in = code[i];
+		if (in.op >= opcode::count)
+			throw InvalidModuleImage{ "unknown opcode" };
+
+		switch (in.op)
+		{
+			case opcode::CALL: case opcode::TAILCALL:
+				if (std::find(callees, callees + record.callees_count, in.k) == callees + record.callees_count)
+					throw InvalidModuleImage{ "call of a function missing from the callees" };
+				break;
+
+			case opcode::ACOPY: case opcode::AFILL: case opcode::ACMP:
+			case opcode::AADD: case opcode::AMUL: case opcode::AMIN: case opcode::AMAX: {
+				if (in.k >= operands)
+					throw InvalidModuleImage{ "array operands out of bounds" };
+				const bytecode::ArrayOperands& ops = section<bytecode::ArrayOperands>(_header->array_operands)[record.array_operands_first + in.k];
+				const size_t element = arrays::element_size(ops.kind);
+				if (element == 0 || (in.op >= opcode::AADD && !arrays::arithmetic(ops.kind)))
+					throw InvalidModuleImage{ "array operands of an unsupported kind" };
+				const uint64_t bytes = static_cast<uint64_t>(ops.count) * element;
+				if (in.op != opcode::ACMP)
+					heap(ops.dst, bytes);
+				if (in.op != opcode::AFILL)
+					heap(ops.src0, bytes);
+				if (in.op >= opcode::ACMP)
+					heap(ops.src1, bytes);
+			} break;
+
+			case opcode::LDF: case opcode::STF:
+				if (in.c != 1 && in.c != 2 && in.c != 4 && in.c != 8)
+					throw InvalidModuleImage{ "field of an unsupported width" };
+				heap(in.k, in.c);
+				break;
+
+			default:
+				break;
+		}
+		if (in.op == opcode::HALT || in.op == opcode::RET || in.op == opcode::TAILCALL)
+			return record;
+	}
+}
+
+const ksp::image::NameRecord* ksp::ModuleImage::_find(const std::string& name) const
+{
+	const image::NameRecord* const first = section<image::NameRecord>(_header->names);
+	const image::NameRecord* const last = first + _header->names.count;
+	const char* const strings = section<char>(_header->strings);
+
+	auto compare = [this, strings](const image::NameRecord& record, const std::string& key) {
+		const size_t len = record.name.size < key.size() ? record.name.size : key.size();
+		const int cmp = std::memcmp(strings + _check(_header->strings, record.name.offset, record.name.size, "name"), key.data(), len);
+		return cmp < 0 || (cmp == 0 && record.name.size < key.size());
+	};
+
+	const image::NameRecord* it = std::lower_bound(first, last, name, compare);
+	if (it == last || it->name.size != name.size()
+		|| std::memcmp(strings + _check(_header->strings, it->name.offset, it->name.size, "name"), name.data(), name.size()) != 0)
+		return nullptr;
+	return it;
+}
+
+bool ksp::ModuleImage::hasName(const std::string& name) const
+{
+	return _find(name) != nullptr;
+}
+
+const ksp::image::NameRecord& ksp::ModuleImage::name(const std::string& name) const
+{
+	const image::NameRecord* record = _find(name);
+	if (!record)
+		throw module_info::NameTable::ElementNotFound{ name };
+	return *record;
+}
+
+const ksp::module_info::Function& ksp::ModuleImage::function(const std::string& name)
+{
+	const image::NameRecord& record = this->name(name);
+	if (record.kind != module_info::NameTable::Kind::Function)
+		throw module_info::NameTable::ElementNotFound{ name };
+	return function(record.index);
+}
+
+const ksp::module_info::Function& ksp::ModuleImage::function(const size_t index)
+{
+	if (index >= functionCount())
+		throw module_info::NameTable::ElementNotFound{ "function #" + std::to_string(index) };
+
+	std::lock_guard<std::mutex> lock{ _mutex };
+	return *_materialize(index);
+}
+
+ksp::const_data_ptr_t ksp::ModuleImage::constant(const std::string& name) const
+{
+	const image::NameRecord& record = this->name(name);
+	if (record.kind != module_info::NameTable::Kind::Constant)
+		throw module_info::NameTable::ElementNotFound{ name };
+	return constant(record.index);
+}
+
+ksp::const_data_ptr_t ksp::ModuleImage::constant(const size_t index) const
+{
+	const image::ConstantRecord& record = constantRecord(index);
+	return section<char>(_header->constant_data) + _check(_header->constant_data, record.data, type(record.type).size, "constant data");
+}
+
+/*
+ * Creates the Functions of 'index' and of everything it can call, so that CALL never finds an empty slot.
+ * All of them are checked first: a rejected callee leaves no caller behind.
+ */
+ksp::module_info::Function* ksp::ModuleImage::_materialize(const size_t index)
+{
+	const uint32_t* const callees = section<uint32_t>(_header->callees);
+
+	std::vector<size_t> created;
+	std::unordered_set<size_t> checked;
+	std::vector<size_t> pending{ index };
+	while (!pending.empty())
+	{
+		const size_t i = pending.back();
+		pending.pop_back();
+		if (_functions[i] || !checked.insert(i).second)
+			continue;
+
+		const image::FunctionRecord& record = _checkFunction(i);
+		created.push_back(i);
+		for (uint32_t c = 0; c < record.callees_count; ++c)
+			pending.push_back(callees[record.callees_first + c]);
+	}
+
+	for (const size_t i : created)
+	{
+		const image::FunctionRecord& record = functionRecord(i);
+		std::unique_ptr<module_info::Function> f{ new module_info::Function };
+		f->fastRegisterCount = record.register_count;
+		f->fastParameterCount = record.parameter_count;
+		f->fastExtraStackSize = static_cast<size_t>(record.extra_stack_size);
+		f->fastCodeAccessor = const_cast<bytecode_t>(reinterpret_cast<const opcode_t*>(_base + record.code));
+		f->fastInstructionAccessor = reinterpret_cast<const bytecode::Instruction*>(_base + record.instructions);
+		f->fastArrayOperandAccessor = section<bytecode::ArrayOperands>(_header->array_operands) + record.array_operands_first;
+		f->fastMaterialized = true;
+
+		_functions[i] = f.get();
+		_materialized.push_back(std::move(f));
+	}
+	return _functions[index];
+}
@@ -0,0 +1,226 @@
+#pragma once
+
+#include "support.h"
+
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "vm.h"
+
+/* Bumped whenever the layout of a ModuleImage, or of bytecode::Instruction, changes. */
+#define __KSP_IMAGE_VERSION (3)
+
+namespace ksp
+{
+	class InvalidModuleImage : exception
+	{
+	public:
+		inline InvalidModuleImage(const std::string& msg) :
+			exception{ ("Invalid module image: " + msg).c_str() }
+		{}
+	};
+
+	/*
+	 * Records of the on-disk module image. Every section starts 8 byte aligned and every
+	 * offset is in bytes from the start of the image, so the file is used in place once
+	 * mapped. Strings are stored once in the string section and referenced by offset
+	 * and size. Integers use the byte order of the machine that wrote the image.
+	 */
+	namespace image
+	{
+		struct Section
+		{
+			uint64_t offset;
+			uint64_t count;
+		};
+
+		struct Header
+		{
+			char     magic[8];
+			uint32_t version;
+			uint32_t byte_order;
+			uint32_t instruction_size;
+			uint32_t opcode_count;
+			uint64_t size;
+
+			Section types;
+			Section type_parameters;
+			Section constants;
+			Section constant_data;
+			Section names;
+			Section functions;
+			Section variables;
+			Section callees;
+			Section instructions;
+			Section array_operands;
+			Section code;
+			Section strings;
+		};
+
+		struct String
+		{
+			uint32_t offset;
+			uint32_t size;
+		};
+
+		/*
+		 * One TypeInfo. 'component' is the component type of pointers and arrays, and the return
+		 * type of functions. 'element_count' is the alignment of structs, whose fields are
+		 * stored as parameters.
+		 */
+		struct TypeRecord
+		{
+			TypeKind kind;
+			uint32_t component;
+			uint64_t size;
+			uint64_t element_count;
+			uint32_t parameters_first;
+			uint32_t parameters_count;
+		};
+
+		/* 'offset' is that of a struct field; 0 for function parameters. */
+		struct TypeParameterRecord
+		{
+			uint32_t type;
+			String   name;
+			uint32_t _pad;
+			uint64_t offset;
+		};
+
+		/* 'data' is the offset of the constant bytes in the constant_data section. */
+		struct ConstantRecord
+		{
+			uint32_t type;
+			uint32_t _pad;
+			uint64_t data;
+		};
+
+		/* Sorted by name. 'index' is the position in the table of the element kind. */
+		struct NameRecord
+		{
+			String name;
+			module_info::NameTable::Kind kind;
+			uint32_t index;
+		};
+
+		/*
+		 * 'instructions' and 'code' are the decoded (handler-less) and byte encoded code of
+		 * the function; 'callees' lists the functions its CALL and TAILCALL instructions name.
+		 */
+		struct FunctionRecord
+		{
+			uint8_t  register_count;
+			uint8_t  parameter_count;
+			uint16_t _pad;
+			uint32_t return_type;
+			uint64_t extra_stack_size;
+			uint64_t instructions;
+			uint64_t instruction_count;
+			uint64_t code;
+			uint64_t code_size;
+			uint32_t variables_first;
+			uint32_t variables_count;
+			uint32_t callees_first;
+			uint32_t callees_count;
+			uint64_t array_operands_first;
+		};
+
+		struct VariableRecord
+		{
+			uint32_t type;
+			String   name;
+			uint32_t parameter;
+			uint64_t heap_offset;
+		};
+
+		/* Type index meaning "no type", e.g. the return type of a function that never set one. */
+		constexpr uint32_t no_type = 0xffffffffU;
+	}
+
+	/*
+	 * A Module written to disk and mapped back. Opening an image maps the file and checks
+	 * its header, nothing else: the constants, the name table and the decoded code of
+	 * every function are used where they lie in the mapping, so the cost of opening does
+	 * not grow with the module. Function objects are only created for the functions
+	 * looked up (and those they call), pointing their fast accessors into the mapping.
+	 *
+	 * The mapped instructions carry no resolved handlers; execute dispatches them through
+	 * the opcode table instead. Records are checked when first used, each index against the
+	 * count of its section and each range against the section it lies in; a function also
+	 * has its code checked when looked up, so that it can only call functions the image
+	 * creates with it and only reach its own frame heap. Any failure throws
+	 * InvalidModuleImage. Register operands are not checked, as for built code. Lookups may
+	 * run from several threads; the image must outlive every execution of its functions.
+	 */
+	class ModuleImage
+	{
+	private:
+		const char* _base;
+		size_t _size;
+		const image::Header* _header;
+
+		Module _module;
+		module_info::Function** _functions;
+		std::vector<std::unique_ptr<module_info::Function>> _materialized;
+		std::mutex _mutex;
+
+	public:
+		/* Maps the image at 'path'. Throws InvalidModuleImage if it can not be read or was written by an incompatible build. */
+		explicit ModuleImage(const std::string& path);
+		ModuleImage(const ModuleImage&) = delete;
+		~ModuleImage();
+
+		ModuleImage& operator= (const ModuleImage&) = delete;
+
+		/* Writes the built 'module' as an image. Throws InvalidModuleImage on I/O errors. */
+		static void write(const Module& module, const std::string& path);
+
+		inline const image::Header& header() const { return *_header; }
+
+		inline size_t typeCount() const { return static_cast<size_t>(_header->types.count); }
+		inline size_t constantCount() const { return static_cast<size_t>(_header->constants.count); }
+		inline size_t functionCount() const { return static_cast<size_t>(_header->functions.count); }
+
+		/* The Module to execute the functions with; CALL and TAILCALL find their callees through it. */
+		inline const Module& module() const { return _module; }
+
+		bool hasName(const std::string& name) const;
+
+		/* The name record of 'name'. Throws module_info::NameTable::ElementNotFound. */
+		const image::NameRecord& name(const std::string& name) const;
+
+		const module_info::Function& function(const std::string& name);
+		const module_info::Function& function(const size_t index);
+
+		/* Bytes of a constant, inside the mapping. */
+		const_data_ptr_t constant(const std::string& name) const;
+		const_data_ptr_t constant(const size_t index) const;
+
+		// Records. Throw InvalidModuleImage for an index or a range outside its section //
+		inline const image::TypeRecord& type(const size_t index) const { return section<image::TypeRecord>(_header->types)[_check(_header->types, index, 1, "type")]; }
+		inline const image::ConstantRecord& constantRecord(const size_t index) const { return section<image::ConstantRecord>(_header->constants)[_check(_header->constants, index, 1, "constant")]; }
+		inline const image::FunctionRecord& functionRecord(const size_t index) const { return section<image::FunctionRecord>(_header->functions)[_check(_header->functions, index, 1, "function")]; }
+
+		inline const image::VariableRecord* variables(const image::FunctionRecord& function) const { return section<image::VariableRecord>(_header->variables) + _check(_header->variables, function.variables_first, function.variables_count, "function variables"); }
+		inline const image::TypeParameterRecord* parameters(const image::TypeRecord& type) const { return section<image::TypeParameterRecord>(_header->type_parameters) + _check(_header->type_parameters, type.parameters_first, type.parameters_count, "type parameters"); }
+
+		inline std::string string(const image::String& str) const { return { section<char>(_header->strings) + _check(_header->strings, str.offset, str.size, "string"), str.size }; }
+
+	private:
+		template<typename _Ty>
+		inline const _Ty* section(const image::Section& sec) const { return reinterpret_cast<const _Ty*>(_base + sec.offset); }
+
+		/* 'first', once [first, first + count) is known to lie in 'sec'. */
+		size_t _check(const image::Section& sec, const uint64_t first, const uint64_t count, const char* what) const;
+
+		/* The record of function 'index', once its ranges and its code are checked. */
+		const image::FunctionRecord& _checkFunction(const size_t index) const;
+
+		const image::NameRecord* _find(const std::string& name) const;
+
+		module_info::Function* _materialize(const size_t index);
+	};
+}
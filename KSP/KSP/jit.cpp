@@ -0,0 +1,334 @@
+#include "jit.h"
+
+#include <cstring>
+#include <exception>
+
+#include "aot.h"
+#include "runtime.h"
+#include "vm.h"
+#include "ops.h"
+
+#if defined(__KSP_JIT)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+using ksp::opcode_t;
+using ksp::bytecode::Instruction;
+
+namespace
+{
+	/*
+	 * x86-64 templates. Native code is entered as native_code_t: rdi, rsi and rdx hold the
+	 * RuntimeState, KSP_State and Module, kept in rbx, r12 and r13 across calls. rsi is loaded
+	 * with the regs_base of state.ci and every register operand becomes [rsi + reg * 4].
+	 */
+	class Emitter
+	{
+	private:
+		std::vector<uint8_t> _code;
+
+	public:
+		inline const std::vector<uint8_t>& code() const { return _code; }
+
+		inline void byte(const uint8_t b) { _code.push_back(b); }
+		inline void bytes(std::initializer_list<uint8_t> bs) { _code.insert(_code.end(), bs); }
+		inline void imm32(const uint32_t v) { for (int i = 0; i < 4; ++i) byte(static_cast<uint8_t>(v >> (i * 8))); }
+		inline void imm64(const uint64_t v) { for (int i = 0; i < 8; ++i) byte(static_cast<uint8_t>(v >> (i * 8))); }
+		inline void reg(const uint8_t r) { imm32(static_cast<uint32_t>(r) * sizeof(ksp::reg_t)); }
+
+		// push rbx ; push r12 ; push r13 (which leaves rsp 16 byte aligned for calls) ; mov rbx, rdi ; mov r12, rsi ; mov r13, rdx
+		inline void prologue()
+		{
+			bytes({ 0x53, 0x41, 0x54, 0x41, 0x55, 0x48, 0x89, 0xFB, 0x49, 0x89, 0xF4, 0x49, 0x89, 0xD5 });
+			load_regs();
+		}
+
+		// mov rsi, [rbx + offsetof(RuntimeState, ci)] ; mov rsi, [rsi + offsetof(CallInfo, regs_base)]
+		inline void load_regs()
+		{
+			bytes({ 0x48, 0x8B, 0xB3 }); imm32(static_cast<uint32_t>(offsetof(ksp::RuntimeState, ci)));
+			bytes({ 0x48, 0x8B, 0x76, static_cast<uint8_t>(offsetof(ksp::CallInfo, regs_base)) });
+		}
+
+		// pop r13 ; pop r12 ; pop rbx ; ret
+		inline void epilogue() { bytes({ 0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3 }); }
+
+		// mov byte [rbx + offsetof(RuntimeState, status)], Finished ; mov [rbx + offsetof(RuntimeState, rret)], eax
+		inline void finish()
+		{
+			bytes({ 0xC6, 0x83 }); imm32(static_cast<uint32_t>(offsetof(ksp::RuntimeState, status))); byte(static_cast<uint8_t>(ksp::ExecutionStatus::Finished));
+			bytes({ 0x89, 0x83 }); imm32(static_cast<uint32_t>(offsetof(ksp::RuntimeState, rret)));
+		}
+
+		// mov rdi, rbx ; mov rsi, r12 ; mov rdx, r13 ; mov ecx, base ; mov r8d, index ; mov rax, helper ; call rax
+		inline void call(const void* helper, const uint8_t base, const uint32_t index)
+		{
+			bytes({ 0x48, 0x89, 0xDF, 0x4C, 0x89, 0xE6, 0x4C, 0x89, 0xEA });
+			byte(0xB9); imm32(base);
+			bytes({ 0x41, 0xB8 }); imm32(index);
+			bytes({ 0x48, 0xB8 }); imm64(reinterpret_cast<uint64_t>(helper));
+			bytes({ 0xFF, 0xD0 });
+		}
+
+		// cmp byte [rbx + offsetof(RuntimeState, status)], Running ; je past the epilogue ; epilogue
+		inline void return_unless_running()
+		{
+			bytes({ 0x80, 0xBB }); imm32(static_cast<uint32_t>(offsetof(ksp::RuntimeState, status))); byte(static_cast<uint8_t>(ksp::ExecutionStatus::Running));
+			bytes({ 0x74, 0x06 });
+			epilogue();
+		}
+
+		// mov dword [rsi + r*4], imm32
+		inline void put32(const uint8_t r, const uint32_t value) { bytes({ 0xC7, 0x86 }); reg(r); imm32(value); }
+
+		// mov rax, imm64 ; mov [rsi + r*4], rax
+		inline void put64(const uint8_t r, const uint64_t value) { bytes({ 0x48, 0xB8 }); imm64(value); bytes({ 0x48, 0x89, 0x86 }); reg(r); }
+
+		// movzx eax, byte [rsi + r*4]
+		inline void load8(const uint8_t r) { bytes({ 0x0F, 0xB6, 0x86 }); reg(r); }
+		// movzx eax, word [rsi + r*4]
+		inline void load16(const uint8_t r) { bytes({ 0x0F, 0xB7, 0x86 }); reg(r); }
+		// mov eax, [rsi + r*4]
+		inline void load32(const uint8_t r) { bytes({ 0x8B, 0x86 }); reg(r); }
+		// mov rax, [rsi + r*4]
+		inline void load64(const uint8_t r) { bytes({ 0x48, 0x8B, 0x86 }); reg(r); }
+
+		// mov [rsi + r*4], eax
+		inline void store32(const uint8_t r) { bytes({ 0x89, 0x86 }); reg(r); }
+		// mov [rsi + r*4], rax
+		inline void store64(const uint8_t r) { bytes({ 0x48, 0x89, 0x86 }); reg(r); }
+
+	};
+
+	/* Thrown below compiled code, kept until jit::run is back above it. */
+	thread_local std::exception_ptr __pending;
+
+	ksp::reg_t run_callee(ksp::RuntimeState& state, ksp::KSP_State* ksp_state, const ksp::Module* module, const ksp::module_info::Function& callee)
+	{
+		if (callee.fastAotCode)
+			return callee.fastAotCode(state, ksp_state, module);
+		if (ksp::native_code_t native = ksp::jit::code_for(module, callee))
+			return ksp::jit::run(native, state, ksp_state, module);
+		return ksp::aot::call_interpreted(state, ksp_state, module, callee);
+	}
+
+	/* The CALL of compiled code: the same frames as the CALL handler, then the value in the base register. */
+	ksp::reg_t call_helper(ksp::RuntimeState& state, ksp::KSP_State* ksp_state, const ksp::Module* module, const uint32_t base, const uint32_t index) noexcept
+	{
+		try
+		{
+			ksp::CallInfo* const ci = state.ci;
+			const ksp::module_info::Function& callee = *module->fastFunctionAccessor[index];
+			callee.materialize();
+
+			const ksp::reg_ptr_t args = ci->regs_base + base;
+			if (callee.fastExtraStackSize == 0)
+				state.push_call_window(args, callee.fastRegisterCount);
+			else
+			{
+				state.push_call_info(callee.fastRegisterCount, callee.fastExtraStackSize);
+				std::memcpy(state.ci->regs_base, args, callee.fastParameterCount * sizeof(ksp::reg_t));
+			}
+
+			const ksp::reg_t value = run_callee(state, ksp_state, module, callee);
+			if (state.status != ksp::ExecutionStatus::Running)
+				return value;
+			state.ci = ci;
+			*args = value;
+			return value;
+		}
+		catch (...)
+		{
+			__pending = std::current_exception();
+			state.status = ksp::ExecutionStatus::Finished;
+			return 0;
+		}
+	}
+
+	/* The TAILCALL of compiled code, reusing the frame like the TAILCALL handler. */
+	ksp::reg_t tail_call_helper(ksp::RuntimeState& state, ksp::KSP_State* ksp_state, const ksp::Module* module, const uint32_t base, const uint32_t index) noexcept
+	{
+		try
+		{
+			const ksp::module_info::Function& callee = *module->fastFunctionAccessor[index];
+			callee.materialize();
+
+			const ksp::reg_ptr_t args = state.ci->regs_base + base;
+			state.reuse_call_info(callee.fastRegisterCount, callee.fastExtraStackSize);
+			std::memmove(state.ci->regs_base, args, callee.fastParameterCount * sizeof(ksp::reg_t));
+			return run_callee(state, ksp_state, module, callee);
+		}
+		catch (...)
+		{
+			__pending = std::current_exception();
+			state.status = ksp::ExecutionStatus::Finished;
+			return 0;
+		}
+	}
+
+	bool has_template(const opcode_t op)
+	{
+		switch (op)
+		{
+			case ksp::opcode::NOP:
+			case ksp::opcode::PUTB: case ksp::opcode::PUTW: case ksp::opcode::PUTL: case ksp::opcode::PUTQ:
+			case ksp::opcode::MOVB: case ksp::opcode::MOVW: case ksp::opcode::MOVL: case ksp::opcode::MOVQ:
+			case ksp::opcode::PUTMOVB: case ksp::opcode::PUTMOVW: case ksp::opcode::PUTMOVL: case ksp::opcode::PUTMOVQ:
+			case ksp::opcode::HALT:
+			case ksp::opcode::CALL: case ksp::opcode::TAILCALL: case ksp::opcode::RET:
+				return true;
+
+			default:
+				return false;
+		}
+	}
+
+	inline bool ends_function(const opcode_t op)
+	{
+		return op == ksp::opcode::HALT || op == ksp::opcode::RET || op == ksp::opcode::TAILCALL;
+	}
+
+	/* Stitches the templates of every instruction up to, and including, the first HALT, RET or TAILCALL. */
+	void emit(Emitter& e, const Instruction* pc)
+	{
+		namespace op = ksp::opcode;
+
+		e.prologue();
+		for (;; ++pc)
+		{
+			switch (pc->op)
+			{
+				case op::NOP: break;
+
+				case op::PUTB: e.put32(pc->a, static_cast<uint32_t>(pc->k & 0xffU)); break;
+				case op::PUTW: e.put32(pc->a, static_cast<uint32_t>(pc->k & 0xffffU)); break;
+				case op::PUTL: e.put32(pc->a, static_cast<uint32_t>(pc->k)); break;
+				case op::PUTQ: e.put64(pc->a, pc->k); break;
+
+				case op::MOVB: e.load8(pc->a); e.store32(pc->b); break;
+				case op::MOVW: e.load16(pc->a); e.store32(pc->b); break;
+				case op::MOVL: e.load32(pc->a); e.store32(pc->b); break;
+				case op::MOVQ: e.load64(pc->a); e.store64(pc->b); break;
+
+				case op::PUTMOVB: e.put32(pc->a, static_cast<uint32_t>(pc->k & 0xffU)); e.put32(pc->b, static_cast<uint32_t>(pc->k & 0xffU)); break;
+				case op::PUTMOVW: e.put32(pc->a, static_cast<uint32_t>(pc->k & 0xffffU)); e.put32(pc->b, static_cast<uint32_t>(pc->k & 0xffffU)); break;
+				case op::PUTMOVL: e.put32(pc->a, static_cast<uint32_t>(pc->k)); e.put32(pc->b, static_cast<uint32_t>(pc->k)); break;
+				case op::PUTMOVQ: e.put64(pc->a, pc->k); e.put64(pc->b, pc->k); break;
+
+				case op::CALL:
+					e.call(reinterpret_cast<const void*>(&call_helper), pc->a, static_cast<uint32_t>(pc->k));
+					e.return_unless_running();
+					e.load_regs();
+					break;
+
+				case op::TAILCALL:
+					e.call(reinterpret_cast<const void*>(&tail_call_helper), pc->a, static_cast<uint32_t>(pc->k));
+					e.epilogue();
+					return;
+
+				case op::RET:
+					e.load32(pc->a);
+					e.epilogue();
+					return;
+
+				case op::HALT:
+					e.load32(pc->a);
+					e.finish();
+					e.epilogue();
+					return;
+			}
+		}
+	}
+
+#if defined(__KSP_JIT)
+	/* Every compiled function gets its own mapping; its total length is kept just before the code. */
+	constexpr size_t __code_header = 16;
+
+	ksp::native_code_t install(const std::vector<uint8_t>& code)
+	{
+		const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+		const size_t len = (code.size() + __code_header + page - 1) & ~(page - 1);
+
+		void* mem = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mem == MAP_FAILED)
+			return nullptr;
+
+		std::memcpy(mem, &len, sizeof(len));
+		std::memcpy(static_cast<uint8_t*>(mem) + __code_header, code.data(), code.size());
+		if (mprotect(mem, len, PROT_READ | PROT_EXEC) != 0)
+		{
+			munmap(mem, len);
+			return nullptr;
+		}
+		return reinterpret_cast<ksp::native_code_t>(static_cast<uint8_t*>(mem) + __code_header);
+	}
+#endif
+}
+
+bool ksp::jit::compilable(const module_info::Function& function)
+{
+	const Instruction* pc = function.fastInstructionAccessor;
+	if (!pc)
+		return false;
+	for (;; ++pc)
+	{
+		if (!has_template(pc->op))
+			return false;
+		if (ends_function(pc->op))
+			return true;
+	}
+}
+
+ksp::native_code_t ksp::jit::compile(const module_info::Function& function)
+{
+#if defined(__KSP_JIT)
+	if (!compilable(function))
+		return nullptr;
+
+	Emitter e;
+	emit(e, function.fastInstructionAccessor);
+	return install(e.code());
+#else
+	return nullptr;
+#endif
+}
+
+ksp::native_code_t ksp::jit::code_for(const Module* module, const module_info::Function& function)
+{
+	native_code_t native = function.fastNativeCode.load(std::memory_order_acquire);
+	if (native || function.fastInvocationCount.load(std::memory_order_relaxed) >= __KSP_JIT_THRESHOLD)
+		return native;
+
+	if (function.fastInvocationCount.fetch_add(1, std::memory_order_relaxed) + 1 == __KSP_JIT_THRESHOLD)
+	{
+		native = function.reachesYield(*module) ? nullptr : compile(function);
+		function.fastNativeCode.store(native, std::memory_order_release);
+	}
+	return native;
+}
+
+ksp::reg_t ksp::jit::run(native_code_t code, RuntimeState& state, KSP_State* ksp_state, const Module* module)
+{
+	const reg_t value = code(state, ksp_state, module);
+	if (__pending)
+	{
+		std::exception_ptr error = __pending;
+		__pending = nullptr;
+		std::rethrow_exception(error);
+	}
+	return value;
+}
+
+void ksp::jit::release(native_code_t code)
+{
+#if defined(__KSP_JIT)
+	if (code)
+	{
+		uint8_t* mem = reinterpret_cast<uint8_t*>(code) - __code_header;
+		size_t len;
+		std::memcpy(&len, mem, sizeof(len));
+		munmap(mem, len);
+	}
+#endif
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "support.h"
+
+/* Baseline template JIT, only for x86-64 System V targets. Define __KSP_NO_JIT to disable it. */
+#if !defined(__KSP_NO_JIT) && defined(__x86_64__) && defined(__linux__)
+#define __KSP_JIT
+#endif
+
+/* Calls of a Function run by the interpreter before it is compiled. */
+#define __KSP_JIT_THRESHOLD (1000)
+
+namespace ksp
+{
+	struct RuntimeState;
+	struct KSP_State;
+	struct Module;
+
+	namespace module_info
+	{
+		class Function;
+	}
+
+	/*
+	 * Compiled Function, entered like aot_code_t on the frame already pushed in state.ci. Returns
+	 * the value of its RET, or of its HALT, which also leaves state.status Finished. Enter it
+	 * through jit::run, which rethrows what the functions it called threw.
+	 */
+	typedef reg_t (*native_code_t)(RuntimeState& state, KSP_State* ksp_state, const Module* module);
+
+	namespace jit
+	{
+		/* True when every opcode of 'function' has a machine-code template. */
+		bool compilable(const module_info::Function& function);
+
+		/* Returns nullptr when the JIT is disabled or 'function' is not compilable. */
+		native_code_t compile(const module_info::Function& function);
+
+		void release(native_code_t code);
+
+		/*
+		 * The compiled code of 'function', compiled by the call that brings its invocation count
+		 * to __KSP_JIT_THRESHOLD. nullptr while the function runs interpreted, which it keeps doing
+		 * when a call of it can reach a YIELD in 'module' (see Function::reachesYield): compiled
+		 * code can not suspend. Building the module again after a change decides anew.
+		 */
+		native_code_t code_for(const Module* module, const module_info::Function& function);
+
+		/*
+		 * Runs 'code' on the frame pushed for it. Compiled code CALLs through a helper that runs
+		 * the callee compiled, translated or interpreted; an exception can not unwind through
+		 * machine code, so the helper stops the execution instead and run rethrows the exception.
+		 */
+		reg_t run(native_code_t code, RuntimeState& state, KSP_State* ksp_state, const Module* module);
+	}
+}
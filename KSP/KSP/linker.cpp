@@ -0,0 +1,320 @@
+#include "linker.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <iostream>
+#include <mutex>
+#include <unordered_map>
+
+#include "ops.h"
+
+namespace
+{
+	typedef std::chrono::steady_clock link_clock;
+
+	inline uint64_t elapsed_ns(const link_clock::time_point start)
+	{
+		return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(link_clock::now() - start).count());
+	}
+
+	bool makes_calls(const ksp::module_info::Function& function)
+	{
+		if (function.opcodeCount() == 0)
+			return false;
+		for (const ksp::bytecode::Instruction& in : ksp::bytecode::decode(function.opcodes().data(), function.opcodeCount()))
+			if (in.op == ksp::opcode::CALL || in.op == ksp::opcode::TAILCALL)
+				return true;
+		return false;
+	}
+
+	/* Tarjan's strongly connected components, each emitted after the components it depends on. */
+	class Components
+	{
+	private:
+		const std::vector<std::vector<size_t>>& _edges;
+		std::vector<size_t> _index;
+		std::vector<size_t> _low;
+		std::vector<bool> _onStack;
+		std::vector<size_t> _stack;
+		size_t _next;
+
+	public:
+		std::vector<std::vector<size_t>> components;
+		std::vector<size_t> componentOf;
+
+		Components(const std::vector<std::vector<size_t>>& edges) :
+			_edges{ edges },
+			_index(edges.size(), unvisited),
+			_low(edges.size(), 0),
+			_onStack(edges.size(), false),
+			_stack{},
+			_next{ 0 },
+			components{},
+			componentOf(edges.size(), 0)
+		{
+			for (size_t v = 0; v < edges.size(); ++v)
+				if (_index[v] == unvisited)
+					_visit(v);
+		}
+
+	private:
+		static constexpr size_t unvisited = static_cast<size_t>(-1);
+
+		void _visit(const size_t v)
+		{
+			_index[v] = _low[v] = _next++;
+			_stack.push_back(v);
+			_onStack[v] = true;
+
+			for (const size_t w : _edges[v])
+			{
+				if (_index[w] == unvisited)
+				{
+					_visit(w);
+					_low[v] = std::min(_low[v], _low[w]);
+				}
+				else if (_onStack[w])
+					_low[v] = std::min(_low[v], _index[w]);
+			}
+
+			if (_low[v] != _index[v])
+				return;
+
+			std::vector<size_t> component;
+			size_t w;
+			do
+			{
+				w = _stack.back();
+				_stack.pop_back();
+				_onStack[w] = false;
+				componentOf[w] = components.size();
+				component.push_back(w);
+			} while (w != v);
+			components.push_back(std::move(component));
+		}
+	};
+}
+
+ksp::Linker::Linker(const size_t workers) :
+	_units{},
+	_reports{},
+	_workers{ workers > 0 ? workers : 1 }
+{}
+
+void ksp::Linker::add(Module& module, const std::string& name)
+{
+	_units.push_back({ &module, name, {} });
+}
+
+void ksp::Linker::link()
+{
+	_reports.assign(_units.size(), ModuleReport{});
+	for (size_t i = 0; i < _units.size(); ++i)
+	{
+		_units[i].dependencies.clear();
+		_reports[i].name = _units[i].name;
+	}
+
+	_resolve();
+	_build();
+}
+
+void ksp::Linker::_resolve()
+{
+	typedef module_info::NameTable NameTable;
+
+	struct Import
+	{
+		size_t unit;
+		Atom name;
+		const NameTable::Element* definition;
+	};
+
+	/* Every definition of every name, and the module of every table, for attachExternal'd elements. */
+	std::unordered_map<Atom, std::vector<std::pair<size_t, const NameTable::Element*>>> definitions;
+	std::unordered_map<const NameTable*, size_t> owners;
+	for (size_t u = 0; u < _units.size(); ++u)
+	{
+		const link_clock::time_point start = link_clock::now();
+		owners.emplace(&_units[u].module->content, u);
+		for (const auto& p : _units[u].module->content.elements())
+			if (p.second.kind() != NameTable::Kind::Invalid && !p.second.isExtern())
+				definitions[p.first].emplace_back(u, &p.second);
+		_reports[u].resolve_ns += elapsed_ns(start);
+	}
+
+	std::vector<Import> imports;
+	std::vector<std::string> errors;
+	std::unordered_map<const module_info::Function*, bool> calls;
+	for (size_t u = 0; u < _units.size(); ++u)
+	{
+		const link_clock::time_point start = link_clock::now();
+		const std::string prefix = _units[u].name + ": ";
+
+		for (const auto& p : _units[u].module->content.elements())
+		{
+			const NameTable::Element& e = p.second;
+			if (e.isExtern())
+			{
+				auto owner = owners.find(&e.owner());
+				if (owner != owners.end() && owner->second != u)
+					_units[u].dependencies.push_back(owner->second);
+				continue;
+			}
+			if (e.kind() != NameTable::Kind::Invalid)
+				continue;
+
+			auto it = definitions.find(p.first);
+			if (it == definitions.end())
+			{
+				errors.push_back(prefix + p.first.str() + " (not defined)");
+				continue;
+			}
+			if (it->second.size() > 1)
+			{
+				std::string modules;
+				for (const auto& d : it->second)
+					modules += (modules.empty() ? "" : ", ") + _units[d.first].name;
+				errors.push_back(prefix + p.first.str() + " (defined by " + modules + ")");
+				continue;
+			}
+
+			const size_t from = it->second.front().first;
+			const NameTable::Element* definition = it->second.front().second;
+			if (definition->kind() == NameTable::Kind::Function)
+			{
+				const module_info::Function* f = definition->getFunction();
+				auto known = calls.find(f);
+				if (known == calls.end())
+					known = calls.emplace(f, makes_calls(*f)).first;
+				if (known->second)
+				{
+					errors.push_back(prefix + p.first.str() + " (function of " + _units[from].name + " makes calls)");
+					continue;
+				}
+			}
+
+			imports.push_back({ u, p.first, definition });
+			_units[u].dependencies.push_back(from);
+		}
+		_reports[u].resolve_ns += elapsed_ns(start);
+	}
+
+	if (!errors.empty())
+		throw LinkError{ std::to_string(errors.size()) + " unresolved import" + (errors.size() > 1 ? "s" : ""), errors };
+
+	for (const Import& import : imports)
+	{
+		const link_clock::time_point start = link_clock::now();
+		_units[import.unit].module->content.getElement(import.name).attachExternal(*import.definition);
+		++_reports[import.unit].imports;
+		_reports[import.unit].resolve_ns += elapsed_ns(start);
+	}
+
+	for (Unit& unit : _units)
+	{
+		std::sort(unit.dependencies.begin(), unit.dependencies.end());
+		unit.dependencies.erase(std::unique(unit.dependencies.begin(), unit.dependencies.end()), unit.dependencies.end());
+	}
+}
+
+void ksp::Linker::_build()
+{
+	std::vector<std::vector<size_t>> edges(_units.size());
+	for (size_t u = 0; u < _units.size(); ++u)
+		edges[u] = _units[u].dependencies;
+	const Components graph{ edges };
+	const size_t count = graph.components.size();
+
+	/* Components wait on the components they import from; a finished one releases its dependents. */
+	std::vector<size_t> waiting(count, 0);
+	std::vector<std::vector<size_t>> dependents(count);
+	for (size_t c = 0; c < count; ++c)
+	{
+		std::vector<size_t> from;
+		for (const size_t u : graph.components[c])
+			for (const size_t d : _units[u].dependencies)
+				if (graph.componentOf[d] != c)
+					from.push_back(graph.componentOf[d]);
+		std::sort(from.begin(), from.end());
+		from.erase(std::unique(from.begin(), from.end()), from.end());
+
+		waiting[c] = from.size();
+		for (const size_t f : from)
+			dependents[f].push_back(c);
+	}
+
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::vector<size_t> ready;
+	size_t finished = 0;
+	std::exception_ptr error;
+	for (size_t c = 0; c < count; ++c)
+		if (waiting[c] == 0)
+			ready.push_back(c);
+
+	auto work = [&](const size_t worker) {
+		std::unique_lock<std::mutex> lock{ mutex };
+		for (;;)
+		{
+			wake.wait(lock, [&]() { return !ready.empty() || finished == count || error; });
+			if (error || ready.empty())
+				return;
+
+			const size_t c = ready.back();
+			ready.pop_back();
+			lock.unlock();
+
+			try
+			{
+				for (const size_t u : graph.components[c])
+				{
+					const link_clock::time_point start = link_clock::now();
+					_units[u].module->build();
+					_reports[u].build_ns = elapsed_ns(start);
+					_reports[u].worker = worker;
+				}
+			}
+			catch (...)
+			{
+				lock.lock();
+				if (!error)
+					error = std::current_exception();
+				wake.notify_all();
+				return;
+			}
+
+			lock.lock();
+			++finished;
+			for (const size_t d : dependents[c])
+				if (--waiting[d] == 0)
+					ready.push_back(d);
+			wake.notify_all();
+		}
+	};
+
+	/* The calling thread is worker 0. */
+	const size_t workers = std::min(_workers, count > 0 ? count : 1);
+	std::vector<std::thread> threads;
+	for (size_t w = 1; w < workers; ++w)
+		threads.emplace_back(work, w);
+	work(0);
+	for (std::thread& t : threads)
+		t.join();
+
+	if (error)
+		std::rethrow_exception(error);
+}
+
+std::ostream& operator<< (std::ostream& os, const ksp::Linker& linker)
+{
+	for (const auto& report : linker.reports())
+	{
+		os << report.name << ": " << report.imports << " imports, resolve "
+			<< (report.resolve_ns / 1e6) << " ms, build "
+			<< (report.build_ns / 1e6) << " ms (worker " << report.worker << ")" << std::endl;
+	}
+	return os;
+}
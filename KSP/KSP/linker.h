@@ -0,0 +1,89 @@
+#pragma once
+
+#include "support.h"
+#include "vm.h"
+
+#include <exception>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace ksp
+{
+	class LinkError : exception
+	{
+	private:
+		std::vector<std::string> _unresolved;
+
+	public:
+		inline LinkError(const std::string& msg, const std::vector<std::string>& unresolved) :
+			exception{ ("Link error: " + msg).c_str() },
+			_unresolved{ unresolved }
+		{}
+
+		/* Every name that could not be linked, as "module: name (reason)". */
+		inline const std::vector<std::string>& unresolved() const { return _unresolved; }
+	};
+
+	/*
+	 * Links and builds a set of Modules. An import is an element created in a module's
+	 * NameTable and never defined; link() attaches each import to the one module that
+	 * defines its name, then builds every module after the modules it imports from.
+	 * Modules that do not depend on each other are built in parallel, and modules that
+	 * import from each other are built in turn by one worker.
+	 *
+	 * An imported function runs with the importing Module, so its own CALLs would look
+	 * their callees up in the wrong table: only functions that make no calls can be
+	 * imported. Modules already attached with Element::attachExternal keep their
+	 * elements and are ordered after the modules they attached to.
+	 */
+	class Linker
+	{
+	public:
+		struct ModuleReport
+		{
+			std::string name;
+			size_t      imports;
+			uint64_t    resolve_ns;
+			uint64_t    build_ns;
+			size_t      worker;
+		};
+
+	private:
+		struct Unit
+		{
+			Module* module;
+			std::string name;
+			std::vector<size_t> dependencies;
+		};
+
+		std::vector<Unit> _units;
+		std::vector<ModuleReport> _reports;
+		size_t _workers;
+
+	public:
+		explicit Linker(const size_t workers = std::thread::hardware_concurrency());
+
+		/* Adds a module to link, under the name used in reports and errors. The module must outlive link(). */
+		void add(Module& module, const std::string& name);
+
+		/*
+		 * Resolves every import, then builds every module. Throws LinkError, before anything is
+		 * attached or built, listing every import that no module defines, that several modules
+		 * define, or that names a function making calls. Rethrows the first error of a build.
+		 */
+		void link();
+
+		inline size_t moduleCount() const { return _units.size(); }
+		inline size_t workerCount() const { return _workers; }
+
+		/* One report per module in the order they were added, valid after link(). */
+		inline const std::vector<ModuleReport>& reports() const { return _reports; }
+
+	private:
+		void _resolve();
+		void _build();
+	};
+}
+
+std::ostream& operator<< (std::ostream& os, const ksp::Linker& linker);
@@ -1,12 +1,25 @@
+#include <fstream>
 #include <iostream>
 
 #include "runtime.h"
 #include "vm.h"
 #include "ops.h"
 #include "types.h"
+#include "bench_module.h"
+#include "aot.h"
 
 int main(int argc, char** argv)
 {
+	if (argc > 2 && std::string{ argv[1] } == "aot-emit")
+	{
+		/* Generates bench_aot.cpp; the CMake build of KSP Bench runs this. */
+		ksp::Module mod;
+		ksp::bench::build_aot_module(mod);
+		std::ofstream out{ argv[2] };
+		ksp::aot::emit(mod, out, "ksp_bench_aot_bind");
+		return out ? 0 : 1;
+	}
+
 	ksp::Type t = ksp::Type::Integer;
 	std::cout << t.size() << std::endl;
 
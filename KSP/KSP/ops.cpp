@@ -1,5 +1,29 @@
 #include "ops.h"
 
+namespace
+{
+	namespace info = ksp::opcode::info;
+
+	const ksp::OpcodeInfo* const __opinfos[] = {
+		&info::NOP,
+		&info::PUTB, &info::PUTW, &info::PUTL, &info::PUTQ,
+		&info::MOVB, &info::MOVW, &info::MOVL, &info::MOVQ,
+		&info::HALT,
+		&info::YIELD,
+		&info::CALL, &info::TAILCALL, &info::RET,
+		&info::ACOPY, &info::AFILL, &info::ACMP,
+		&info::AADD, &info::AMUL, &info::AMIN, &info::AMAX,
+		&info::LDF, &info::STF,
+		&info::PUTMOVB, &info::PUTMOVW, &info::PUTMOVL, &info::PUTMOVQ
+	};
+	static_assert(sizeof(__opinfos) / sizeof(*__opinfos) == ksp::opcode::count, "opcode info table out of sync with ksp::opcode");
+}
+
+const ksp::OpcodeInfo* ksp::opcode::info::find(const opcode_t code)
+{
+	return code < ksp::opcode::count ? __opinfos[code] : nullptr;
+}
+
 std::ostream& operator<< (std::ostream& os, const ksp::OpcodeInfo& opinfo)
 {
 	os << opinfo.name();
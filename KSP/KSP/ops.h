@@ -1,6 +1,7 @@
 #pragma once
 
 #include "support.h"
+#include "atom.h"
 
 #include <string>
 #include <vector>
@@ -12,13 +13,19 @@ namespace ksp
 	{
 		std::string name;
 		uint8_t size;
+
+		/* Arguments named "..._reg" are register numbers; the others are values, decoded into Instruction::k. */
+		inline bool isRegister() const
+		{
+			return name.size() >= 4 && name.compare(name.size() - 4, 4, "_reg") == 0;
+		}
 	};
 
 	class OpcodeInfo
 	{
 	private:
 		opcode_t _code;
-		std::string _name;
+		Atom _name;
 		std::vector<OpcodeArgument> _args;
 
 	public:
@@ -31,7 +38,8 @@ namespace ksp
 
 		inline opcode_t code() const { return _code; }
 
-		inline const std::string& name() const { return _name; }
+		inline const std::string& name() const { return _name.str(); }
+		inline Atom atom() const { return _name; }
 
 		inline size_t args_count() const { return _args.size(); }
 
@@ -53,8 +61,37 @@ namespace ksp
 			MOVW,
 			MOVL,
 			MOVQ,
+
+			HALT,
+			YIELD,
+
+			// Calls (see RuntimeState::push_call_window) //
+			CALL,
+			TAILCALL,
+			RET,
+
+			// Bulk array operations (see module_info::Function::build) //
+			ACOPY,
+			AFILL,
+			ACMP,
+			AADD,
+			AMUL,
+			AMIN,
+			AMAX,
+
+			// Struct fields (see module_info::Function::build) //
+			LDF,
+			STF,
+
+			// Superinstructions (see bytecode::fuse) //
+			PUTMOVB,
+			PUTMOVW,
+			PUTMOVL,
+			PUTMOVQ,
 		};
 
+		constexpr size_t count = static_cast<size_t>(PUTMOVQ) + 1;
+
 #define __declop(_Opcode, ...) const OpcodeInfo _Opcode{ opcode::_Opcode, #_Opcode, { __VA_ARGS__ } }
 		namespace info
 		{
@@ -69,6 +106,31 @@ namespace ksp
 			__declop(MOVW, { "src_reg", 1 }, { "dst_reg", 1 });
 			__declop(MOVL, { "src_reg", 1 }, { "dst_reg", 1 });
 			__declop(MOVQ, { "src_reg", 1 }, { "dst_reg", 1 });
+
+			__declop(HALT, { "src_reg", 1 });
+			__declop(YIELD, { "src_reg", 1 });
+
+			__declop(CALL, { "base_reg", 1 }, { "function_value", 4 });
+			__declop(TAILCALL, { "base_reg", 1 }, { "function_value", 4 });
+			__declop(RET, { "src_reg", 1 });
+
+			__declop(ACOPY, { "dst_reg", 1 }, { "src_reg", 1 });
+			__declop(AFILL, { "dst_reg", 1 }, { "value_reg", 1 });
+			__declop(ACMP, { "dst_reg", 1 }, { "src0_reg", 1 }, { "src1_reg", 1 });
+			__declop(AADD, { "dst_reg", 1 }, { "src0_reg", 1 }, { "src1_reg", 1 });
+			__declop(AMUL, { "dst_reg", 1 }, { "src0_reg", 1 }, { "src1_reg", 1 });
+			__declop(AMIN, { "dst_reg", 1 }, { "src0_reg", 1 }, { "src1_reg", 1 });
+			__declop(AMAX, { "dst_reg", 1 }, { "src0_reg", 1 }, { "src1_reg", 1 });
+
+			__declop(LDF, { "dst_reg", 1 }, { "struct_reg", 1 }, { "field_value", 1 });
+			__declop(STF, { "struct_reg", 1 }, { "src_reg", 1 }, { "field_value", 1 });
+
+			__declop(PUTMOVB, { "dst_reg", 1 }, { "mov_dst_reg", 1 }, { "byte_value", 1 });
+			__declop(PUTMOVW, { "dst_reg", 1 }, { "mov_dst_reg", 1 }, { "word_value", 2 });
+			__declop(PUTMOVL, { "dst_reg", 1 }, { "mov_dst_reg", 1 }, { "long_value", 4 });
+			__declop(PUTMOVQ, { "dst_reg", 1 }, { "mov_dst_reg", 1 }, { "quad_value", 8 });
+
+			const OpcodeInfo* find(const opcode_t code);
 		}
 #undef __declop
 	}
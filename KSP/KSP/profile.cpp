@@ -0,0 +1,104 @@
+#include "profile.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+ksp::OpcodeProfile::OpcodeProfile() :
+	_sampleCycles{ false },
+	_lastTick{ 0 }
+{
+	clear();
+}
+
+void ksp::OpcodeProfile::clear()
+{
+	std::memset(_counts, 0, sizeof(_counts));
+	std::memset(_cycles, 0, sizeof(_cycles));
+	std::memset(_histograms, 0, sizeof(_histograms));
+}
+
+uint64_t ksp::OpcodeProfile::total() const
+{
+	uint64_t total = 0;
+	for (size_t i = 0; i < opcode::count; ++i)
+		total += _counts[i];
+	return total;
+}
+
+std::vector<ksp::OpcodeProfile::Entry> ksp::OpcodeProfile::entries() const
+{
+	std::vector<Entry> entries;
+	for (size_t i = 0; i < opcode::count; ++i)
+		if (_counts[i] > 0)
+			entries.push_back({ opcode::info::find(static_cast<opcode_t>(i)), _counts[i], _cycles[i], _histograms[i] });
+
+	std::stable_sort(entries.begin(), entries.end(), [](const Entry& e0, const Entry& e1) { return e0.count > e1.count; });
+	return entries;
+}
+
+void ksp::OpcodeProfile::begin()
+{
+	if (_sampleCycles)
+		_lastTick = ticks();
+}
+
+void ksp::OpcodeProfile::_sample(const opcode_t op)
+{
+	const uint64_t now = ticks();
+	const uint64_t delta = now - _lastTick;
+	_lastTick = now;
+
+	size_t bucket = 0;
+	for (uint64_t d = delta; d > 1 && bucket < __KSP_PROFILE_HISTOGRAM_BUCKETS - 1; d >>= 1)
+		++bucket;
+
+	_cycles[op] += delta;
+	++_histograms[op][bucket];
+}
+
+uint64_t ksp::OpcodeProfile::ticks()
+{
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+#endif
+}
+
+
+
+std::ostream& operator<< (std::ostream& os, const ksp::OpcodeProfile& profile)
+{
+	const std::ios_base::fmtflags flags = os.flags();
+	const std::streamsize precision = os.precision();
+
+	const uint64_t total = profile.total();
+	for (const auto& e : profile.entries())
+	{
+		os << std::left << std::setw(10) << e.info->name() << std::right
+			<< std::setw(14) << e.count
+			<< std::setw(8) << std::fixed << std::setprecision(2) << (total ? 100.0 * e.count / total : 0) << "%";
+
+		if (profile.isCycleSampling())
+		{
+			os << std::setw(10) << std::setprecision(1) << (static_cast<double>(e.cycles) / e.count) << " cycles/op  [";
+			for (size_t b = 0; b < __KSP_PROFILE_HISTOGRAM_BUCKETS; ++b)
+				if (e.histogram[b] > 0)
+					os << " <" << (uint64_t{ 1 } << (b + 1)) << ":" << e.histogram[b];
+			os << " ]";
+		}
+		os << std::endl;
+	}
+
+	os.flags(flags);
+	os.precision(precision);
+	return os;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "support.h"
+#include "ops.h"
+
+#include <iostream>
+
+#define __KSP_PROFILE_HISTOGRAM_BUCKETS (32)
+
+namespace ksp
+{
+	/*
+	 * Per opcode execution counters, filled by execute<policy::Profile>. With cycle
+	 * sampling enabled every instruction also reads the time stamp counter, and the
+	 * delta since the previous instruction goes to a log2 histogram of its opcode.
+	 */
+	class OpcodeProfile
+	{
+	public:
+		struct Entry
+		{
+			const OpcodeInfo* info;
+			uint64_t count;
+			uint64_t cycles;
+			const uint64_t* histogram;
+		};
+
+	private:
+		uint64_t _counts[opcode::count];
+		uint64_t _cycles[opcode::count];
+		uint64_t _histograms[opcode::count][__KSP_PROFILE_HISTOGRAM_BUCKETS];
+		bool _sampleCycles;
+		uint64_t _lastTick;
+
+	public:
+		OpcodeProfile();
+		~OpcodeProfile() = default;
+
+		void clear();
+
+		inline void setCycleSampling(const bool enabled) { _sampleCycles = enabled; }
+		inline bool isCycleSampling() const { return _sampleCycles; }
+
+		inline uint64_t count(const opcode_t op) const { return _counts[op]; }
+		inline uint64_t cycles(const opcode_t op) const { return _cycles[op]; }
+		inline const uint64_t* histogram(const opcode_t op) const { return _histograms[op]; }
+
+		uint64_t total() const;
+
+		/* Executed opcodes only, most executed first. */
+		std::vector<Entry> entries() const;
+
+		void begin();
+
+		inline void record(const opcode_t op)
+		{
+			++_counts[op];
+			if (_sampleCycles)
+				_sample(op);
+		}
+
+		static uint64_t ticks();
+
+	private:
+		void _sample(const opcode_t op);
+	};
+}
+
+std::ostream& operator<< (std::ostream& os, const ksp::OpcodeProfile& profile);
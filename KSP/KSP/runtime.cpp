@@ -1,40 +1,75 @@
 #include "runtime.h"
 
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 
 #include "vm.h"
 #include "ops.h"
+#include "jit.h"
+#include "aot.h"
+#include "vmem.h"
+#include "arrays.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <csetjmp>
+#include <csignal>
+#endif
 
 using ksp::CallInfo;
 using ksp::ptr_t;
 using ksp::stack_ptr_t;
 using ksp::bytecode::RunnableBytecode;
 using ksp::opcode_t;
-using ksp::bytecode_t;
 
 ksp::RuntimeState::RuntimeState(
 	const size_t calls_stack_size,
 	const size_t data_stack_size) :
-	calls_base{ reinterpret_cast<CallInfo*>(std::malloc(calls_stack_size * sizeof(CallInfo))) },
+	calls_base{ reinterpret_cast<CallInfo*>(vmem::reserve(calls_stack_size * sizeof(CallInfo), __KSP_STACK_GUARD_SIZE)) },
 	ci{ nullptr },
 	calls_size{ calls_stack_size },
-	data{ reinterpret_cast<stack_ptr_t>(std::malloc(data_stack_size * sizeof(stack_ptr_t))) },
+	calls_bytes{ vmem::round_to_pages(calls_stack_size * sizeof(CallInfo)) },
+	data{ reinterpret_cast<stack_ptr_t>(vmem::reserve(data_stack_size * sizeof(stack_ptr_t), __KSP_STACK_GUARD_SIZE)) },
 	data_size{ data_stack_size },
+	data_bytes{ vmem::round_to_pages(data_stack_size * sizeof(stack_ptr_t)) },
 	pc{},
-	rret{}
-{}
+	rret{},
+	status{ ExecutionStatus::Finished },
+	entry{ nullptr }
+{
+	if (!calls_base || !data)
+	{
+		vmem::release(calls_base, calls_bytes, __KSP_STACK_GUARD_SIZE);
+		vmem::release(data, data_bytes, __KSP_STACK_GUARD_SIZE);
+		throw std::bad_alloc{};
+	}
+}
 ksp::RuntimeState::~RuntimeState()
 {
-	std::free(calls_base);
-	std::free(data);
+	vmem::release(calls_base, calls_bytes, __KSP_STACK_GUARD_SIZE);
+	vmem::release(data, data_bytes, __KSP_STACK_GUARD_SIZE);
+}
+
+const char* ksp::RuntimeState::guard_hit(const void* address) const
+{
+	const char* p = reinterpret_cast<const char*>(address);
+	const char* calls_guard = reinterpret_cast<const char*>(calls_base) + calls_bytes;
+	const char* data_guard = data + data_bytes;
+
+	if (p >= data_guard && p < data_guard + vmem::round_to_pages(__KSP_STACK_GUARD_SIZE))
+		return "data";
+	if (p >= calls_guard && p < calls_guard + vmem::round_to_pages(__KSP_STACK_GUARD_SIZE))
+		return "calls";
+	return nullptr;
 }
 
 void ksp::RuntimeState::print_current_callinfo_registers() const
 {
 	if (ci)
 	{
-		size_t count = (reinterpret_cast<char*>(ci->heap_base) - reinterpret_cast<char*>(ci->regs_base)) / sizeof(reg_t);
+		size_t count = (ci->top - reinterpret_cast<stack_ptr_t>(ci->regs_base)) / sizeof(reg_t);
 		reg_ptr_t ptr = ci->regs_base;
 		int idx = 0;
 		while ((count--) > 0)
@@ -42,6 +77,29 @@ void ksp::RuntimeState::print_current_callinfo_registers() const
 	}
 }
 
+/*
+ * Lays out [heap][regs] from info->bottom. The heap starts 8 byte aligned, so that the
+ * heap offsets Function::build aligns stay aligned, and is rounded up to keep quad
+ * registers aligned too.
+ */
+static void place_frame(ksp::CallInfo* info, const uint8_t register_count, const size_t heap_size)
+{
+	const size_t heap = (heap_size + (sizeof(uint64_t) - 1)) & ~(sizeof(uint64_t) - 1);
+
+	info->heap_base = reinterpret_cast<ksp::stack_ptr_t>((reinterpret_cast<uintptr_t>(info->bottom) + (sizeof(uint64_t) - 1)) & ~static_cast<uintptr_t>(sizeof(uint64_t) - 1));
+	info->regs_base = reinterpret_cast<ksp::reg_ptr_t>(info->heap_base + heap);
+	info->top = reinterpret_cast<ksp::stack_ptr_t>(info->regs_base + register_count);
+
+	/* Only a heap wider than the guard band could step over it. */
+	if (heap >= __KSP_STACK_GUARD_SIZE)
+	{
+		const size_t page = ksp::vmem::page_size();
+		for (volatile const char* p = info->bottom; p < info->top; p += page)
+			(void) *p;
+		(void) *reinterpret_cast<volatile const char*>(info->top - 1);
+	}
+}
+
 void ksp::RuntimeState::push_call_info(const uint8_t register_count, const size_t heap_size)
 {
 	CallInfo* info;
@@ -57,14 +115,245 @@ void ksp::RuntimeState::push_call_info(const uint8_t register_count, const size_
 		info->bottom = ci->top;
 		info->prev = ci;
 	}
-	
-	info->regs_base = reinterpret_cast<reg_ptr_t>(info->bottom);
-	info->heap_base = reinterpret_cast<stack_ptr_t>(info->regs_base + register_count);
-	info->top = info->heap_base + heap_size;
+
+	info->saved_pc = pc;
+	info->result = nullptr;
+	ci = info;
+	place_frame(info, register_count, heap_size);
+}
+
+void ksp::RuntimeState::push_call_window(const reg_ptr_t window, const uint8_t register_count)
+{
+	CallInfo* info = ci + 1;
+	info->bottom = reinterpret_cast<stack_ptr_t>(window);
+	info->heap_base = info->bottom;
+	info->regs_base = window;
+	info->top = reinterpret_cast<stack_ptr_t>(window + register_count);
+	info->prev = ci;
 	info->saved_pc = pc;
+	info->result = window;
 	ci = info;
 }
 
+void ksp::RuntimeState::reuse_call_info(const uint8_t register_count, const size_t heap_size)
+{
+	place_frame(ci, register_count, heap_size);
+}
+
+void ksp::RuntimeState::reset(const bool release_memory)
+{
+	ci = nullptr;
+	pc = nullptr;
+	rret = 0;
+	status = ExecutionStatus::Finished;
+	entry = nullptr;
+
+	if (release_memory)
+	{
+		vmem::discard(calls_base, calls_bytes);
+		vmem::discard(data, data_bytes);
+	}
+}
+
+
+void ksp::RuntimeState::cancel()
+{
+	if (status != ExecutionStatus::Suspended)
+		return;
+
+	pc = entry->saved_pc;
+	ci = entry->prev;
+	status = ExecutionStatus::Finished;
+	entry = nullptr;
+}
+
+
+
+ksp::RuntimeStatePool::Lease::Lease(RuntimeStatePool* pool, std::unique_ptr<RuntimeState> state) :
+	_pool{ pool },
+	_state{ std::move(state) }
+{}
+ksp::RuntimeStatePool::Lease::~Lease()
+{
+	if (_state)
+		_pool->give_back(std::move(_state));
+}
+
+ksp::RuntimeStatePool::Lease& ksp::RuntimeStatePool::Lease::operator= (Lease&& other)
+{
+	if (this != &other)
+	{
+		if (_state)
+			_pool->give_back(std::move(_state));
+		_pool = other._pool;
+		_state = std::move(other._state);
+	}
+	return *this;
+}
+
+ksp::RuntimeStatePool::RuntimeStatePool(const size_t calls_stack_size, const size_t data_stack_size, const size_t max_idle) :
+	_mutex{},
+	_idle{},
+	_callsStackSize{ calls_stack_size },
+	_dataStackSize{ data_stack_size },
+	_maxIdle{ max_idle },
+	_created{ 0 }
+{}
+
+ksp::RuntimeStatePool::Lease ksp::RuntimeStatePool::acquire()
+{
+	{
+		std::lock_guard<std::mutex> lock{ _mutex };
+		if (!_idle.empty())
+		{
+			std::unique_ptr<RuntimeState> state = std::move(_idle.back());
+			_idle.pop_back();
+			return { this, std::move(state) };
+		}
+		++_created;
+	}
+	/* Reserving the stacks is the slow part; done outside the lock. */
+	return { this, std::make_unique<RuntimeState>(_callsStackSize, _dataStackSize) };
+}
+
+void ksp::RuntimeStatePool::give_back(std::unique_ptr<RuntimeState> state)
+{
+	state->reset();
+
+	std::lock_guard<std::mutex> lock{ _mutex };
+	if (_idle.size() < _maxIdle)
+		_idle.push_back(std::move(state));
+}
+
+void ksp::RuntimeStatePool::trim()
+{
+	std::lock_guard<std::mutex> lock{ _mutex };
+	for (std::unique_ptr<RuntimeState>& state : _idle)
+		state->reset(true);
+}
+
+size_t ksp::RuntimeStatePool::idle() const
+{
+	std::lock_guard<std::mutex> lock{ _mutex };
+	return _idle.size();
+}
+
+size_t ksp::RuntimeStatePool::created() const
+{
+	std::lock_guard<std::mutex> lock{ _mutex };
+	return _created;
+}
+
+
+
+/*
+ * Guard band traps. While a frame runs, the thread's GuardScope names the RuntimeState
+ * whose bands must turn access faults into StackOverflow; any other fault keeps its
+ * usual behaviour.
+ */
+namespace
+{
+	struct GuardScope
+	{
+		const ksp::RuntimeState* state;
+		GuardScope* prev;
+		const char* hit;
+#if !defined(_WIN32)
+		sigjmp_buf env;
+#endif
+	};
+
+	thread_local GuardScope* __guard_scope = nullptr;
+
+#if defined(_WIN32)
+	int guard_filter(EXCEPTION_POINTERS* ep, GuardScope* scope)
+	{
+		if (ep->ExceptionRecord->ExceptionCode != EXCEPTION_ACCESS_VIOLATION)
+			return EXCEPTION_CONTINUE_SEARCH;
+		scope->hit = scope->state->guard_hit(reinterpret_cast<const void*>(ep->ExceptionRecord->ExceptionInformation[1]));
+		return scope->hit ? EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH;
+	}
+#else
+	struct sigaction __previous_segv;
+
+	void on_segv(int sig, siginfo_t* info, void* context)
+	{
+		GuardScope* scope = __guard_scope;
+		if (scope && (scope->hit = scope->state->guard_hit(info->si_addr)) != nullptr)
+			siglongjmp(scope->env, 1);
+
+		if (__previous_segv.sa_flags & SA_SIGINFO)
+			__previous_segv.sa_sigaction(sig, info, context);
+		else if (__previous_segv.sa_handler != SIG_DFL && __previous_segv.sa_handler != SIG_IGN)
+			__previous_segv.sa_handler(sig);
+		else sigaction(SIGSEGV, &__previous_segv, nullptr); // the faulting access runs again with the default action
+	}
+
+	void install_guard_handler()
+	{
+		static const bool installed = []() {
+			struct sigaction action {};
+			action.sa_sigaction = &on_segv;
+			action.sa_flags = SA_SIGINFO | SA_NODEFER | SA_ONSTACK;
+			sigemptyset(&action.sa_mask);
+			return sigaction(SIGSEGV, &action, &__previous_segv) == 0;
+		}();
+		(void) installed;
+	}
+#endif
+
+	/* Calls 'fn', dropping 'scope' if an exception leaves it. Apart from run_guarded, where SEH allows no C++ handler. */
+	template<typename _Fn>
+	ksp::reg_t call_in_scope(_Fn& fn, GuardScope& scope)
+	{
+		try
+		{
+			return fn();
+		}
+		catch (...)
+		{
+			__guard_scope = scope.prev;
+			throw;
+		}
+	}
+
+	/* Runs 'fn' with the guard bands of 'state' armed. Returns false, with the band name in 'hit', on overflow. */
+	template<typename _Fn>
+	bool run_guarded(ksp::RuntimeState& state, _Fn&& fn, ksp::reg_t& result, const char*& hit)
+	{
+		GuardScope scope;
+		scope.state = &state;
+		scope.prev = __guard_scope;
+		scope.hit = nullptr;
+
+#if defined(_WIN32)
+		__guard_scope = &scope;
+		__try
+		{
+			result = call_in_scope(fn, scope);
+		}
+		__except (guard_filter(GetExceptionInformation(), &scope))
+		{
+			__guard_scope = scope.prev;
+			hit = scope.hit;
+			return false;
+		}
+#else
+		install_guard_handler();
+		if (sigsetjmp(scope.env, 0))
+		{
+			__guard_scope = scope.prev;
+			hit = scope.hit;
+			return false;
+		}
+		__guard_scope = &scope;
+		result = call_in_scope(fn, scope);
+#endif
+		__guard_scope = scope.prev;
+		return true;
+	}
+}
+
 
 
 
@@ -72,19 +361,41 @@ void ksp::RuntimeState::push_call_info(const uint8_t register_count, const size_
 #define RET_REG STACK.rret
 #define CI STACK.ci
 #define PC STACK.pc
-#define DECL_STACK RuntimeState STACK
 #define STACK_PUSH_CALL_INFO(regs_count, heap_size) STACK.push_call_info((regs_count), (heap_size))
 
-#define STACK_PRINT() STACK.print_current_callinfo_registers()
+#define VM_BEGIN() _Policy::begin(STACK, ksp_state)
+#define VM_STEP() _Policy::step(STACK, ksp_state)
 
 #define PC_SET(instruction) PC = (instruction)
 #define PC_SHIFT(amount) PC += (amount)
 
-#define GET_OPCODE() (*(PC))
-
-#define vmswitch(op) switch(op)
+#define GET_OPCODE() (PC->op)
+#define GET_HANDLER() (PC->handler)
+
+#define ARG_A (PC->a)
+#define ARG_B (PC->b)
+#define ARG_C (PC->c)
+#define ARG_K (PC->k)
+
+/*
+ * Dispatch engines. With __KSP_THREADED_DISPATCH every handler ends with its own
+ * indirect jump to the handler address resolved at decode time, so the branch
+ * predictor gets one slot per handler instead of the single shared jump emitted
+ * for the switch. Resolved addresses belong to the Release instantiation; the
+ * other policies index their own label table by opcode.
+ */
+#if defined(__KSP_THREADED_DISPATCH)
+#define vmdispatch() goto *(_Policy::resolved_handlers ? GET_HANDLER() : __disptab[GET_OPCODE()])
+#define vmswitch() vmdispatch();
+#define vmcase(op) __L_##op :
+#define vmbreak { VM_STEP(); PC_SHIFT(1); vmdispatch(); }
+#define vmjump(instruction) { PC_SET(instruction); vmdispatch(); }
+#else
+#define vmswitch() switch(GET_OPCODE())
 #define vmcase(op) case ksp::opcode:: op :
 #define vmbreak break
+#define vmjump(instruction) { PC_SET(instruction); continue; }
+#endif
 
 #define BYTE uint8_t
 #define WORD uint16_t
@@ -92,13 +403,43 @@ void ksp::RuntimeState::push_call_info(const uint8_t register_count, const size_
 #define QUAD uint64_t
 #define PTR ptr_t
 
-#define AS_QUAD(value) ((0xffffffffffffffffULL) & (value))
+#define HEAP_PTR(offset) (CI->heap_base + (offset))
+#define ARRAY_OPERANDS() (CI->arrays[ARG_K])
+#define ARRAY_BINARY(operation) { \
+		const ksp::bytecode::ArrayOperands& ops = ARRAY_OPERANDS(); \
+		ksp::arrays::binary(ksp::arrays::Operation:: operation, ops.kind, HEAP_PTR(ops.dst), HEAP_PTR(ops.src0), HEAP_PTR(ops.src1), ops.count); \
+	}
+
+/* Struct fields sit at their natural alignment in the frame heap (see module_info::Function::build). */
+#define FIELD_PTR(type) reinterpret_cast<type*>(HEAP_PTR(ARG_K))
 
-#define __PC_GET_DATA(offset, type) *reinterpret_cast<type*>(PC + (offset))
-#define PC_GET_BYTE(offset) __PC_GET_DATA(offset, BYTE)
-#define PC_GET_WORD(offset) __PC_GET_DATA(offset, WORD)
-#define PC_GET_LONG(offset) __PC_GET_DATA(offset, LONG)
-#define PC_GET_QUAD(offset) __PC_GET_DATA(offset, QUAD)
+#define CALLEE() (*module->fastFunctionAccessor[ARG_K])
+
+/* Pops a called frame, storing RET_REG in its result register, and goes on after the CALL. */
+#define RETURN_TO_CALLER() { \
+		*CI->result = RET_REG; \
+		PC_SET(CI->saved_pc); \
+		CI = CI->prev; \
+		vmjump(PC + 1); \
+	}
+
+/* Runs the translated code of 'callee' on the frame just pushed for it. A HALT in there ends this execution too. */
+#define RETURN_FROM_AOT(callee) { \
+		RET_REG = (callee).fastAotCode(STACK, ksp_state, module); \
+		if (!CI->result || STACK.status != ksp::ExecutionStatus::Running) \
+			return RET_REG; \
+		RETURN_TO_CALLER(); \
+	}
+
+/* Same as RETURN_FROM_AOT for the compiled code of the callee. */
+#define RETURN_FROM_NATIVE(code) { \
+		RET_REG = ksp::jit::run((code), STACK, ksp_state, module); \
+		if (!CI->result || STACK.status != ksp::ExecutionStatus::Running) \
+			return RET_REG; \
+		RETURN_TO_CALLER(); \
+	}
+
+#define AS_QUAD(value) ((0xffffffffffffffffULL) & (value))
 
 #define __REG(offset) (CI->regs_base[(offset)])
 #define __REG_PTR(offset) (CI->regs_base + (offset))
@@ -111,9 +452,9 @@ void ksp::RuntimeState::push_call_info(const uint8_t register_count, const size_
 #define REG_GET_LONG(offset) __REG(offset)
 #define REG_GET_QUAD(offset) (*reinterpret_cast<QUAD*>(__REG_PTR(offset)))
 
-#define REG_SET_BYTE(offset, value) __REG_SET(offset, (value) & 0xffU)
-#define REG_SET_WORD(offset, value) __REG_SET(offset, (value) & 0xffffU)
-#define REG_SET_LONG(offset, value) __REG_SET(offset, value)
+#define REG_SET_BYTE(offset, value) __REG_SET(offset, static_cast<LONG>(value) & 0xffU)
+#define REG_SET_WORD(offset, value) __REG_SET(offset, static_cast<LONG>(value) & 0xffffU)
+#define REG_SET_LONG(offset, value) __REG_SET(offset, static_cast<LONG>(value))
 #define REG_SET_QUAD(offset, value) (*reinterpret_cast<QUAD*>(__REG_PTR(offset)) = (value))
 
 #define REG_GET_PTR(offset) (*reinterpret_cast<PTR*>(__REG_PTR(offset)))
@@ -133,79 +474,491 @@ void ksp::RuntimeState::push_call_info(const uint8_t register_count, const size_
 
 
 
-void ksp::execute(KSP_State* ksp_state, Module* module, const bytecode::RunnableBytecode& code)
+namespace
 {
-	DECL_STACK;
-	PC_SET(code.code);
+	/* Register arguments of each opcode; the first one is decoded into a, the second into b. */
+	struct RegisterArguments
+	{
+		uint8_t counts[ksp::opcode::count];
 
-	STACK_PUSH_CALL_INFO(2, 0);
+		RegisterArguments() : counts{}
+		{
+			for (size_t op = 0; op < ksp::opcode::count; ++op)
+			{
+				const ksp::OpcodeInfo* info = ksp::opcode::info::find(static_cast<ksp::opcode_t>(op));
+				for (size_t i = 0; info && i < info->args_count(); ++i)
+					counts[op] += info->arg(i).isRegister() ? 1 : 0;
+			}
+		}
+	};
+}
+
+void ksp::policy::Trace::begin(RuntimeState&, KSP_State* ksp_state)
+{
+	if (ksp_state->trace.capacity() == 0)
+		ksp_state->trace.reset(__KSP_DEFAULT_TRACE_BUFFER_SIZE);
+}
+
+void ksp::policy::Trace::step(RuntimeState& state, KSP_State* ksp_state)
+{
+	static const RegisterArguments registers;
+
+	const bytecode::Instruction* pc = state.pc;
+	const reg_ptr_t regs = state.ci->regs_base;
+	const uint8_t count = registers.counts[pc->op];
+	ksp_state->trace.push({
+		static_cast<uint32_t>(ksp_state->trace.written()),
+		pc->op, pc->a, pc->b, pc->c,
+		count > 0 ? regs[pc->a] : 0, count > 1 ? regs[pc->b] : 0
+	});
+}
+
+void ksp::policy::Profile::begin(RuntimeState&, KSP_State* ksp_state)
+{
+	ksp_state->profile.begin();
+}
+
+void ksp::policy::Profile::step(RuntimeState& state, KSP_State* ksp_state)
+{
+	ksp_state->profile.record(state.pc->op);
+}
+
+void ksp::policy::Verbose::step(RuntimeState& state, KSP_State*)
+{
+	state.print_current_callinfo_registers();
+}
 
-	for (;; PC_SHIFT(1))
+
+
+/*
+ * Runs decoded instructions from PC in the current call info until HALT, or a RET
+ * of the frame the execution started in. CALL and TAILCALL take their callee from
+ * 'module', which Module::build has validated.
+ * Called with a non null 'export_table' it only publishes the handler table.
+ */
+template<typename _Policy>
+static ksp::reg_t vm_run(ksp::RuntimeState* state, ksp::KSP_State* ksp_state, const ksp::Module* module, const void* const** export_table)
+{
+#if defined(__KSP_THREADED_DISPATCH)
+	static const void* const __disptab[] = {
+		&&__L_NOP,
+		&&__L_PUTB, &&__L_PUTW, &&__L_PUTL, &&__L_PUTQ,
+		&&__L_MOVB, &&__L_MOVW, &&__L_MOVL, &&__L_MOVQ,
+		&&__L_HALT,
+		&&__L_YIELD,
+		&&__L_CALL, &&__L_TAILCALL, &&__L_RET,
+		&&__L_ACOPY, &&__L_AFILL, &&__L_ACMP,
+		&&__L_AADD, &&__L_AMUL, &&__L_AMIN, &&__L_AMAX,
+		&&__L_LDF, &&__L_STF,
+		&&__L_PUTMOVB, &&__L_PUTMOVW, &&__L_PUTMOVL, &&__L_PUTMOVQ
+	};
+	static_assert(sizeof(__disptab) / sizeof(*__disptab) == ksp::opcode::count, "dispatch table out of sync with ksp::opcode");
+
+	if (export_table)
 	{
-		opcode_t op = GET_OPCODE();
+		*export_table = __disptab;
+		return 0;
+	}
+#else
+	if (export_table)
+	{
+		*export_table = nullptr;
+		return 0;
+	}
+#endif
+
+	ksp::RuntimeState& STACK = *state;
+	VM_BEGIN();
 
-		vmswitch(op)
+	for (;;)
+	{
+		vmswitch()
 		{
 			vmcase(NOP) {
 			} vmbreak;
 
 			vmcase(PUTB) {
+				REG_SET_BYTE(ARG_A, ARG_K);
+			} vmbreak;
 
-				REG_SET_BYTE(PC_GET_BYTE(1), PC_GET_BYTE(2));
+			vmcase(PUTW) {
+				REG_SET_WORD(ARG_A, ARG_K);
+			} vmbreak;
 
-				PC_SHIFT(2);
+			vmcase(PUTL) {
+				REG_SET_LONG(ARG_A, ARG_K);
 			} vmbreak;
 
-			vmcase(PUTW) {
+			vmcase(PUTQ) {
+				REG_SET_QUAD(ARG_A, ARG_K);
+			} vmbreak;
 
-				REG_SET_WORD(PC_GET_BYTE(1), PC_GET_WORD(2));
+			vmcase(MOVB) {
+				REG_SET_BYTE(ARG_B, REG_GET_BYTE(ARG_A));
+			} vmbreak;
 
-				PC_SHIFT(3);
+			vmcase(MOVW) {
+				REG_SET_WORD(ARG_B, REG_GET_WORD(ARG_A));
 			} vmbreak;
 
-			vmcase(PUTL) {
+			vmcase(MOVL) {
+				REG_SET_LONG(ARG_B, REG_GET_LONG(ARG_A));
+			} vmbreak;
 
-				REG_SET_LONG(PC_GET_BYTE(1), PC_GET_LONG(2));
+			vmcase(MOVQ) {
+				REG_SET_QUAD(ARG_B, REG_GET_QUAD(ARG_A));
+			} vmbreak;
 
-				PC_SHIFT(5);
+			vmcase(PUTMOVB) {
+				REG_SET_BYTE(ARG_A, ARG_K);
+				REG_SET_BYTE(ARG_B, REG_GET_BYTE(ARG_A));
 			} vmbreak;
 
-			vmcase(PUTQ) {
+			vmcase(PUTMOVW) {
+				REG_SET_WORD(ARG_A, ARG_K);
+				REG_SET_WORD(ARG_B, REG_GET_WORD(ARG_A));
+			} vmbreak;
 
-				REG_SET_QUAD(PC_GET_BYTE(1), PC_GET_QUAD(2));
+			vmcase(PUTMOVL) {
+				REG_SET_LONG(ARG_A, ARG_K);
+				REG_SET_LONG(ARG_B, REG_GET_LONG(ARG_A));
+			} vmbreak;
 
-				PC_SHIFT(9);
+			vmcase(PUTMOVQ) {
+				REG_SET_QUAD(ARG_A, ARG_K);
+				REG_SET_QUAD(ARG_B, REG_GET_QUAD(ARG_A));
 			} vmbreak;
 
-			vmcase(MOVB) {
+			vmcase(HALT) {
+				VM_STEP();
+				RET_REG = REG_GET_LONG(ARG_A);
+				STACK.status = ksp::ExecutionStatus::Finished;
+				return RET_REG;
+			}
 
-				REG_SET_BYTE(PC_GET_BYTE(2), REG_GET_BYTE(PC_GET_BYTE(1)));
+			vmcase(ACOPY) {
+				const ksp::bytecode::ArrayOperands& ops = ARRAY_OPERANDS();
+				ksp::arrays::copy(HEAP_PTR(ops.dst), HEAP_PTR(ops.src0), ops.count * ksp::arrays::element_size(ops.kind));
+			} vmbreak;
 
-				PC_SHIFT(2);
+			vmcase(AFILL) {
+				const ksp::bytecode::ArrayOperands& ops = ARRAY_OPERANDS();
+				const QUAD value = ksp::arrays::element_size(ops.kind) > sizeof(LONG) ? REG_GET_QUAD(ops.src0) : REG_GET_LONG(ops.src0);
+				ksp::arrays::fill(ops.kind, HEAP_PTR(ops.dst), value, ops.count);
 			} vmbreak;
 
-			vmcase(MOVW) {
+			vmcase(ACMP) {
+				const ksp::bytecode::ArrayOperands& ops = ARRAY_OPERANDS();
+				REG_SET_LONG(ops.dst, ksp::arrays::compare(ops.kind, HEAP_PTR(ops.src0), HEAP_PTR(ops.src1), ops.count));
+			} vmbreak;
 
-				REG_SET_WORD(PC_GET_BYTE(1), REG_GET_WORD(PC_GET_BYTE(2)));
+			vmcase(AADD) ARRAY_BINARY(Add) vmbreak;
+			vmcase(AMUL) ARRAY_BINARY(Mul) vmbreak;
+			vmcase(AMIN) ARRAY_BINARY(Min) vmbreak;
+			vmcase(AMAX) ARRAY_BINARY(Max) vmbreak;
+
+			vmcase(LDF) {
+				switch (ARG_C)
+				{
+					case 1: REG_SET_BYTE(ARG_A, *FIELD_PTR(BYTE)); break;
+					case 2: REG_SET_WORD(ARG_A, *FIELD_PTR(WORD)); break;
+					case 4: REG_SET_LONG(ARG_A, *FIELD_PTR(LONG)); break;
+					default: REG_SET_QUAD(ARG_A, *FIELD_PTR(QUAD)); break;
+				}
+			} vmbreak;
 
-				PC_SHIFT(2);
+			vmcase(STF) {
+				switch (ARG_C)
+				{
+					case 1: *FIELD_PTR(BYTE) = REG_GET_BYTE(ARG_B); break;
+					case 2: *FIELD_PTR(WORD) = REG_GET_WORD(ARG_B); break;
+					case 4: *FIELD_PTR(LONG) = REG_GET_LONG(ARG_B); break;
+					default: *FIELD_PTR(QUAD) = REG_GET_QUAD(ARG_B); break;
+				}
 			} vmbreak;
 
-			vmcase(MOVL) {
+			vmcase(YIELD) {
+				VM_STEP();
+				RET_REG = REG_GET_LONG(ARG_A);
+				PC_SHIFT(1);
+				STACK.status = ksp::ExecutionStatus::Suspended;
+				return RET_REG;
+			}
+
+			vmcase(CALL) {
+				VM_STEP();
+				const ksp::module_info::Function& callee = CALLEE();
+				callee.materialize();
+				const ksp::reg_ptr_t args = __REG_PTR(ARG_A);
+				if (callee.fastExtraStackSize == 0)
+					STACK.push_call_window(args, callee.fastRegisterCount);
+				else
+				{
+					STACK_PUSH_CALL_INFO(callee.fastRegisterCount, callee.fastExtraStackSize);
+					std::memcpy(CI->regs_base, args, callee.fastParameterCount * sizeof(ksp::reg_t));
+					CI->result = args;
+				}
+				if (_Policy::resolved_handlers && callee.fastAotCode)
+					RETURN_FROM_AOT(callee);
+#if defined(__KSP_JIT)
+				if (_Policy::resolved_handlers)
+					if (const ksp::native_code_t native = ksp::jit::code_for(module, callee))
+						RETURN_FROM_NATIVE(native);
+#endif
+				CI->arrays = callee.fastArrayOperandAccessor;
+				vmjump(callee.fastInstructionAccessor);
+			}
+
+			vmcase(TAILCALL) {
+				VM_STEP();
+				const ksp::module_info::Function& callee = CALLEE();
+				callee.materialize();
+				const ksp::reg_ptr_t args = __REG_PTR(ARG_A);
+				STACK.reuse_call_info(callee.fastRegisterCount, callee.fastExtraStackSize);
+				std::memmove(CI->regs_base, args, callee.fastParameterCount * sizeof(ksp::reg_t));
+				if (_Policy::resolved_handlers && callee.fastAotCode)
+					RETURN_FROM_AOT(callee);
+#if defined(__KSP_JIT)
+				if (_Policy::resolved_handlers)
+					if (const ksp::native_code_t native = ksp::jit::code_for(module, callee))
+						RETURN_FROM_NATIVE(native);
+#endif
+				CI->arrays = callee.fastArrayOperandAccessor;
+				vmjump(callee.fastInstructionAccessor);
+			}
+
+			vmcase(RET) {
+				VM_STEP();
+				RET_REG = REG_GET_LONG(ARG_A);
+				if (!CI->result)
+					return RET_REG;
+				RETURN_TO_CALLER();
+			}
+		}
 
-				REG_SET_LONG(PC_GET_BYTE(1), REG_GET_LONG(PC_GET_BYTE(2)));
+		VM_STEP();
+		PC_SHIFT(1);
+	}
+}
 
-				PC_SHIFT(2);
-			} vmbreak;
+#if defined(__KSP_THREADED_DISPATCH)
+namespace
+{
+	/* policy::Release for code without resolved handlers, such as the instructions mapped from a ModuleImage. */
+	struct MappedRelease : ksp::policy::Release
+	{
+		static constexpr bool resolved_handlers = false;
+	};
+}
+#endif
 
-			vmcase(MOVQ) {
+/* vm_run from STACK.pc, through the opcode table when that code has no resolved handlers. */
+template<typename _Policy>
+static ksp::reg_t vm_enter(ksp::RuntimeState* state, ksp::KSP_State* ksp_state, const ksp::Module* module)
+{
+#if defined(__KSP_THREADED_DISPATCH)
+	if (_Policy::resolved_handlers && !state->pc->handler)
+		return vm_run<MappedRelease>(state, ksp_state, module, nullptr);
+#endif
+	return vm_run<_Policy>(state, ksp_state, module, nullptr);
+}
+
+const void* const* ksp::dispatch_table()
+{
+	static const void* const* const table = []() {
+		const void* const* t = nullptr;
+		vm_run<policy::Release>(nullptr, nullptr, nullptr, &t);
+		return t;
+	}();
+	return table;
+}
 
-				REG_SET_QUAD(PC_GET_BYTE(1), REG_GET_QUAD(PC_GET_BYTE(2)));
+/* Backs the execute overloads without a RuntimeState argument; reserved on the first call of each thread. */
+static ksp::RuntimeState& thread_state()
+{
+	thread_local ksp::RuntimeState state;
+	return state;
+}
 
-				PC_SHIFT(2);
-			} vmbreak;
+namespace
+{
+	/* What an execution entry point has to restore once its execution is over. */
+	struct Caller
+	{
+		CallInfo* ci;
+		const ksp::bytecode::Instruction* pc;
+		CallInfo* entry;
+		ksp::ExecutionStatus status;
+
+		static inline Caller of(const ksp::RuntimeState& state) { return { state.ci, state.pc, state.entry, state.status }; }
+	};
+
+	void begin_execution(ksp::RuntimeState& state)
+	{
+		if (state.suspended())
+			throw ksp::InvalidExecutionState{ "Cannot execute on a RuntimeState with a suspended execution" };
+	}
+
+	/*
+	 * Keeps a suspended execution in 'state' when 'resumable'; otherwise pops it and throws
+	 * if it overflowed. An execution nested in a running one can not outlive it, so its
+	 * YIELD just returns.
+	 */
+	ksp::reg_t end_execution(ksp::RuntimeState& state, const Caller& caller, const bool ok, const char* hit, const ksp::reg_t result, const bool resumable)
+	{
+		if (ok && state.suspended() && resumable && caller.status != ksp::ExecutionStatus::Running)
+			return result;
+
+		state.ci = caller.ci;
+		state.pc = caller.pc;
+		state.entry = caller.entry;
+		state.status = caller.status;
+		if (!ok)
+			throw ksp::StackOverflow{ hit };
+		return result;
+	}
+
+	/* Runs 'body' guarded and ends its execution, also when an exception (InvalidBytecode from a stub, say) leaves it. */
+	template<typename _Fn>
+	ksp::reg_t run_execution(ksp::RuntimeState& state, const Caller& caller, _Fn& body, const bool resumable)
+	{
+		ksp::reg_t result;
+		const char* hit;
+		bool ok;
+		try
+		{
+			ok = run_guarded(state, body, result, hit);
+		}
+		catch (...)
+		{
+			end_execution(state, caller, true, nullptr, 0, false);
+			throw;
 		}
+		return end_execution(state, caller, ok, hit, result, resumable);
+	}
+}
 
-		STACK_PRINT();
+#define STACK_ENTER(regs_count, heap_size) { \
+		STACK_PUSH_CALL_INFO((regs_count), (heap_size)); \
+		STACK.entry = CI; \
+		STACK.status = ExecutionStatus::Running; \
 	}
+
+template<typename _Policy>
+ksp::reg_t ksp::execute(KSP_State* ksp_state, const Module* module, const bytecode::RunnableBytecode& code)
+{
+	const std::vector<bytecode::Instruction> instructions = bytecode::decode(code.code, code.size);
+
+	RuntimeState& STACK = thread_state();
+	begin_execution(STACK);
+	const Caller caller = Caller::of(STACK);
+
+	auto body = [&]() {
+		PC_SET(instructions.data());
+		STACK_ENTER(2, 0);
+		return vm_enter<_Policy>(&STACK, ksp_state, module);
+	};
+
+	return run_execution(STACK, caller, body, false);
+}
+
+template<typename _Policy>
+ksp::reg_t ksp::execute(KSP_State* ksp_state, const Module* module, const module_info::Function& function)
+{
+	RuntimeState& state = thread_state();
+	const Caller caller = Caller::of(state);
+	const reg_t result = execute<_Policy>(ksp_state, module, state, function);
+	return end_execution(state, caller, true, nullptr, result, false);
 }
+
+template<typename _Policy>
+ksp::reg_t ksp::execute(KSP_State* ksp_state, const Module* module, RuntimeState& state, const module_info::Function& function)
+{
+	RuntimeState& STACK = state;
+	begin_execution(STACK);
+	function.materialize();
+	const Caller caller = Caller::of(STACK);
+
+	auto body = [&]() -> reg_t {
+		PC_SET(function.fastInstructionAccessor);
+		STACK_ENTER(function.fastRegisterCount, function.fastExtraStackSize);
+
+		if (_Policy::resolved_handlers && function.fastAotCode)
+			return RET_REG = function.fastAotCode(STACK, ksp_state, module);
+
+#if defined(__KSP_JIT)
+		if (_Policy::resolved_handlers)
+			if (const native_code_t native = jit::code_for(module, function))
+				return RET_REG = jit::run(native, STACK, ksp_state, module);
+#endif
+		CI->arrays = function.fastArrayOperandAccessor;
+		return vm_enter<_Policy>(&STACK, ksp_state, module);
+	};
+
+	return run_execution(STACK, caller, body, true);
+}
+
+template<typename _Policy>
+ksp::reg_t ksp::resume(KSP_State* ksp_state, const Module* module, RuntimeState& state)
+{
+	RuntimeState& STACK = state;
+	if (!STACK.suspended())
+		throw InvalidExecutionState{ "RuntimeState has no suspended execution to resume" };
+
+	const Caller caller = { STACK.entry->prev, STACK.entry->saved_pc, nullptr, ExecutionStatus::Finished };
+	STACK.status = ExecutionStatus::Running;
+
+	auto body = [&]() {
+		return vm_enter<_Policy>(&STACK, ksp_state, module);
+	};
+
+	return run_execution(STACK, caller, body, true);
+}
+
+template<typename _Policy>
+ksp::reg_t ksp::interpret(KSP_State* ksp_state, const Module* module, RuntimeState& state)
+{
+	state.status = ExecutionStatus::Running;
+	return vm_enter<_Policy>(&state, ksp_state, module);
+}
+
+ksp::reg_t ksp::aot::call_interpreted(RuntimeState& state, KSP_State* ksp_state, const Module* module, const module_info::Function& function)
+{
+	const bytecode::Instruction* const pc = state.pc;
+	function.materialize();
+
+	/*
+	 * A frame without result register makes its RET leave the interpreter. The frame keeps
+	 * its own one afterwards: after a TAILCALL it is still the frame an interpreted caller
+	 * returns through.
+	 */
+	CallInfo* const ci = state.ci;
+	const reg_ptr_t caller_result = ci->result;
+	ci->result = nullptr;
+	ci->arrays = function.fastArrayOperandAccessor;
+	state.pc = function.fastInstructionAccessor;
+	const reg_t result = vm_enter<policy::Release>(&state, ksp_state, module);
+
+	if (state.suspended())
+	{
+		state.cancel();
+		throw InvalidExecutionState{ "Cannot YIELD below ahead-of-time compiled code" };
+	}
+	ci->result = caller_result;
+	state.pc = pc;
+	return result;
+}
+
+#define __instantiate_execute(_Policy) \
+	template ksp::reg_t ksp::execute<_Policy>(KSP_State*, const Module*, const bytecode::RunnableBytecode&); \
+	template ksp::reg_t ksp::execute<_Policy>(KSP_State*, const Module*, const module_info::Function&); \
+	template ksp::reg_t ksp::execute<_Policy>(KSP_State*, const Module*, RuntimeState&, const module_info::Function&); \
+	template ksp::reg_t ksp::resume<_Policy>(KSP_State*, const Module*, RuntimeState&); \
+	template ksp::reg_t ksp::interpret<_Policy>(KSP_State*, const Module*, RuntimeState&)
+
+__instantiate_execute(ksp::policy::Release);
+__instantiate_execute(ksp::policy::Trace);
+__instantiate_execute(ksp::policy::Profile);
+__instantiate_execute(ksp::policy::Verbose);
+
+#undef __instantiate_execute
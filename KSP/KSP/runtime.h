@@ -2,9 +2,27 @@
 
 #include "support.h"
 
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
 #define __KSP_DEFAULT_DATA_STACK_SIZE (1024 * 1024)
 #define __KSP_DEFAULT_CALLS_STACK_SIZE (1024)
 
+/* No-access band placed after the data and calls stacks. Frames with a bigger heap are probed when pushed. */
+#define __KSP_STACK_GUARD_SIZE (64 * 1024)
+
+/* Idle states a RuntimeStatePool keeps by default. Extra states given back are destroyed. */
+#define __KSP_DEFAULT_STATE_POOL_IDLE (16)
+
+/* Computed-goto dispatch needs the GNU "labels as values" extension. Define
+ * __KSP_NO_THREADED_DISPATCH to force the portable switch engine. */
+#if !defined(__KSP_NO_THREADED_DISPATCH) && (defined(__GNUC__) || defined(__clang__))
+#define __KSP_THREADED_DISPATCH
+#endif
+
 namespace ksp
 {
 	typedef stack_ptr_t* temp_ptr_t;
@@ -15,9 +33,21 @@ namespace ksp
 	namespace bytecode
 	{
 		struct RunnableBytecode;
+		struct Instruction;
+		struct ArrayOperands;
+	}
+
+	namespace module_info
+	{
+		class Function;
 	}
 
 
+	/*
+	 * A frame is [heap][regs]: the registers are at its top, so the next frame can start
+	 * inside them. 'result' is the caller register that receives the RET value, nullptr
+	 * for frames pushed by an execution entry point.
+	 */
 	struct CallInfo
 	{
 		stack_ptr_t top;
@@ -25,37 +55,252 @@ namespace ksp
 		reg_ptr_t regs_base;
 		stack_ptr_t bottom;
 
-		bytecode_t saved_pc;
+		const bytecode::Instruction* saved_pc;
+
+		/* Operand table of the function interpreted in this frame, indexed by the k of its bulk array instructions. */
+		const bytecode::ArrayOperands* arrays;
 
 		CallInfo* prev;
 
+		reg_ptr_t result;
+
 		CallInfo() = default;
 		~CallInfo() = default;
 	};
 
+	class StackOverflow : exception
+	{
+	public:
+		inline StackOverflow(const std::string& which) :
+			exception{ ("Script " + which + " stack overflow").c_str() }
+		{}
+		inline StackOverflow(const char* which) :
+			StackOverflow{ std::string{ which } }
+		{}
+	};
+
+	/* Thrown when resuming a RuntimeState with nothing suspended, or executing on one with a suspended execution. */
+	class InvalidExecutionState : exception
+	{
+	public:
+		inline InvalidExecutionState(const std::string& msg) :
+			exception{ msg.c_str() }
+		{}
+	};
+
+	enum class ExecutionStatus : uint8_t
+	{
+		Finished,
+		Running,
+		Suspended
+	};
+
+	/*
+	 * Both stacks are reserved address space, backed by memory only when touched and
+	 * followed by a __KSP_STACK_GUARD_SIZE no-access band. Running into a band while
+	 * executing throws StackOverflow instead of corrupting memory, without any check
+	 * on the push path.
+	 *
+	 * A YIELD leaves the execution Suspended: its frames, registers and pc stay in the
+	 * state until resume() continues it, so a suspended script costs only the stack
+	 * pages it touched.
+	 */
 	struct RuntimeState
 	{
 		CallInfo* ci;
 		CallInfo* calls_base;
 		size_t calls_size;
+		size_t calls_bytes;
 
 		stack_ptr_t data;
 		size_t data_size;
+		size_t data_bytes;
 
 		reg_t rret;
-		bytecode_t pc;
+		const bytecode::Instruction* pc;
+
+		ExecutionStatus status;
+		CallInfo* entry;
 
 		RuntimeState(
 			const size_t calls_stack_size = __KSP_DEFAULT_CALLS_STACK_SIZE,
 			const size_t data_stack_size = __KSP_DEFAULT_DATA_STACK_SIZE);
+		RuntimeState(const RuntimeState&) = delete;
 		~RuntimeState();
 
+		RuntimeState& operator= (const RuntimeState&) = delete;
+
+		/* Which stack's guard band contains 'address', or nullptr. */
+		const char* guard_hit(const void* address) const;
+
 		void print_current_callinfo_registers() const;
 
 		void push_call_info(const uint8_t register_count, const size_t heap_size);
+
+		/*
+		 * Pushes a frame without heap whose registers start at 'window', a register of the
+		 * current frame. The arguments the caller left there are the callee's parameters,
+		 * so a CALL copies nothing; the callee returns its value in 'window'[0].
+		 */
+		void push_call_window(const reg_ptr_t window, const uint8_t register_count);
+
+		/* Resizes the current frame in place for a TAILCALL. Bottom, caller and return slot are kept. */
+		void reuse_call_info(const uint8_t register_count, const size_t heap_size);
+
+		/*
+		 * Drops every frame so the state can serve an unrelated execution. Keeps the
+		 * stacks; with 'release_memory' their pages are also given back to the system.
+		 */
+		void reset(const bool release_memory = false);
+
+		/* Drops a suspended execution, making the frame current when it started current again. */
+		void cancel();
+
+		inline bool suspended() const { return status == ExecutionStatus::Suspended; }
+	};
+
+
+	/*
+	 * Recycles RuntimeStates so that short executions do not reserve and release stacks
+	 * every time. acquire() hands out an idle state, or a new one, already reset; the
+	 * Lease gives it back when destroyed. Safe to use from several threads.
+	 */
+	class RuntimeStatePool
+	{
+	public:
+		class Lease
+		{
+		private:
+			RuntimeStatePool* _pool;
+			std::unique_ptr<RuntimeState> _state;
+
+		public:
+			Lease(RuntimeStatePool* pool, std::unique_ptr<RuntimeState> state);
+			Lease(Lease&&) = default;
+			Lease(const Lease&) = delete;
+			~Lease();
+
+			Lease& operator= (Lease&& other);
+			Lease& operator= (const Lease&) = delete;
+
+			inline RuntimeState& operator* () const { return *_state; }
+			inline RuntimeState* operator-> () const { return _state.get(); }
+			inline RuntimeState& get() const { return *_state; }
+		};
+
+	private:
+		mutable std::mutex _mutex;
+		std::vector<std::unique_ptr<RuntimeState>> _idle;
+		size_t _callsStackSize;
+		size_t _dataStackSize;
+		size_t _maxIdle;
+		size_t _created;
+
+	public:
+		RuntimeStatePool(
+			const size_t calls_stack_size = __KSP_DEFAULT_CALLS_STACK_SIZE,
+			const size_t data_stack_size = __KSP_DEFAULT_DATA_STACK_SIZE,
+			const size_t max_idle = __KSP_DEFAULT_STATE_POOL_IDLE);
+		RuntimeStatePool(const RuntimeStatePool&) = delete;
+		~RuntimeStatePool() = default;
+
+		RuntimeStatePool& operator= (const RuntimeStatePool&) = delete;
+
+		Lease acquire();
+
+		/* Returns the pages of every idle state to the system. The states stay pooled. */
+		void trim();
+
+		size_t idle() const;
+		size_t created() const;
+
+	private:
+		void give_back(std::unique_ptr<RuntimeState> state);
 	};
 
 
 
-	void execute(KSP_State* ksp_state, Module* module, const bytecode::RunnableBytecode& code);
+	/*
+	 * Execution policies. The interpreter loop is instantiated once per policy, so
+	 * the hooks of the policies not chosen by an execute call are not in its code.
+	 */
+	namespace policy
+	{
+		/* No hooks. The only policy that jumps through the handlers resolved at decode time. */
+		struct Release
+		{
+			static constexpr bool resolved_handlers = true;
+
+			static inline void begin(RuntimeState&, KSP_State*) {}
+			static inline void step(RuntimeState&, KSP_State*) {}
+		};
+
+		/* Appends one TraceRecord per executed instruction to KSP_State::trace. */
+		struct Trace
+		{
+			static constexpr bool resolved_handlers = false;
+
+			static void begin(RuntimeState& state, KSP_State* ksp_state);
+			static void step(RuntimeState& state, KSP_State* ksp_state);
+		};
+
+		/* Counts every executed opcode, and optionally its cycles, in KSP_State::profile. */
+		struct Profile
+		{
+			static constexpr bool resolved_handlers = false;
+
+			static void begin(RuntimeState& state, KSP_State* ksp_state);
+			static void step(RuntimeState& state, KSP_State* ksp_state);
+		};
+
+		/* Prints the register file after every executed instruction. */
+		struct Verbose
+		{
+			static constexpr bool resolved_handlers = false;
+
+			static inline void begin(RuntimeState&, KSP_State*) {}
+			static void step(RuntimeState& state, KSP_State* ksp_state);
+		};
+	}
+
+	/* Handler addresses stored in bytecode::Instruction::handler, or nullptr for the switch engine. */
+	const void* const* dispatch_table();
+
+	/* Decodes 'code' on every call. Prefer the Function overload for code that runs more than once. */
+	template<typename _Policy = policy::Release>
+	reg_t execute(KSP_State* ksp_state, const Module* module, const bytecode::RunnableBytecode& code);
+
+	/*
+	 * Under policy::Release a function is compiled by the JIT once it has been called
+	 * __KSP_JIT_THRESHOLD times, here or by a CALL, and runs natively on the same frame
+	 * from then on.
+	 */
+	template<typename _Policy = policy::Release>
+	reg_t execute(KSP_State* ksp_state, const Module* module, const module_info::Function& function);
+
+	/*
+	 * Same as above on a caller owned 'state'. The frame is pushed after state.ci and
+	 * popped again before returning, so one RuntimeState serves any number of calls.
+	 * A RuntimeState and a KSP_State must not be used by two threads at once.
+	 *
+	 * If the function YIELDs, the yielded value is returned and the frame stays pushed
+	 * with state.status Suspended; continue it with resume, or drop it with cancel.
+	 * The overloads without a RuntimeState cancel a yielded execution themselves.
+	 */
+	template<typename _Policy = policy::Release>
+	reg_t execute(KSP_State* ksp_state, const Module* module, RuntimeState& state, const module_info::Function& function);
+
+	/*
+	 * Continues the execution suspended in 'state' after its last YIELD, until the next
+	 * YIELD or HALT. The suspended Function must still be alive. Resumed code is always interpreted.
+	 */
+	template<typename _Policy = policy::Release>
+	reg_t resume(KSP_State* ksp_state, const Module* module, RuntimeState& state);
+
+	/*
+	 * Interprets from state.pc on the frame already pushed in 'state', never entering native code.
+	 * Bulk array instructions need state.ci->arrays set to the fastArrayOperandAccessor of the function.
+	 */
+	template<typename _Policy = policy::Release>
+	reg_t interpret(KSP_State* ksp_state, const Module* module, RuntimeState& state);
 }
@@ -0,0 +1,237 @@
+#include "scheduler.h"
+
+ksp::Fiber::Fiber(const module_info::Function& function) :
+	_function{ &function },
+	_state{},
+	_result{ 0 },
+	_finished{ false },
+	_slices{ 0 },
+	_worker{ 0 },
+	_error{}
+{}
+
+
+
+ksp::Scheduler::Scheduler(const Module& module, const size_t workers, const Queueing queueing) :
+	_module{ module },
+	_queueing{ queueing },
+	_workers{},
+	_global{},
+	_fibers{},
+	_nextWorker{ 0 },
+	_mutex{},
+	_wake{},
+	_done{},
+	_generation{ 0 },
+	_stop{ false },
+	_pending{ 0 },
+	_live{ 0 },
+	_error{},
+	_ready{},
+	_queued{ 0 },
+	_idle{ 0 }
+{
+	const size_t count = workers > 0 ? workers : 1;
+	_workers.reserve(count);
+	for (size_t i = 0; i < count; ++i)
+	{
+		_workers.emplace_back(new Worker);
+		_workers.back()->seed = static_cast<uint32_t>(i * 0x9e3779b9U) | 1U;
+	}
+	for (size_t i = 0; i < count; ++i)
+		_workers[i]->thread = std::thread{ &Scheduler::_work, this, std::ref(*_workers[i]), i };
+}
+ksp::Scheduler::~Scheduler()
+{
+	{
+		std::lock_guard<std::mutex> lock{ _mutex };
+		_stop = true;
+	}
+	_wake.notify_all();
+	for (auto& w : _workers)
+		w->thread.join();
+}
+
+ksp::Fiber& ksp::Scheduler::spawn(const module_info::Function& function)
+{
+	_fibers.emplace_back(new Fiber{ function });
+	Fiber* fiber = _fibers.back().get();
+
+	/* New fibers are dealt round robin; stealing evens out whatever imbalance is left. */
+	_live.fetch_add(1, std::memory_order_relaxed);
+	_push(_queueing == Queueing::Global ? _global : _workers[_nextWorker++ % _workers.size()]->queue, *fiber, 0);
+	return *fiber;
+}
+
+void ksp::Scheduler::run()
+{
+	if (_live.load(std::memory_order_relaxed) == 0)
+		return;
+
+	std::unique_lock<std::mutex> lock{ _mutex };
+	_pending = _workers.size();
+	++_generation;
+	_wake.notify_all();
+
+	_done.wait(lock, [this]() { return _pending == 0; });
+
+	if (_error)
+	{
+		std::exception_ptr error = _error;
+		_error = nullptr;
+		std::rethrow_exception(error);
+	}
+}
+
+void ksp::Scheduler::clear()
+{
+	for (auto& w : _workers)
+		w->queue.fibers.clear();
+	_global.fibers.clear();
+	_fibers.clear();
+	_live.store(0, std::memory_order_relaxed);
+	_queued.store(0, std::memory_order_relaxed);
+}
+
+void ksp::Scheduler::_work(Worker& worker, const size_t index)
+{
+	uint64_t seen = 0;
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock{ _mutex };
+			_wake.wait(lock, [this, seen]() { return _stop || _generation != seen; });
+			if (_stop)
+				return;
+			seen = _generation;
+		}
+
+		while (_live.load(std::memory_order_acquire) > 0)
+		{
+			Fiber* fiber = _take(worker);
+			if (!fiber && _queueing == Queueing::WorkStealing)
+				fiber = _steal(worker, index);
+
+			if (fiber)
+			{
+				_slice(worker, index, *fiber);
+				continue;
+			}
+
+			/* Counted idle before looking at _queued, so that _push either sees this worker or was seen by it. */
+			std::unique_lock<std::mutex> lock{ _mutex };
+			_idle.fetch_add(1);
+			_ready.wait(lock, [this]() { return _queued.load() > 0 || _live.load(std::memory_order_acquire) == 0; });
+			_idle.fetch_sub(1);
+		}
+
+		std::lock_guard<std::mutex> lock{ _mutex };
+		if (--_pending == 0)
+			_done.notify_one();
+	}
+}
+
+ksp::Fiber* ksp::Scheduler::_take(Worker& worker)
+{
+	Queue& queue = _queueing == Queueing::Global ? _global : worker.queue;
+
+	std::lock_guard<std::mutex> lock{ queue.mutex };
+	if (queue.fibers.empty())
+		return nullptr;
+	Fiber* fiber = queue.fibers.front();
+	queue.fibers.pop_front();
+	_queued.fetch_sub(1);
+	return fiber;
+}
+
+ksp::Fiber* ksp::Scheduler::_steal(Worker& worker, const size_t index)
+{
+	const size_t count = _workers.size();
+	if (count < 2)
+		return nullptr;
+
+	/* xorshift32: start at a random victim so idle workers do not all hit the same one. */
+	worker.seed ^= worker.seed << 13;
+	worker.seed ^= worker.seed >> 17;
+	worker.seed ^= worker.seed << 5;
+
+	const size_t first = worker.seed % count;
+	for (size_t i = 0; i < count; ++i)
+	{
+		const size_t victim = (first + i) % count;
+		if (victim == index)
+			continue;
+
+		Queue& queue = _workers[victim]->queue;
+		std::lock_guard<std::mutex> lock{ queue.mutex };
+		if (!queue.fibers.empty())
+		{
+			Fiber* fiber = queue.fibers.front();
+			queue.fibers.pop_front();
+			_queued.fetch_sub(1);
+			return fiber;
+		}
+	}
+	return nullptr;
+}
+
+void ksp::Scheduler::_slice(Worker& worker, const size_t index, Fiber& fiber)
+{
+	++fiber._slices;
+	fiber._worker = index;
+
+	try
+	{
+		if (!fiber._state)
+		{
+			fiber._state.emplace(worker.pool.acquire());
+			fiber._result = execute(&worker.ksp_state, &_module, fiber._state->get(), *fiber._function);
+		}
+		else
+			fiber._result = resume(&worker.ksp_state, &_module, fiber._state->get());
+	}
+	catch (...)
+	{
+		fiber._error = std::current_exception();
+		{
+			std::lock_guard<std::mutex> lock{ _mutex };
+			if (!_error)
+				_error = fiber._error;
+		}
+		_finish(fiber);
+		return;
+	}
+
+	/* This worker goes back for a fiber itself, so another one is only worth waking for a second. */
+	if (fiber._state->get().suspended())
+		_push(_queueing == Queueing::Global ? _global : worker.queue, fiber, 1);
+	else
+		_finish(fiber);
+}
+
+void ksp::Scheduler::_push(Queue& queue, Fiber& fiber, const size_t claimed)
+{
+	{
+		std::lock_guard<std::mutex> lock{ queue.mutex };
+		queue.fibers.push_back(&fiber);
+	}
+	const size_t queued = _queued.fetch_add(1) + 1;
+
+	/* Taking _mutex orders the notification after the predicate check of a worker about to wait. */
+	if (queued > claimed && _idle.load() > 0)
+	{
+		{ std::lock_guard<std::mutex> lock{ _mutex }; }
+		_ready.notify_one();
+	}
+}
+
+void ksp::Scheduler::_finish(Fiber& fiber)
+{
+	fiber._state.reset();
+	fiber._finished = true;
+	if (_live.fetch_sub(1, std::memory_order_release) == 1)
+	{
+		{ std::lock_guard<std::mutex> lock{ _mutex }; }
+		_ready.notify_all();
+	}
+}
@@ -0,0 +1,162 @@
+#pragma once
+
+#include "support.h"
+#include "runtime.h"
+#include "vm.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+
+/* Idle RuntimeStates each worker keeps for new fibers. */
+#define __KSP_SCHEDULER_POOL_IDLE (256)
+
+namespace ksp
+{
+	/* One resumable execution of a Function, run by a Scheduler until it HALTs. */
+	class Fiber
+	{
+	private:
+		const module_info::Function* _function;
+		std::optional<RuntimeStatePool::Lease> _state;
+		reg_t _result;
+		bool _finished;
+		size_t _slices;
+		size_t _worker;
+		std::exception_ptr _error;
+
+	public:
+		Fiber(const module_info::Function& function);
+		Fiber(const Fiber&) = delete;
+		~Fiber() = default;
+
+		Fiber& operator= (const Fiber&) = delete;
+
+		inline const module_info::Function& function() const { return *_function; }
+
+		inline bool finished() const { return _finished; }
+
+		/* What a slice threw, ending the fiber; null unless it failed. */
+		inline std::exception_ptr error() const { return _error; }
+
+		/* The value of the last YIELD, or of the HALT once finished. */
+		inline reg_t result() const { return _result; }
+
+		/* Times the fiber was run: its first execute and every resume. */
+		inline size_t slices() const { return _slices; }
+
+		/* Index of the worker that ran its last slice. */
+		inline size_t lastWorker() const { return _worker; }
+
+		friend class Scheduler;
+	};
+
+	/*
+	 * Runs Fibers of one built Module over a pool of worker threads, one slice (up to
+	 * the next YIELD) at a time.
+	 *
+	 * With Queueing::WorkStealing every worker owns a deque of runnable fibers. It runs
+	 * them from the front and puts a fiber that yielded back at its own back, so a fiber
+	 * stays on the core that has its frames in cache. An idle worker steals the front of
+	 * another worker's deque: the fiber that ran there longest ago, with the least left
+	 * in that cache. Queueing::Global shares a single queue instead. A worker that finds
+	 * nothing to run sleeps until a fiber is queued or the last one finishes.
+	 *
+	 * Every worker owns a RuntimeStatePool; a fiber leases its state on its first slice
+	 * and gives it back when it finishes.
+	 */
+	class Scheduler
+	{
+	public:
+		enum class Queueing
+		{
+			WorkStealing,
+			Global
+		};
+
+	private:
+		struct Queue
+		{
+			std::mutex mutex;
+			std::deque<Fiber*> fibers;
+		};
+
+		struct Worker
+		{
+			std::thread thread;
+			Queue queue;
+			RuntimeStatePool pool;
+			KSP_State ksp_state;
+			uint32_t seed;
+
+			Worker() :
+				thread{},
+				queue{},
+				pool{ __KSP_DEFAULT_CALLS_STACK_SIZE, __KSP_DEFAULT_DATA_STACK_SIZE, __KSP_SCHEDULER_POOL_IDLE },
+				ksp_state{},
+				seed{ 1 }
+			{}
+		};
+
+		const Module& _module;
+		const Queueing _queueing;
+		std::vector<std::unique_ptr<Worker>> _workers;
+		Queue _global;
+		std::vector<std::unique_ptr<Fiber>> _fibers;
+		size_t _nextWorker;
+
+		std::mutex _mutex;
+		std::condition_variable _wake;
+		std::condition_variable _done;
+		uint64_t _generation;
+		bool _stop;
+		size_t _pending;
+		std::atomic<size_t> _live;
+		std::exception_ptr _error;
+
+		// Idle workers wait on _ready, under _mutex, for a queued fiber //
+		std::condition_variable _ready;
+		std::atomic<size_t> _queued;
+		std::atomic<size_t> _idle;
+
+	public:
+		Scheduler(const Module& module, const size_t workers = std::thread::hardware_concurrency(), const Queueing queueing = Queueing::WorkStealing);
+		Scheduler(const Scheduler&) = delete;
+		~Scheduler();
+
+		Scheduler& operator= (const Scheduler&) = delete;
+
+		inline size_t workerCount() const { return _workers.size(); }
+		inline Queueing queueing() const { return _queueing; }
+
+		/* Queues a new fiber of 'function'. Must not be called while run() is running. */
+		Fiber& spawn(const module_info::Function& function);
+
+		/*
+		 * Runs every spawned fiber until all of them finished. A fiber whose slice throws
+		 * finishes there with its error() set; the others run on, then run() rethrows the first error.
+		 */
+		void run();
+
+		/* Destroys every fiber. */
+		void clear();
+
+		inline size_t fiberCount() const { return _fibers.size(); }
+		inline const Fiber& fiber(const size_t index) const { return *_fibers[index]; }
+
+	private:
+		void _work(Worker& worker, const size_t index);
+
+		Fiber* _take(Worker& worker);
+		Fiber* _steal(Worker& worker, const size_t index);
+		void _slice(Worker& worker, const size_t index, Fiber& fiber);
+
+		void _push(Queue& queue, Fiber& fiber, const size_t claimed);
+		void _finish(Fiber& fiber);
+	};
+}
@@ -1,11 +1,22 @@
 #pragma once
 
+#include <algorithm>
 #include <cinttypes>
+#include <exception>
 #include <string>
 #include <vector>
 
 #define INVOKE_CONSTRUCTOR(_Object, _Class, ...) new(&(_Object)) _Class{ __VA_ARGS__ }
 
+/* MSVC compiles intrinsics for any target; GCC and Clang need the ISA on the function using them. */
+#if defined(__GNUC__) || defined(__clang__)
+#define __KSP_TARGET(_Isa) __attribute__((target(_Isa)))
+#define __KSP_FLATTEN __attribute__((flatten))
+#else
+#define __KSP_TARGET(_Isa)
+#define __KSP_FLATTEN
+#endif
+
 namespace ksp
 {
 	typedef void* ptr_t;
@@ -26,4 +37,20 @@ namespace ksp
 	{
 		return (a > b) ? (a) : (b);
 	}
+
+	/* Base of the ksp exceptions. Only the MSVC std::exception keeps a message, so elsewhere this one does. */
+#if defined(_MSC_VER)
+	typedef std::exception exception;
+#else
+	class exception : public std::exception
+	{
+	private:
+		std::string _msg;
+
+	public:
+		inline exception(const char* msg) : _msg{ msg } {}
+
+		inline const char* what() const noexcept override { return _msg.c_str(); }
+	};
+#endif
 }
@@ -0,0 +1,43 @@
+#include "trace.h"
+
+#include "ops.h"
+
+ksp::TraceBuffer::TraceBuffer(const size_t capacity) :
+	_records{},
+	_written{ 0 }
+{
+	if (capacity > 0)
+		reset(capacity);
+}
+
+void ksp::TraceBuffer::reset(const size_t capacity)
+{
+	size_t len = 1;
+	while (len < capacity)
+		len <<= 1;
+
+	_records.assign(len, TraceRecord{});
+	_written = 0;
+}
+
+const ksp::TraceRecord& ksp::TraceBuffer::operator[] (const size_t index) const
+{
+	const uint64_t first = _written - size();
+	return _records[static_cast<size_t>(first + index) & (_records.size() - 1)];
+}
+
+
+
+std::ostream& operator<< (std::ostream& os, const ksp::TraceBuffer& trace)
+{
+	const size_t len = trace.size();
+	for (size_t i = 0; i < len; ++i)
+	{
+		const auto& r = trace[i];
+		const ksp::OpcodeInfo* info = ksp::opcode::info::find(r.op);
+		os << r.sequence << ": " << (info ? info->name() : std::to_string(r.op))
+			<< " a=" << static_cast<int>(r.a) << " b=" << static_cast<int>(r.b) << " c=" << static_cast<int>(r.c)
+			<< " ; ra=" << r.ra << " rb=" << r.rb << std::endl;
+	}
+	return os;
+}
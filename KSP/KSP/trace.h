@@ -0,0 +1,50 @@
+#pragma once
+
+#include "support.h"
+
+#include <iostream>
+
+#define __KSP_DEFAULT_TRACE_BUFFER_SIZE (4096)
+
+namespace ksp
+{
+	/* One executed instruction, with the values of its a/b registers after it ran; 0 where a or b is not a register. */
+	struct TraceRecord
+	{
+		uint32_t sequence;
+		opcode_t op;
+		uint8_t  a;
+		uint8_t  b;
+		uint8_t  c;
+		reg_t    ra;
+		reg_t    rb;
+	};
+
+	/* Fixed size ring of TraceRecords; once full, the oldest records are overwritten. */
+	class TraceBuffer
+	{
+	private:
+		std::vector<TraceRecord> _records;
+		uint64_t _written;
+
+	public:
+		TraceBuffer(const size_t capacity = 0);
+		~TraceBuffer() = default;
+
+		/* Drops every record. The capacity is rounded up to a power of two. */
+		void reset(const size_t capacity);
+		inline void clear() { _written = 0; }
+
+		inline size_t capacity() const { return _records.size(); }
+		inline uint64_t written() const { return _written; }
+		inline size_t size() const { return _written < _records.size() ? static_cast<size_t>(_written) : _records.size(); }
+		inline bool empty() const { return _written == 0; }
+
+		inline void push(const TraceRecord& record) { _records[static_cast<size_t>(_written++) & (_records.size() - 1)] = record; }
+
+		/* Index 0 is the oldest record still in the ring. */
+		const TraceRecord& operator[] (const size_t index) const;
+	};
+}
+
+std::ostream& operator<< (std::ostream& os, const ksp::TraceBuffer& trace);
@@ -1,36 +1,62 @@
 #include "types.h"
 
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+
 bool ksp::TypeInfo::_equals(const TypeInfo& type) const
 {
 	if (this == &type)
 		return true;
-	if (_kind != type._kind)
+	if (_kind != type._kind || _size != type._size)
 		return false;
 	switch (_kind)
 	{
 		default: return true;
 		case TypeKind::Pointer:
-			return _componentType
-				? type._componentType && _componentType->_equals(*type._componentType)
-				: !type._componentType;
+			return _same(_componentType, type._componentType);
 		case TypeKind::Array:
 			return _elementCount == type._elementCount &&
-				_componentType->_equals(*type._componentType);
+				_same(_componentType, type._componentType);
+		case TypeKind::Function:
+			if (!_same(_returnType, type._returnType) || _parameters.size() != type._parameters.size())
+				return false;
+			for (size_t i = 0; i < _parameters.size(); ++i)
+				if (_parameters[i].name != type._parameters[i].name || !_same(_parameters[i].type, type._parameters[i].type))
+					return false;
+			return true;
+		case TypeKind::Struct:
+			if (_fields.size() != type._fields.size())
+				return false;
+			for (size_t i = 0; i < _fields.size(); ++i)
+				if (_fields[i].name != type._fields[i].name || _fields[i].offset != type._fields[i].offset || !_same(_fields[i].type, type._fields[i].type))
+					return false;
+			return true;
 	}
-	return false;
 }
 
-bool operator== (const ksp::TypeInfo& t0, const ksp::TypeInfo& t1) { return t0._equals(t1); }
-bool operator!= (const ksp::TypeInfo& t0, const ksp::TypeInfo& t1) { return !t0._equals(t1); }
+/* Canonical types are equal only to themselves; the structural walk is left for copies. */
+bool ksp::TypeInfo::_same(const TypeInfo* t0, const TypeInfo* t1)
+{
+	if (t0 == t1)
+		return true;
+	if (!t0 || !t1 || (t0->_interned && t1->_interned))
+		return false;
+	return t0->_equals(*t1);
+}
+
+bool operator== (const ksp::TypeInfo& t0, const ksp::TypeInfo& t1) { return ksp::TypeInfo::_same(&t0, &t1); }
+bool operator!= (const ksp::TypeInfo& t0, const ksp::TypeInfo& t1) { return !ksp::TypeInfo::_same(&t0, &t1); }
 
-bool operator== (const ksp::Type& t0, const ksp::Type& t1) { return t0._type->_equals(*t1._type); }
-bool operator!= (const ksp::Type& t0, const ksp::Type& t1) { return !t0._type->_equals(*t1._type); }
+bool operator== (const ksp::Type& t0, const ksp::Type& t1) { return ksp::TypeInfo::_same(t0._type, t1._type); }
+bool operator!= (const ksp::Type& t0, const ksp::Type& t1) { return !ksp::TypeInfo::_same(t0._type, t1._type); }
 
-bool operator== (const ksp::TypeInfo& t0, const ksp::Type& t1) { return t0._equals(*t1._type); }
-bool operator!= (const ksp::TypeInfo& t0, const ksp::Type& t1) { return !t0._equals(*t1._type); }
+bool operator== (const ksp::TypeInfo& t0, const ksp::Type& t1) { return ksp::TypeInfo::_same(&t0, t1._type); }
+bool operator!= (const ksp::TypeInfo& t0, const ksp::Type& t1) { return !ksp::TypeInfo::_same(&t0, t1._type); }
 
-bool operator== (const ksp::Type& t0, const ksp::TypeInfo& t1) { return t0._type->_equals(t1); }
-bool operator!= (const ksp::Type& t0, const ksp::TypeInfo& t1) { return !t0._type->_equals(t1); }
+bool operator== (const ksp::Type& t0, const ksp::TypeInfo& t1) { return ksp::TypeInfo::_same(t0._type, &t1); }
+bool operator!= (const ksp::Type& t0, const ksp::TypeInfo& t1) { return !ksp::TypeInfo::_same(t0._type, &t1); }
 
 
 void ksp::TypeInfo::_resetExtra()
@@ -40,6 +66,9 @@ void ksp::TypeInfo::_resetExtra()
 		case TypeKind::Function:
 			_parameters.~vector();
 			break;
+		case TypeKind::Struct:
+			_fields.~vector();
+			break;
 	}
 }
 void ksp::TypeInfo::_copyExtra(const TypeInfo& type)
@@ -55,7 +84,11 @@ void ksp::TypeInfo::_copyExtra(const TypeInfo& type)
 			break;
 		case TypeKind::Function:
 			_returnType = type._returnType;
-			_parameters = type._parameters;
+			INVOKE_CONSTRUCTOR(_parameters, std::vector<FunctionParameter>, type._parameters);
+			break;
+		case TypeKind::Struct:
+			_alignment = type._alignment;
+			INVOKE_CONSTRUCTOR(_fields, std::vector<StructField>, type._fields);
 			break;
 	}
 }
@@ -72,15 +105,21 @@ void ksp::TypeInfo::_moveExtra(TypeInfo&& type) noexcept
 		break;
 	case TypeKind::Function:
 		_returnType = std::move(type._returnType);
-		_parameters = std::move(type._parameters);
+		INVOKE_CONSTRUCTOR(_parameters, std::vector<FunctionParameter>, std::move(type._parameters));
+		break;
+	case TypeKind::Struct:
+		_alignment = type._alignment;
+		INVOKE_CONSTRUCTOR(_fields, std::vector<StructField>, std::move(type._fields));
 		break;
 	}
 }
 
-ksp::TypeInfo::TypeInfo(const TypeKind kind, const size_t size) :
+ksp::TypeInfo::TypeInfo(const TypeKind kind, const size_t size, const bool interned) :
 	_kind{ kind },
+	_interned{ interned },
 	_size{ size },
-	_extra{}
+	_componentType{ nullptr },
+	_elementCount{ 0 }
 {}
 ksp::TypeInfo::TypeInfo(const TypeInfo& type) :
 	TypeInfo{ type._kind, type._size }
@@ -89,6 +128,7 @@ ksp::TypeInfo::TypeInfo(const TypeInfo& type) :
 }
 ksp::TypeInfo::TypeInfo(TypeInfo&& type) noexcept :
 	_kind{ std::move(type._kind) },
+	_interned{ false },
 	_size{ std::move(type._size) }
 {
 	_moveExtra(std::move(type));
@@ -123,54 +163,257 @@ size_t ksp::TypeInfo::getExtraSizeRequired() const
 			return 0;
 
 		case TypeKind::Array:
+		case TypeKind::Struct:
 			return _size;
 	}
 }
 
+size_t ksp::TypeInfo::alignment() const
+{
+	switch (_kind)
+	{
+		case TypeKind::Array:
+			return _componentType->alignment();
+		case TypeKind::Struct:
+			return _alignment;
+		case TypeKind::Pointer:
+		case TypeKind::Function:
+			return sizeof(void*);
+		default:
+			return _size > 0 ? _size : 1;
+	}
+}
+
+/* _fields shares its storage with the extras of the other kinds. */
+const std::vector<ksp::TypeInfo::StructField>& ksp::TypeInfo::fields() const
+{
+	static const std::vector<StructField> none;
+	return _kind == TypeKind::Struct ? _fields : none;
+}
+
+const ksp::TypeInfo::StructField* ksp::TypeInfo::field(const Atom& name) const
+{
+	if (_kind != TypeKind::Struct)
+		return nullptr;
+	for (const StructField& f : _fields)
+		if (f.name == name)
+			return &f;
+	return nullptr;
+}
+
+size_t ksp::TypeInfo::padding() const
+{
+	if (_kind != TypeKind::Struct)
+		return 0;
+	size_t used = 0;
+	for (const StructField& f : _fields)
+		used += f.type->_size;
+	return _size - used;
+}
+
 
 
-const ksp::TypeInfo ksp::TypeInfo::Invalid{};
+const ksp::TypeInfo ksp::TypeInfo::Invalid{ static_cast<TypeKind>(0), 0, true };
 
-const ksp::TypeInfo ksp::TypeInfo::Byte{ TypeKind::Byte, sizeof(int8_t) };
-const ksp::TypeInfo ksp::TypeInfo::Short{ TypeKind::Short, sizeof(int16_t) };
-const ksp::TypeInfo ksp::TypeInfo::Integer{ TypeKind::Integer, sizeof(int32_t) };
-const ksp::TypeInfo ksp::TypeInfo::Long{ TypeKind::Long, sizeof(int64_t) };
+const ksp::TypeInfo ksp::TypeInfo::Byte{ TypeKind::Byte, sizeof(int8_t), true };
+const ksp::TypeInfo ksp::TypeInfo::Short{ TypeKind::Short, sizeof(int16_t), true };
+const ksp::TypeInfo ksp::TypeInfo::Integer{ TypeKind::Integer, sizeof(int32_t), true };
+const ksp::TypeInfo ksp::TypeInfo::Long{ TypeKind::Long, sizeof(int64_t), true };
 
-const ksp::TypeInfo ksp::TypeInfo::UByte{ TypeKind::UByte, sizeof(uint8_t) };
-const ksp::TypeInfo ksp::TypeInfo::UShort{ TypeKind::UShort, sizeof(uint16_t) };
-const ksp::TypeInfo ksp::TypeInfo::UInteger{ TypeKind::UInteger, sizeof(uint32_t) };
-const ksp::TypeInfo ksp::TypeInfo::ULong{ TypeKind::ULong, sizeof(uint64_t) };
+const ksp::TypeInfo ksp::TypeInfo::UByte{ TypeKind::UByte, sizeof(uint8_t), true };
+const ksp::TypeInfo ksp::TypeInfo::UShort{ TypeKind::UShort, sizeof(uint16_t), true };
+const ksp::TypeInfo ksp::TypeInfo::UInteger{ TypeKind::UInteger, sizeof(uint32_t), true };
+const ksp::TypeInfo ksp::TypeInfo::ULong{ TypeKind::ULong, sizeof(uint64_t), true };
 
-const ksp::TypeInfo ksp::TypeInfo::Float{ TypeKind::Float, sizeof(float) };
-const ksp::TypeInfo ksp::TypeInfo::Double{ TypeKind::Double, sizeof(double) };
+const ksp::TypeInfo ksp::TypeInfo::Float{ TypeKind::Float, sizeof(float), true };
+const ksp::TypeInfo ksp::TypeInfo::Double{ TypeKind::Double, sizeof(double), true };
 
-const ksp::TypeInfo ksp::TypeInfo::Boolean{ TypeKind::Boolean, sizeof(bool) };
+const ksp::TypeInfo ksp::TypeInfo::Boolean{ TypeKind::Boolean, sizeof(bool), true };
 
-const ksp::TypeInfo ksp::TypeInfo::Character{ TypeKind::Character, sizeof(char16_t) };
+const ksp::TypeInfo ksp::TypeInfo::Character{ TypeKind::Character, sizeof(char16_t), true };
 
 
 
-ksp::TypeInfo ksp::TypeInfo::pointerOf(const TypeInfo& type)
+namespace
+{
+	/* Canonical pointer, array and function types; never freed, so their addresses stay valid. */
+	class TypeInterner
+	{
+	private:
+		std::mutex _mutex;
+		std::deque<ksp::TypeInfo> _types;
+		std::unordered_multimap<uint64_t, const ksp::TypeInfo*> _index;
+
+	public:
+		const ksp::TypeInfo* find(const uint64_t hash, const ksp::TypeInfo& type)
+		{
+			const auto range = _index.equal_range(hash);
+			for (auto it = range.first; it != range.second; ++it)
+				if (*it->second == type)
+					return it->second;
+			return nullptr;
+		}
+
+		template<typename _Fn>
+		const ksp::TypeInfo& intern(const uint64_t hash, ksp::TypeInfo&& type, _Fn&& mark)
+		{
+			std::lock_guard<std::mutex> lock{ _mutex };
+
+			if (const ksp::TypeInfo* found = find(hash, type))
+				return *found;
+
+			_types.push_back(std::move(type));
+			mark(_types.back());
+			_index.emplace(hash, &_types.back());
+			return _types.back();
+		}
+
+		inline size_t count()
+		{
+			std::lock_guard<std::mutex> lock{ _mutex };
+			return _types.size();
+		}
+	};
+
+	TypeInterner& type_interner()
+	{
+		static TypeInterner interner;
+		return interner;
+	}
+
+	inline uint64_t hash_combine(const uint64_t hash, const uint64_t value)
+	{
+		return (hash ^ value) * 0x100000001b3ULL;
+	}
+	inline uint64_t hash_combine(const uint64_t hash, const void* ptr)
+	{
+		return hash_combine(hash, static_cast<uint64_t>(reinterpret_cast<uintptr_t>(ptr)));
+	}
+}
+
+const ksp::TypeInfo& ksp::TypeInfo::intern(const TypeInfo& type)
+{
+	if (type._interned)
+		return type;
+
+	switch (type._kind)
+	{
+		case TypeKind::Byte: return type._size == 0 ? Invalid : Byte; /* Invalid shares the kind of Byte. */
+		case TypeKind::Short: return Short;
+		case TypeKind::Integer: return Integer;
+		case TypeKind::Long: return Long;
+		case TypeKind::UByte: return UByte;
+		case TypeKind::UShort: return UShort;
+		case TypeKind::UInteger: return UInteger;
+		case TypeKind::ULong: return ULong;
+		case TypeKind::Float: return Float;
+		case TypeKind::Double: return Double;
+		case TypeKind::Boolean: return Boolean;
+		case TypeKind::Character: return Character;
+		case TypeKind::Pointer: case TypeKind::Array: case TypeKind::Function: case TypeKind::Struct: break;
+		default: return Invalid;
+	}
+
+	/* Components first, so that the canonical type only refers to canonical types and compares them by address. */
+	TypeInfo key{ type };
+	uint64_t hash = hash_combine(hash_combine(0xcbf29ce484222325ULL, static_cast<uint64_t>(key._kind)), key._size);
+	switch (key._kind)
+	{
+		case TypeKind::Array:
+			hash = hash_combine(hash, key._elementCount);
+			[[fallthrough]];
+		case TypeKind::Pointer:
+			if (key._componentType)
+				key._componentType = &intern(*key._componentType);
+			hash = hash_combine(hash, key._componentType);
+			break;
+
+		case TypeKind::Function:
+			if (key._returnType)
+				key._returnType = &intern(*key._returnType);
+			hash = hash_combine(hash, key._returnType);
+			for (FunctionParameter& param : key._parameters)
+			{
+				if (param.type)
+					param.type = &intern(*param.type);
+				hash = hash_combine(hash_combine(hash, param.type), param.name.id());
+			}
+			break;
+
+		case TypeKind::Struct:
+			for (StructField& field : key._fields)
+			{
+				field.type = &intern(*field.type);
+				hash = hash_combine(hash_combine(hash_combine(hash, field.type), field.name.id()), field.offset);
+			}
+			break;
+	}
+
+	return type_interner().intern(hash, std::move(key), [](TypeInfo& t) { t._interned = true; });
+}
+
+size_t ksp::TypeInfo::internedCount()
+{
+	return type_interner().count();
+}
+
+const ksp::TypeInfo& ksp::TypeInfo::pointerOf(const TypeInfo& type)
 {
 	TypeInfo t{ TypeKind::Pointer, sizeof(void*) };
 	t._componentType = &type;
-	return std::move(t);
+	return intern(t);
 }
 
-ksp::TypeInfo ksp::TypeInfo::arrayOf(const TypeInfo& type, const size_t element_count)
+const ksp::TypeInfo& ksp::TypeInfo::arrayOf(const TypeInfo& type, const size_t element_count)
 {
 	TypeInfo t{ TypeKind::Array, type._size * element_count };
 	t._componentType = &type;
 	t._elementCount = element_count;
-	return std::move(t);
+	return intern(t);
 }
 
-ksp::TypeInfo ksp::TypeInfo::function(const TypeInfo& returnType, const std::vector<FunctionParameter>& parameters)
+const ksp::TypeInfo& ksp::TypeInfo::function(const TypeInfo& returnType, const std::vector<FunctionParameter>& parameters)
 {
 	TypeInfo t{ TypeKind::Function, sizeof(void*) };
 	t._returnType = &returnType;
 	INVOKE_CONSTRUCTOR(t._parameters, std::vector<FunctionParameter>, parameters);
-	return std::move(t);
+	return intern(t);
+}
+
+const ksp::TypeInfo& ksp::TypeInfo::structOf(const std::vector<FunctionParameter>& fields, const StructLayout layout)
+{
+	for (size_t i = 0; i < fields.size(); ++i)
+	{
+		/* Byte shares kind 0 with Invalid; only the size tells them apart. */
+		if (!fields[i].type || fields[i].type->size() == 0)
+			throw InvalidType{ "struct field " + fields[i].name.str() + " has no valid type" };
+		for (size_t j = 0; j < i; ++j)
+			if (fields[j].name == fields[i].name)
+				throw InvalidType{ "struct field " + fields[i].name.str() + " declared twice" };
+	}
+
+	/* Decreasing power of two alignments leave no gap between fields, only at the end. */
+	std::vector<size_t> order(fields.size());
+	for (size_t i = 0; i < order.size(); ++i)
+		order[i] = i;
+	if (layout == StructLayout::MinimalPadding)
+		std::stable_sort(order.begin(), order.end(), [&fields](const size_t f0, const size_t f1) { return fields[f0].type->alignment() > fields[f1].type->alignment(); });
+
+	std::vector<StructField> laid(fields.size());
+	size_t size = 0, alignment = 1;
+	for (const size_t i : order)
+	{
+		const size_t align = fields[i].type->alignment();
+		size = (size + align - 1) / align * align;
+		laid[i] = { fields[i].type, fields[i].name, size };
+		size += fields[i].type->_size;
+		alignment = align > alignment ? align : alignment;
+	}
+
+	TypeInfo t{ TypeKind::Struct, (size + alignment - 1) / alignment * alignment };
+	t._alignment = alignment;
+	INVOKE_CONSTRUCTOR(t._fields, std::vector<StructField>, std::move(laid));
+	return intern(t);
 }
 
 
@@ -1,10 +1,12 @@
 #pragma once
 
 #include <cinttypes>
+#include <exception>
 #include <string>
 #include <vector>
 
 #include "support.h"
+#include "atom.h"
 
 namespace ksp
 {
@@ -24,6 +26,9 @@ bool operator!= (const ksp::TypeInfo& t0, const ksp::Type& t1);
 bool operator== (const ksp::Type& t0, const ksp::TypeInfo& t1);
 bool operator!= (const ksp::Type& t0, const ksp::TypeInfo& t1);
 
+/* Cache line size assumed by TypeInfo::fitsInCacheLine. */
+#define __KSP_CACHE_LINE_SIZE (64)
+
 namespace ksp
 {
 	typedef char type_identifier_t[32];
@@ -47,7 +52,23 @@ namespace ksp
 		Character,
 		Pointer,
 		Array,
-		Function
+		Function,
+		Struct
+	};
+
+	/* Field order of a struct type: as declared, or by decreasing alignment so that padding is minimal. */
+	enum class StructLayout
+	{
+		Declared,
+		MinimalPadding
+	};
+
+	class InvalidType : exception
+	{
+	public:
+		inline InvalidType(const std::string& msg) :
+			exception{ ("Invalid type: " + msg).c_str() }
+		{}
 	};
 
 
@@ -60,51 +81,41 @@ namespace ksp
 		struct FunctionParameter
 		{
 			const TypeInfo* type;
-			std::string     name;
+			Atom            name;
+		};
+
+		/* 'offset' is in bytes from the start of the struct. */
+		struct StructField
+		{
+			const TypeInfo* type;
+			Atom            name;
+			size_t          offset;
 		};
-		typedef FunctionParameter StructField;
 
 	private:
 		TypeKind _kind;
+		bool     _interned;
 		size_t   _size;
 
 		// Type specific part //
 		union
 		{
-			// Pointer //
-			struct
-			{
-				const TypeInfo* _componentType;
-			};
-
-			// Array //
-			struct
-			{
-				const TypeInfo* _componentType;
-				size_t          _elementCount;
-			};
-
-			// Function //
-			struct
-			{
-				const TypeInfo* _returnType;
-				std::vector<FunctionParameter> _parameters;
-			};
-
-			char _extra[
-				max(
-					max(
-						sizeof(_componentType),
-						sizeof(_componentType) + sizeof(_elementCount)),
-					sizeof(_returnType) + sizeof(_parameters)
-				)
-			];
+			const TypeInfo* _componentType;  // Pointer, Array
+			const TypeInfo* _returnType;     // Function
+			size_t          _alignment;      // Struct
 		};
+		union
+		{
+			size_t                         _elementCount;  // Array
+			std::vector<FunctionParameter> _parameters;    // Function
+			std::vector<StructField>       _fields;        // Struct
+		};
+
 		void _resetExtra();
 		void _copyExtra(const TypeInfo& type);
 		void _moveExtra(TypeInfo&& type) noexcept;
 
-		TypeInfo(const TypeKind kind, const size_t size);
+		TypeInfo(const TypeKind kind, const size_t size, const bool interned = false);
 
 	public:
 		inline TypeInfo() : TypeInfo{ static_cast<TypeKind>(0), 0 } {}
@@ -122,6 +133,9 @@ namespace ksp
 
 		inline bool isInvalid() const { return !static_cast<int>(_kind); }
 
+		/* True for the canonical instance of a type, which only compares equal to itself. */
+		inline bool isInterned() const { return _interned; }
+
 		inline const TypeInfo* componentType() const { return _componentType; }
 
 		inline size_t elementCount() const { return _elementCount; }
@@ -129,11 +143,28 @@ namespace ksp
 		inline const TypeInfo* returnType() const { return _returnType; }
 		inline const std::vector<FunctionParameter>& parameters() const { return _parameters; }
 
+		/* Natural alignment: the size of primitives, that of the component of arrays, the largest field alignment of structs. */
+		size_t alignment() const;
+
+		/* Struct fields in declaration order, each with its offset. Empty for other kinds. */
+		const std::vector<StructField>& fields() const;
+
+		/* The field named 'name', or nullptr (always for kinds other than Struct). */
+		const StructField* field(const Atom& name) const;
+
+		/* Bytes of a struct not covered by any field; 0 for other kinds. */
+		size_t padding() const;
+
+		/* True if the type is no larger than a cache line, so that placed at a multiple of __KSP_CACHE_LINE_SIZE it touches one line. */
+		inline bool fitsInCacheLine() const { return _size <= __KSP_CACHE_LINE_SIZE; }
+
 
 
 	private:
 		bool _equals(const TypeInfo& type) const;
 
+		static bool _same(const TypeInfo* t0, const TypeInfo* t1);
+
 	public:
 		friend class Type;
 
@@ -169,11 +200,31 @@ namespace ksp
 	public:
 		inline static TypeInfo invalid() { return std::move(TypeInfo{}); }
 
-		static TypeInfo pointerOf(const TypeInfo& type);
+		/*
+		 * The canonical instance of 'type': one per structurally distinct type, kept for the
+		 * life of the process. The primitive types are the static instances above. Function
+		 * types are distinct when their return type, parameter types or parameter names are.
+		 * Thread safe.
+		 */
+		static const TypeInfo& intern(const TypeInfo& type);
+
+		/* Number of canonical pointer, array and function types. */
+		static size_t internedCount();
 
-		static TypeInfo arrayOf(const TypeInfo& type, const size_t element_count);
+		/* These return canonical instances. */
+		static const TypeInfo& pointerOf(const TypeInfo& type);
 
-		static TypeInfo function(const TypeInfo& returnType, const std::vector<FunctionParameter>& parameters);
+		static const TypeInfo& arrayOf(const TypeInfo& type, const size_t element_count);
+
+		static const TypeInfo& function(const TypeInfo& returnType, const std::vector<FunctionParameter>& parameters);
+
+		/*
+		 * Lays 'fields' out in a struct: every field at its natural alignment, in the order
+		 * given by 'layout', and the size rounded to the struct alignment. fields() keeps the
+		 * declaration order either way. Throws InvalidType for a field without a valid type
+		 * and for repeated names.
+		 */
+		static const TypeInfo& structOf(const std::vector<FunctionParameter>& fields, const StructLayout layout = StructLayout::Declared);
 	};
 
 
@@ -222,6 +273,7 @@ namespace ksp
 		inline bool isCharacter() const { return _type->_kind == TypeKind::Character; }
 		inline bool isPointer() const { return _type->_kind == TypeKind::Pointer; }
 		inline bool isArray() const { return _type->_kind == TypeKind::Array; }
+		inline bool isStruct() const { return _type->_kind == TypeKind::Struct; }
 
 		inline TypeKind kind() const { return _type->_kind; }
 		inline size_t size() const { return _type->_size; }
@@ -235,6 +287,9 @@ namespace ksp
 		inline Type returnType() const { return _type->_returnType; }
 		inline const std::vector<TypeInfo::FunctionParameter>& parameters() const { return _type->_parameters; }
 
+		inline size_t alignment() const { return _type->alignment(); }
+		inline const std::vector<TypeInfo::StructField>& fields() const { return _type->fields(); }
+
 	public:
 		friend class TypeInfo;
 		friend bool ::operator== (const ksp::Type& t0, const ksp::Type& t1);
@@ -1,5 +1,13 @@
 #include "vm.h"
 
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+
+#include "runtime.h"
+#include "arrays.h"
+
 
 /* NAME TABLE */
 
@@ -8,21 +16,22 @@ ksp::module_info::NameTable::Element::Element() :
 	_offset{ 0 },
 	_kind{ Kind::Invalid },
 	_extern{ false },
-	_data{ nullptr }
+	_data{ nullptr },
+	_dirty{ true },
+	_laidOut{ Kind::Invalid }
 {}
 ksp::module_info::NameTable::Element::~Element()
 {
-	if (_extern)
+	/* Attached elements share the data of their owner, which deletes it. */
+	if (!_extern)
 	{
 		switch (_kind)
 		{
-		case Kind::Type:
-			delete reinterpret_cast<TypeInfo*>(_data);
-			break;
 		case Kind::Constant:
 			delete reinterpret_cast<ConstantValue*>(_data);
 			break;
 		case Kind::Function:
+			delete reinterpret_cast<Function*>(_data);
 			break;
 		}
 	}
@@ -33,16 +42,18 @@ ksp::Type ksp::module_info::NameTable::Element::createTypeInfo(const TypeInfo& t
 	_reset();
 	_kind = Kind::Type;
 	_extern = false;
-	_data = new TypeInfo{ type };
-	return const_cast<const TypeInfo*>(reinterpret_cast<TypeInfo*>(_data));
+	_dirty = true;
+	_data = const_cast<TypeInfo*>(&TypeInfo::intern(type));
+	return reinterpret_cast<const TypeInfo*>(_data);
 }
 ksp::Type ksp::module_info::NameTable::Element::createTypeInfo(TypeInfo&& type)
 {
 	_reset();
 	_kind = Kind::Type;
 	_extern = false;
-	_data = new TypeInfo{ std::move(type) };
-	return const_cast<const TypeInfo*>(reinterpret_cast<TypeInfo*>(_data));
+	_dirty = true;
+	_data = const_cast<TypeInfo*>(&TypeInfo::intern(type));
+	return reinterpret_cast<const TypeInfo*>(_data);
 }
 
 const ksp::module_info::ConstantValue* ksp::module_info::NameTable::Element::createConstantValue(const Type& type)
@@ -50,87 +61,352 @@ const ksp::module_info::ConstantValue* ksp::module_info::NameTable::Element::cre
 	_reset();
 	_kind = Kind::Constant;
 	_extern = false;
+	_dirty = true;
 	_data = new ConstantValue{ type };
 	return const_cast<const ConstantValue*>(reinterpret_cast<ConstantValue*>(_data));
 }
 
+ksp::module_info::Function& ksp::module_info::NameTable::Element::createFunction()
+{
+	_reset();
+	_kind = Kind::Function;
+	_extern = false;
+	_dirty = true;
+	_data = new Function{};
+	return *reinterpret_cast<Function*>(_data);
+}
+
 void ksp::module_info::NameTable::Element::attachExternal(const Element& elem)
 {
 	_reset();
 	_owner = elem._owner;
 	_kind = elem._kind;
 	_extern = true;
+	_dirty = true;
 	_data = elem._data;
 }
 
 
 ksp::module_info::NameTable::NameTable() :
 	_elems{},
-	_refs{},
-	fastDataAccessor{ nullptr }
+	_pool{},
+	_poolSlots{},
+	_poolUsed{ 0 },
+	_functions{},
+	_changedFunctions{},
+	_laidOut{ false },
+	_slots{},
+	_displacements{},
+	fastDataAccessor{ nullptr },
+	fastFunctionAccessor{ nullptr }
 {}
 ksp::module_info::NameTable::~NameTable() {}
 
-ksp::module_info::NameTable::Element& ksp::module_info::NameTable::createNewElement(const std::string& name)
+ksp::module_info::NameTable::Element& ksp::module_info::NameTable::createNewElement(const Atom& name)
 {
 	auto it = _elems.try_emplace(name, Element{});
 	if(!it.second)
 		throw ElementAlreadyExists{ name };
+	_slots.clear();
+	_displacements.clear();
 	it.first->second._owner = this;
 	return it.first->second;
 }
 
 ksp::module_info::NameTable::Element& ksp::module_info::NameTable::getElement(const std::string& name)
 {
-	const auto& it = _elems.find(name);
-	if (it == _elems.end())
+	Element* e = _find(name);
+	if (!e)
 		throw ElementNotFound{ name };
-	return it->second;
+	return *e;
 }
 const ksp::module_info::NameTable::Element& ksp::module_info::NameTable::getElement(const std::string& name) const
 {
-	const auto& it = _elems.find(name);
-	if (it == _elems.end())
+	const Element* e = _find(name);
+	if (!e)
+		throw ElementNotFound{ name };
+	return *e;
+}
+ksp::module_info::NameTable::Element& ksp::module_info::NameTable::getElement(const Atom& name)
+{
+	Element* e = _find(name);
+	if (!e)
+		throw ElementNotFound{ name };
+	return *e;
+}
+const ksp::module_info::NameTable::Element& ksp::module_info::NameTable::getElement(const Atom& name) const
+{
+	const Element* e = _find(name);
+	if (!e)
 		throw ElementNotFound{ name };
-	return it->second;
+	return *e;
+}
+
+namespace
+{
+	/* Displacements with this bit set hold the slot of their single name directly. */
+	constexpr uint32_t direct_slot = 0x80000000U;
+
+	/* Tries per bucket before freeze gives up; far above what distinct hashes need. */
+	constexpr uint32_t max_displacement = 1U << 20;
+
+	/* splitmix64 finalizer, spreading the FNV-1a bits over the whole word. */
+	inline uint64_t mix(uint64_t x)
+	{
+		x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+		return x ^ (x >> 31);
+	}
+
+	inline size_t bucket_of(const uint64_t hash, const size_t buckets) { return static_cast<size_t>(mix(hash) % buckets); }
+	inline size_t slot_of(const uint64_t hash, const uint32_t displacement, const size_t slots)
+	{
+		return static_cast<size_t>(mix(hash ^ (displacement * 0x9e3779b97f4a7c15ULL)) % slots);
+	}
+}
+
+ksp::module_info::NameTable::Element* ksp::module_info::NameTable::_find(const std::string& name) const
+{
+	if (_slots.empty())
+	{
+		auto it = _elems.find(name);
+		return it == _elems.end() ? nullptr : const_cast<Element*>(&it->second);
+	}
+
+	const uint64_t hash = Atom::hash_of(name);
+	const Slot& slot = _slot(hash);
+	return slot.hash == hash && slot.name.str() == name ? slot.element : nullptr;
+}
+ksp::module_info::NameTable::Element* ksp::module_info::NameTable::_find(const Atom& name) const
+{
+	if (_slots.empty())
+	{
+		auto it = _elems.find(name);
+		return it == _elems.end() ? nullptr : const_cast<Element*>(&it->second);
+	}
+
+	const Slot& slot = _slot(name.hash());
+	return slot.name == name ? slot.element : nullptr;
+}
+
+const ksp::module_info::NameTable::Slot& ksp::module_info::NameTable::_slot(const uint64_t hash) const
+{
+	const uint32_t displacement = _displacements[bucket_of(hash, _displacements.size())];
+	return _slots[displacement & direct_slot ? displacement & ~direct_slot : slot_of(hash, displacement, _slots.size())];
+}
+
+void ksp::module_info::NameTable::freeze()
+{
+	/*
+	 * Hash and displace: names go into buckets of about four, then each bucket, largest
+	 * first, searches for the displacement that moves all of its names to free slots.
+	 * Single name buckets, left for last, take the remaining free slots directly.
+	 */
+	const size_t count = _elems.size();
+	_slots.assign(count, Slot{});
+	_displacements.assign(count / 4 + 1, 0);
+	if (count == 0)
+		return;
+
+	std::vector<std::vector<Slot>> buckets(_displacements.size());
+	for (auto& p : _elems)
+	{
+		const uint64_t hash = p.first.hash();
+		buckets[bucket_of(hash, buckets.size())].push_back({ hash, p.first, &p.second });
+	}
+
+	std::vector<size_t> order(buckets.size());
+	for (size_t i = 0; i < order.size(); ++i)
+		order[i] = i;
+	std::stable_sort(order.begin(), order.end(), [&buckets](const size_t b0, const size_t b1) { return buckets[b0].size() > buckets[b1].size(); });
+
+	std::vector<bool> used(count, false);
+	std::vector<size_t> taken;
+	size_t free_slot = 0;
+	for (const size_t b : order)
+	{
+		const std::vector<Slot>& bucket = buckets[b];
+		if (bucket.empty())
+			break;
+
+		if (bucket.size() == 1)
+		{
+			while (used[free_slot])
+				++free_slot;
+			used[free_slot] = true;
+			_slots[free_slot] = bucket[0];
+			_displacements[b] = static_cast<uint32_t>(free_slot) | direct_slot;
+			continue;
+		}
+
+		for (uint32_t displacement = 0; ; ++displacement)
+		{
+			/* Only names with colliding hashes get here; they stay on the map. */
+			if (displacement == max_displacement)
+			{
+				_slots.clear();
+				_displacements.clear();
+				return;
+			}
+
+			taken.clear();
+			for (const Slot& name : bucket)
+			{
+				const size_t slot = slot_of(name.hash, displacement, count);
+				if (used[slot])
+					break;
+				used[slot] = true;
+				taken.push_back(slot);
+			}
+			if (taken.size() == bucket.size())
+			{
+				for (size_t i = 0; i < taken.size(); ++i)
+					_slots[taken[i]] = bucket[i];
+				_displacements[b] = displacement;
+				break;
+			}
+			for (const size_t slot : taken)
+				used[slot] = false;
+		}
+	}
 }
 
 void ksp::module_info::NameTable::buildReferences()
 {
-	_refs.~vector();
-	INVOKE_CONSTRUCTOR(_refs, std::vector<data_ptr_t>);
-	_refs.reserve(_elems.size());
+	/* A function number left behind by an element that is no function any more would dangle. */
+	bool full = !_laidOut;
+	for (const auto& p : _elems)
+		if (p.second._dirty && p.second._laidOut == Kind::Function && p.second._kind != Kind::Function)
+			full = true;
+
+	std::vector<uint64_t> pool;
+	if (full)
+	{
+		_functions.clear();
+		_poolSlots.clear();
+		_poolUsed = 0;
+	}
+	else pool.swap(_pool);
+	_changedFunctions.assign(_functions.size(), false);
 
-	size_t offCount = 0;
+	std::vector<Element*> constants;
 	for (auto& p : _elems)
 	{
 		auto& e = p.second;
+		if (!full && !e._dirty)
+			continue;
+
 		switch (e._kind)
 		{
 			case Kind::Constant:
-				e._offset = offCount++;
-				_refs.push_back(reinterpret_cast<ConstantValue*>(e._data)->_data);
+				constants.push_back(&e);
 				break;
+
+			case Kind::Function:
+				if (full || e._laidOut != Kind::Function)
+				{
+					e._offset = _functions.size();
+					_functions.push_back(nullptr);
+					_changedFunctions.push_back(false);
+				}
+				_functions[e._offset] = e.getFunction();
+				_changedFunctions[e._offset] = true;
+				break;
+		}
+		e._laidOut = e._kind;
+		e._dirty = false;
+	}
+
+	/* Largest first, so that power of two sizes need no padding between them. */
+	std::stable_sort(constants.begin(), constants.end(), [](const Element* e0, const Element* e1) {
+		return e0->getConstantValue()->type().size() > e1->getConstantValue()->type().size();
+	});
+
+	/*
+	 * Constants are copied into the new pool as they are placed, before the old pool is
+	 * released: rebuilt constants already live in it. Slots are found by FNV-1a hash of
+	 * their bytes, to merge constants.
+	 */
+	const data_ptr_t old_base = reinterpret_cast<data_ptr_t>(full ? _pool.data() : pool.data());
+	for (Element* e : constants)
+	{
+		const ConstantValue& value = *e->getConstantValue();
+		const size_t bytes = value.type().size();
+
+		uint64_t hash = 0xcbf29ce484222325ULL;
+		for (size_t i = 0; i < bytes; ++i)
+			hash = (hash ^ static_cast<uint8_t>(value._data[i])) * 0x100000001b3ULL;
+
+		const PoolSlot* same = nullptr;
+		const auto range = _poolSlots.equal_range(hash);
+		for (auto it = range.first; it != range.second && !same; ++it)
+		{
+			const PoolSlot& slot = it->second;
+			if (value.type() == *slot.type && std::memcmp(reinterpret_cast<data_ptr_t>(pool.data()) + slot.offset, value._data, bytes) == 0)
+				same = &slot;
 		}
+		if (same)
+		{
+			e->_offset = same->offset;
+			continue;
+		}
+
+		size_t align = 1;
+		while (align < sizeof(uint64_t) && bytes % (align * 2) == 0)
+			align *= 2;
+		e->_offset = (_poolUsed + align - 1) & ~(align - 1);
+		_poolUsed = e->_offset + bytes;
+		pool.resize((_poolUsed + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+		std::memcpy(reinterpret_cast<data_ptr_t>(pool.data()) + e->_offset, value._data, bytes);
+		_poolSlots.emplace(hash, PoolSlot{ &value.type(), e->_offset });
 	}
 
-	fastDataAccessor = offCount > 0 ? &_refs[0] : nullptr;
+	/* Point the placed constants at their slots, and every other one too if the pool moved. */
+	const data_ptr_t base = reinterpret_cast<data_ptr_t>(pool.data());
+	auto repoint = [base](Element& e) {
+		/* Attached constants belong to another table, which may be reading them. */
+		if (e._extern)
+			return;
+		ConstantValue& value = *reinterpret_cast<ConstantValue*>(e._data);
+		if (!value._pooled)
+			delete[] value._data;
+		value._data = base + e._offset;
+		value._pooled = true;
+	};
+	if (full || base != old_base)
+	{
+		for (auto& p : _elems)
+			if (p.second._kind == Kind::Constant)
+				repoint(p.second);
+	}
+	else for (Element* e : constants)
+		repoint(*e);
+	_pool.swap(pool);
+	_laidOut = true;
+
+	fastDataAccessor = _poolUsed == 0 ? nullptr : base;
+	fastFunctionAccessor = _functions.empty() ? nullptr : &_functions[0];
+
+	if (!frozen())
+		freeze();
 }
 
 
 
 ksp::module_info::ConstantValue::ConstantValue(const Type& type) :
-	_type{ type },
-	_data{ new char[type.size()] }
+	_type{ &TypeInfo::intern(type) },
+	_data{ new char[type.size()] },
+	_pooled{ false }
 {}
 ksp::module_info::ConstantValue::~ConstantValue()
 {
-	delete[] _data;
+	if (!_pooled)
+		delete[] _data;
 }
 
 
 
-ksp::module_info::Function::VariableInfo::VariableInfo(const Type& type, const std::string& name, const bool is_parameter) :
+ksp::module_info::Function::VariableInfo::VariableInfo(const Type& type, const Atom& name, const bool is_parameter) :
 	_type{ type },
 	_name{ name },
 	_param{ is_parameter }
@@ -143,54 +419,328 @@ ksp::module_info::Function::Function() :
 	_returnType{},
 	_vars{},
 	_code{},
+	_instructions{},
+	_fusion{},
+	_heapOffsets{},
+	_arrayOperands{},
+	_callees{},
+	_dirty{ true },
+	_lazyModule{ nullptr },
 	fastRegisterCount{ 0 },
 	fastParameterCount{ 0 },
 	fastExtraStackSize{ 0 },
-	fastCodeAccessor{ nullptr }
+	fastCodeAccessor{ nullptr },
+	fastInstructionAccessor{ nullptr },
+	fastArrayOperandAccessor{ nullptr },
+	fastAotCode{ nullptr },
+	fastInvocationCount{ 0 },
+	fastNativeCode{ nullptr },
+	fastMaterialized{ false }
 {}
-ksp::module_info::Function::~Function() {}
+ksp::module_info::Function::~Function()
+{
+	jit::release(fastNativeCode.load());
+}
 
 void ksp::module_info::Function::setReturnType(const Type& type)
 {
-	_returnType = type;
+	_returnType = &type ? &TypeInfo::intern(type) : nullptr;
+	_dirty = true;
 }
 
-void ksp::module_info::Function::_insertVar(const Type& type, const std::string& name, bool is_param)
+void ksp::module_info::Function::_insertVar(const Type& type, const Atom& name, bool is_param)
 {
 	auto it = std::find_if(_vars.begin(), _vars.end(), [&name](const VariableInfo& p) { return p._name == name; });
 	if (it != _vars.end())
 		throw ParameterOrVariableAlreadyExists{ name };
 
+	const Type canonical = &type ? &TypeInfo::intern(type) : nullptr;
 	if (is_param && !_vars.empty())
 	{
 		it = std::find_if(_vars.begin(), _vars.end(), [](const VariableInfo& p) { return !p.isParameter(); });
 		if (it == _vars.end())
-			_vars.emplace_back(type, name, true);
-		else _vars.emplace(it, type, name, true);
+			_vars.emplace_back(canonical, name, true);
+		else _vars.emplace(it, canonical, name, true);
 	}
-	else _vars.emplace_back(type, name, is_param);
+	else _vars.emplace_back(canonical, name, is_param);
+
+	if (is_param)
+		++_paramCount;
+	_dirty = true;
 }
 
 void ksp::module_info::Function::addOpcode(const opcode_t op)
 {
 	_code.push_back(op);
+	_dirty = true;
 }
 void ksp::module_info::Function::addOpcodes(const std::vector<opcode_t>& ops)
 {
 	_code.reserve(_code.size() + ops.size());
 	_code.insert(_code.end(), ops.begin(), ops.end());
+	_dirty = true;
 }
 
 void ksp::module_info::Function::build()
+{
+	_build();
+	fastMaterialized.store(true, std::memory_order_release);
+}
+
+void ksp::module_info::Function::_build()
 {
 	fastRegisterCount = static_cast<uint8_t>(_vars.size());
 	fastParameterCount = _paramCount;
 	fastCodeAccessor = _code.empty() ? nullptr : &_code[0];
 
+	/* Extra storage is laid out in the frame heap in declaration order, each at its natural alignment. */
 	size_t extra = 0;
+	_heapOffsets.clear();
 	for (const auto& v : _vars)
-		extra += v._type.getExtraSizeRequired();
+	{
+		const size_t size = v._type.getExtraSizeRequired();
+		if (size > 0)
+		{
+			const size_t align = v._type.alignment();
+			extra = (extra + align - 1) / align * align;
+		}
+		_heapOffsets.push_back(extra);
+		extra += size;
+	}
 	fastExtraStackSize = extra;
+
+	_instructions = bytecode::decode(fastCodeAccessor, _code.size());
+	_fusion = bytecode::fuse(_instructions);
+	_resolveArrayOperands();
+	_resolveFields();
+	fastInstructionAccessor = &_instructions[0];
+	fastArrayOperandAccessor = _arrayOperands.data();
+
+	_callees.clear();
+	for (const bytecode::Instruction& in : _instructions)
+		if ((in.op == opcode::CALL || in.op == opcode::TAILCALL) && std::find(_callees.begin(), _callees.end(), in.k) == _callees.end())
+			_callees.push_back(static_cast<size_t>(in.k));
+	_dirty = false;
+
+	fastAotCode = nullptr;
+	jit::release(fastNativeCode.exchange(nullptr));
+	fastInvocationCount = 0;
+}
+
+/* The code built before, and whatever was compiled from it, no longer matches. */
+void ksp::module_info::Function::_stub(const Module& module)
+{
+	_lazyModule = &module;
+	fastMaterialized.store(false, std::memory_order_relaxed);
+	fastAotCode = nullptr;
+	jit::release(fastNativeCode.exchange(nullptr));
+}
+
+namespace
+{
+	/* Shared by every module: a function only takes it until its first call returns from materialize. */
+	std::mutex& materialize_mutex()
+	{
+		static std::mutex mutex;
+		return mutex;
+	}
+}
+
+void ksp::module_info::Function::_materialize() const
+{
+	std::lock_guard<std::mutex> lock{ materialize_mutex() };
+	if (fastMaterialized.load(std::memory_order_relaxed))
+		return;
+	if (!_lazyModule)
+		throw bytecode::InvalidBytecode{ "function was never built" };
+
+	Function& self = const_cast<Function&>(*this);
+	self._build();
+	self._checkCalls(*_lazyModule);
+	++_lazyModule->_materialized;
+	fastMaterialized.store(true, std::memory_order_release);
+}
+
+void ksp::module_info::Function::_checkCalls(const Module& module)
+{
+	using bytecode::InvalidBytecode;
+
+	const size_t count = module.content.functionCount();
+	for (const bytecode::Instruction& in : _instructions)
+	{
+		if (in.op != opcode::CALL && in.op != opcode::TAILCALL)
+			continue;
+
+		/* A rejected caller stays dirty, so that the next build checks it again. */
+		const std::string& name = opcode::info::find(in.op)->name();
+		if (in.k >= count)
+		{
+			_dirty = true;
+			throw InvalidBytecode{ name + " to unknown function " + std::to_string(in.k) };
+		}
+
+		const Function& callee = *module.fastFunctionAccessor[in.k];
+		if (in.a + callee.parameterCount() > fastRegisterCount)
+		{
+			_dirty = true;
+			throw InvalidBytecode{ name + " arguments from r" + std::to_string(in.a) + " exceed the caller registers" };
+		}
+	}
+}
+
+/* Calls were checked when they were built, or mapped from a ModuleImage: the function table of 'module' may be all there is. */
+bool ksp::module_info::Function::reachesYield(const Module& module) const
+{
+	std::vector<bool> seen;
+	std::vector<const Function*> pending{ this };
+	while (!pending.empty())
+	{
+		const Function* const f = pending.back();
+		pending.pop_back();
+		if (!f || !f->fastMaterialized.load(std::memory_order_acquire) || !f->fastInstructionAccessor)
+			return true;
+
+		for (const bytecode::Instruction* pc = f->fastInstructionAccessor; ; ++pc)
+		{
+			if (pc->op == opcode::YIELD)
+				return true;
+			if ((pc->op == opcode::CALL || pc->op == opcode::TAILCALL) && (pc->k >= seen.size() || !seen[pc->k]))
+			{
+				if (pc->k >= seen.size())
+					seen.resize(static_cast<size_t>(pc->k) + 1, false);
+				seen[pc->k] = true;
+				pending.push_back(module.fastFunctionAccessor[pc->k]);
+			}
+			if (pc->op == opcode::HALT || pc->op == opcode::RET || pc->op == opcode::TAILCALL)
+				break;
+		}
+	}
+	return false;
+}
+
+void ksp::module_info::Function::_resolveArrayOperands()
+{
+	using bytecode::InvalidBytecode;
+
+	auto is_bulk = [](const opcode_t op) { return op >= opcode::ACOPY && op <= opcode::AMAX; };
+
+	_arrayOperands.clear();
+
+	for (bytecode::Instruction& in : _instructions)
+	{
+		if (!is_bulk(in.op))
+			continue;
+
+		const std::string& name = opcode::info::find(in.op)->name();
+		auto array = [this, &name](const uint8_t reg) -> const TypeInfo& {
+			if (reg >= _vars.size() || !_vars[reg]._type.isArray())
+				throw InvalidBytecode{ name + " operand r" + std::to_string(reg) + " is not an array variable" };
+			const TypeInfo& type = _vars[reg]._type;
+			if (arrays::element_size(type.componentType()->kind()) == 0)
+				throw InvalidBytecode{ name + " operand r" + std::to_string(reg) + " has no supported element type" };
+			return type;
+		};
+		auto same = [&name](const TypeInfo& t0, const TypeInfo& t1) {
+			if (t0 != t1)
+				throw InvalidBytecode{ name + " operands must be arrays of the same type" };
+		};
+		auto scalar = [this, &name](const uint8_t reg, const size_t width) {
+			if (reg + (width > sizeof(reg_t) ? 1U : 0U) >= _vars.size())
+				throw InvalidBytecode{ name + " register r" + std::to_string(reg) + " out of range" };
+		};
+
+		const TypeInfo* type;
+		bytecode::ArrayOperands operands{};
+		switch (in.op)
+		{
+			case opcode::ACOPY:
+				/* Structs of one type are copied whole, as arrays of bytes. */
+				if (in.a < _vars.size() && _vars[in.a]._type.isStruct())
+				{
+					if (in.b >= _vars.size() || _vars[in.a]._type != _vars[in.b]._type)
+						throw InvalidBytecode{ name + " operands must be structs of the same type" };
+					operands.dst = static_cast<uint32_t>(_heapOffsets[in.a]);
+					operands.src0 = static_cast<uint32_t>(_heapOffsets[in.b]);
+					operands.count = static_cast<uint32_t>(_vars[in.a]._type.size());
+					operands.kind = TypeKind::UByte;
+					type = nullptr;
+					break;
+				}
+				type = &array(in.a);
+				same(*type, array(in.b));
+				operands.dst = static_cast<uint32_t>(_heapOffsets[in.a]);
+				operands.src0 = static_cast<uint32_t>(_heapOffsets[in.b]);
+				break;
+
+			case opcode::AFILL:
+				type = &array(in.a);
+				scalar(in.b, type->componentType()->size());
+				operands.dst = static_cast<uint32_t>(_heapOffsets[in.a]);
+				operands.src0 = in.b;
+				break;
+
+			case opcode::ACMP:
+				scalar(in.a, sizeof(reg_t));
+				type = &array(in.b);
+				same(*type, array(in.c));
+				operands.dst = in.a;
+				operands.src0 = static_cast<uint32_t>(_heapOffsets[in.b]);
+				operands.src1 = static_cast<uint32_t>(_heapOffsets[in.c]);
+				break;
+
+			default:
+				type = &array(in.a);
+				same(*type, array(in.b));
+				same(*type, array(in.c));
+				if (!arrays::arithmetic(type->componentType()->kind()))
+					throw InvalidBytecode{ name + " needs arrays of a numeric type" };
+				operands.dst = static_cast<uint32_t>(_heapOffsets[in.a]);
+				operands.src0 = static_cast<uint32_t>(_heapOffsets[in.b]);
+				operands.src1 = static_cast<uint32_t>(_heapOffsets[in.c]);
+				break;
+		}
+		if (type)
+		{
+			operands.count = static_cast<uint32_t>(type->elementCount());
+			operands.kind = type->componentType()->kind();
+		}
+
+		in.k = _arrayOperands.size();
+		_arrayOperands.push_back(operands);
+	}
+}
+
+void ksp::module_info::Function::_resolveFields()
+{
+	using bytecode::InvalidBytecode;
+
+	for (bytecode::Instruction& in : _instructions)
+	{
+		if (in.op != opcode::LDF && in.op != opcode::STF)
+			continue;
+
+		const std::string& name = opcode::info::find(in.op)->name();
+		const uint8_t object = in.op == opcode::LDF ? in.b : in.a;
+		const uint8_t value = in.op == opcode::LDF ? in.a : in.b;
+
+		if (object >= _vars.size() || !_vars[object]._type.isStruct())
+			throw InvalidBytecode{ name + " operand r" + std::to_string(object) + " is not a struct variable" };
+		const std::vector<TypeInfo::StructField>& fields = _vars[object]._type.fields();
+		if (in.k >= fields.size())
+			throw InvalidBytecode{ name + " to unknown field " + std::to_string(in.k) + " of r" + std::to_string(object) };
+
+		const TypeInfo& field = *fields[in.k].type;
+		const size_t width = field.size();
+		const bool scalar = field.kind() != TypeKind::Array && field.kind() != TypeKind::Struct && field.kind() != TypeKind::Function;
+		if (!scalar || (width != 1 && width != 2 && width != 4 && width != 8))
+			throw InvalidBytecode{ name + " field " + fields[in.k].name.str() + " is not a scalar" };
+		if (value + (width > sizeof(reg_t) ? 1U : 0U) >= _vars.size())
+			throw InvalidBytecode{ name + " register r" + std::to_string(value) + " out of range" };
+
+		/* k becomes the heap offset of the field and c its width, so the handlers only load or store. */
+		in.k = _heapOffsets[object] + fields[in.k].offset;
+		in.c = static_cast<uint8_t>(width);
+	}
 }
 
 
@@ -205,15 +755,184 @@ void ksp::module_info::Function::build()
 ksp::Module::Module() :
 	content{},
 	fastFunctionAccessor{ nullptr },
-	fastConstantAccessor{ nullptr }
+	fastConstantAccessor{ nullptr },
+	_materialized{ 0 }
 {}
 ksp::Module::~Module() {}
 
-void ksp::Module::build()
+void ksp::Module::build(const bool lazy)
 {
 	content.buildReferences();
+	fastFunctionAccessor = content.fastFunctionAccessor;
+	fastConstantAccessor = content.fastDataAccessor;
+
+	/*
+	 * Attached functions are built, and their calls checked, by the module that owns them.
+	 * A call needs checking again when its caller or its callee changed.
+	 */
+	const size_t count = content.functionCount();
+	std::vector<bool> changed(count, false);
+	std::vector<std::pair<size_t, module_info::Function*>> owned;
+	for (const auto& p : content.elements())
+	{
+		if (p.second.kind() != module_info::NameTable::Kind::Function)
+			continue;
+		const size_t index = p.second.offset();
+		module_info::Function* f = p.second.getFunction();
+		changed[index] = content.functionChanged(index);
+		if (p.second.isExtern())
+			continue;
+		if (f->dirty())
+		{
+			if (lazy)
+				f->_stub(*this);
+			else
+			{
+				f->build();
+				++_materialized;
+			}
+			changed[index] = true;
+		}
+		owned.emplace_back(index, f);
+	}
+
+	/* Stubs check their calls when they materialize. */
+	for (const auto& o : owned)
+	{
+		module_info::Function& caller = *o.second;
+		if (!caller.fastMaterialized.load(std::memory_order_relaxed))
+			continue;
+		if (!changed[o.first] && std::none_of(caller.callees().begin(), caller.callees().end(),
+			[&changed, count](const size_t callee) { return callee >= count || changed[callee]; }))
+			continue;
+		caller._checkCalls(*this);
+	}
+
+	/*
+	 * Whether the JIT compiles a function depends on its callees (see jit::code_for): after a change,
+	 * compiled code that can now reach a YIELD goes back to the interpreter, and functions the JIT
+	 * refused are counted again, so that both are decided again at the threshold.
+	 */
+	if (std::none_of(changed.begin(), changed.end(), [](const bool c) { return c; }))
+		return;
+	for (const auto& o : owned)
+	{
+		module_info::Function& f = *o.second;
+		if (f.fastNativeCode.load(std::memory_order_relaxed) ? f.reachesYield(*this) : f.fastInvocationCount.load(std::memory_order_relaxed) >= __KSP_JIT_THRESHOLD)
+		{
+			jit::release(f.fastNativeCode.exchange(nullptr));
+			f.fastInvocationCount = 0;
+		}
+	}
+}
+
+
+
+
+std::vector<ksp::bytecode::Instruction> ksp::bytecode::decode(const opcode_t* code, const size_t size)
+{
+	const void* const* handlers = ksp::dispatch_table();
+
+	std::vector<Instruction> ins;
+	ins.reserve(size / 2 + 1);
+
+	size_t idx = 0;
+	while (idx < size)
+	{
+		const size_t start = idx;
+		const OpcodeInfo* info = opcode::info::find(code[idx++]);
+		if (!info)
+			throw InvalidBytecode{ "unknown opcode " + std::to_string(code[start]) + " at " + std::to_string(start) };
+
+		Instruction in{};
+		in.op = info->code();
+		in.handler = handlers ? handlers[in.op] : nullptr;
+
+		uint8_t* const regs[] = { &in.a, &in.b, &in.c };
+		size_t reg_count = 0;
+
+		const size_t len = info->args_count();
+		for (size_t i = 0; i < len; ++i)
+		{
+			const auto& arg = info->arg(i);
+			if (idx + arg.size > size)
+				throw InvalidBytecode{ "truncated " + info->name() + " at " + std::to_string(start) };
+
+			uint64_t value = 0;
+			for (size_t j = 0; j < arg.size; ++j)
+				value |= static_cast<uint64_t>(code[idx++]) << (j * 8);
+
+			if (arg.isRegister())
+				*regs[reg_count++] = static_cast<uint8_t>(value);
+			else in.k = value;
+		}
+
+		ins.push_back(in);
+	}
+
+	Instruction halt{};
+	halt.op = opcode::HALT;
+	halt.handler = handlers ? handlers[halt.op] : nullptr;
+	ins.push_back(halt);
+
+	return ins;
+}
+
+
+namespace
+{
+	struct FusionRule
+	{
+		ksp::opcode_t first;
+		ksp::opcode_t second;
+		ksp::opcode_t fused;
+	};
+
+	/* PUTx r, k; MOVx r, d  =>  PUTMOVx r, d, k */
+	const FusionRule __fusion_rules[] = {
+		{ ksp::opcode::PUTB, ksp::opcode::MOVB, ksp::opcode::PUTMOVB },
+		{ ksp::opcode::PUTW, ksp::opcode::MOVW, ksp::opcode::PUTMOVW },
+		{ ksp::opcode::PUTL, ksp::opcode::MOVL, ksp::opcode::PUTMOVL },
+		{ ksp::opcode::PUTQ, ksp::opcode::MOVQ, ksp::opcode::PUTMOVQ },
+	};
+
+	const FusionRule* find_fusion_rule(const ksp::bytecode::Instruction& first, const ksp::bytecode::Instruction& second)
+	{
+		for (const auto& rule : __fusion_rules)
+			if (rule.first == first.op && rule.second == second.op && first.a == second.a)
+				return &rule;
+		return nullptr;
+	}
 }
 
+ksp::bytecode::FusionReport ksp::bytecode::fuse(std::vector<Instruction>& instructions)
+{
+	const void* const* handlers = ksp::dispatch_table();
+
+	FusionReport report{};
+	report.instructionsBefore = instructions.size();
+
+	size_t out = 0;
+	for (size_t i = 0, len = instructions.size(); i < len; ++i, ++out)
+	{
+		const FusionRule* rule = i + 1 < len ? find_fusion_rule(instructions[i], instructions[i + 1]) : nullptr;
+		if (rule)
+		{
+			Instruction in = instructions[i];
+			in.op = rule->fused;
+			in.handler = handlers ? handlers[in.op] : nullptr;
+			in.b = instructions[i + 1].b;
+			instructions[out] = in;
+			report.fused[rule->fused]++;
+			++i;
+		}
+		else instructions[out] = instructions[i];
+	}
+	instructions.resize(out);
+
+	report.instructionsAfter = out;
+	return report;
+}
 
 
 
@@ -228,6 +947,35 @@ void ksp::bytecode::BytecodeBuilder::push_opcode(const ksp::OpcodeInfo& op, cons
 	const int len = op.args_count();
 	const int bytes_len = bytes.size();
 	auto bytes_ptr = bytes.data();
+	int idx = 0;
+	for (int i = 0; i < len; ++i)
+		for (int j = op.arg(i).size; j > 0; --j, ++idx)
+			_codes.push_back(idx < bytes_len ? bytes_ptr[idx] : 0);
+}
+
+void ksp::bytecode::BytecodeBuilder::push_instruction(const ksp::OpcodeInfo& op, const std::vector<uint64_t>& args)
+{
+	_codes.push_back(op.code());
+	const int len = op.args_count();
+	const int args_len = args.size();
 	for (int i = 0; i < len; ++i)
-		_codes.push_back(i < bytes_len ? *(bytes_ptr++) : 0);
+	{
+		uint64_t value = i < args_len ? args[i] : 0;
+		for (int j = op.arg(i).size; j > 0; --j, value >>= 8)
+			_codes.push_back(static_cast<opcode_t>(value & 0xffU));
+	}
+}
+
+
+
+std::ostream& operator<< (std::ostream& os, const ksp::bytecode::FusionReport& report)
+{
+	os << "fusion: " << report.instructionsBefore << " -> " << report.instructionsAfter
+		<< " instructions, " << report.dispatchesRemoved() << " dispatches removed";
+	for (const auto& p : report.fused)
+	{
+		const ksp::OpcodeInfo* info = ksp::opcode::info::find(p.first);
+		os << std::endl << "  " << (info ? info->name() : std::to_string(p.first)) << ": " << p.second;
+	}
+	return os;
 }
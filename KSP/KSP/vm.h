@@ -1,18 +1,91 @@
 #pragma once
 
+#include <atomic>
 #include <exception>
 #include <vector>
 #include <map>
+#include <unordered_map>
 
 #include "support.h"
+#include "atom.h"
 #include "ops.h"
 #include "types.h"
+#include "trace.h"
+#include "profile.h"
+#include "jit.h"
+#include "aot.h"
 
 namespace ksp
 {
+	namespace bytecode
+	{
+		/*
+		 * Fixed-width form of one instruction, produced once from the byte encoding.
+		 * Register operands are stored in declaration order in a, b and c; the
+		 * (single) immediate operand is stored zero-extended in k.
+		 */
+		struct alignas(8) Instruction
+		{
+			const void* handler;
+			opcode_t    op;
+			uint8_t     a;
+			uint8_t     b;
+			uint8_t     c;
+			uint32_t    _pad;
+			uint64_t    k;
+		};
+
+		class InvalidBytecode : exception
+		{
+		public:
+			inline InvalidBytecode(const std::string& msg) :
+				exception{ ("Invalid bytecode: " + msg).c_str() }
+			{}
+			inline InvalidBytecode(const char* msg) :
+				InvalidBytecode{ std::string{ msg } }
+			{}
+		};
+
+		/*
+		 * Frame heap operands of a bulk array instruction (ACOPY ... AMAX), resolved from
+		 * the array variables it names by Function::build. Instruction::k holds its index
+		 * in the operand table of the function, so decoded code can be moved or mapped from
+		 * a ModuleImage as is. Offsets are in bytes from the frame heap. For ACMP 'dst' is
+		 * the result register and for AFILL 'src0' is the value register.
+		 */
+		struct ArrayOperands
+		{
+			uint32_t dst;
+			uint32_t src0;
+			uint32_t src1;
+			uint32_t count;
+			TypeKind kind;
+		};
+
+		/* Decodes a byte encoded stream. A trailing HALT is appended so execution never runs past the end. */
+		std::vector<Instruction> decode(const opcode_t* code, const size_t size);
+
+
+		struct FusionReport
+		{
+			size_t instructionsBefore;
+			size_t instructionsAfter;
+			std::map<opcode_t, size_t> fused;
+
+			inline size_t dispatchesRemoved() const { return instructionsBefore - instructionsAfter; }
+		};
+
+		/*
+		 * Replaces known instruction pairs with a single superinstruction, in place.
+		 * Must run before any code holds an index into 'instructions'.
+		 */
+		FusionReport fuse(std::vector<Instruction>& instructions);
+	}
+
 	namespace module_info
 	{
 		class ConstantValue;
+		class Function;
 
 		class NameTable
 		{
@@ -25,7 +98,7 @@ namespace ksp
 				Function
 			};
 
-			class ElementAlreadyExists : std::exception
+			class ElementAlreadyExists : exception
 			{
 			public:
 				inline ElementAlreadyExists(const std::string& name) :
@@ -36,7 +109,7 @@ namespace ksp
 				{}
 			};
 
-			class ElementNotFound : std::exception
+			class ElementNotFound : exception
 			{
 			public:
 				inline ElementNotFound(const std::string& name) :
@@ -56,6 +129,11 @@ namespace ksp
 				bool _extern;
 				void* _data;
 
+				/* Set by the create functions and attachExternal; cleared by buildReferences. */
+				bool _dirty;
+				/* The kind _offset was assigned for. */
+				Kind _laidOut;
+
 			public:
 				Element();
 				~Element();
@@ -64,14 +142,22 @@ namespace ksp
 				inline Kind kind() const { return _kind; }
 				inline bool isExtern() const { return _extern; }
 
+				/* Defined or attached since the last buildReferences. */
+				inline bool dirty() const { return _dirty; }
+
+				/* Byte offset of a constant from fastDataAccessor, or index of a function in fastFunctionAccessor. Valid after buildReferences(). */
+				inline size_t offset() const { return _offset; }
+
 				inline Type getTypeMeta() const { return reinterpret_cast<TypeInfo*>(_data); }
+				inline Function* getFunction() const { return reinterpret_cast<Function*>(_data); }
+				inline const ConstantValue* getConstantValue() const { return reinterpret_cast<const ConstantValue*>(_data); }
 
 				Type createTypeInfo(const TypeInfo& type);
 				Type createTypeInfo(TypeInfo&& type);
 
 				const ConstantValue* createConstantValue(const Type& type);
 
-				//Function& createFunction()
+				Function& createFunction();
 
 				void attachExternal(const Element& elem);
 
@@ -82,31 +168,101 @@ namespace ksp
 			};
 
 		private:
-			std::map<std::string, Element> _elems;
-			std::vector<data_ptr_t> _refs;
+			/* One name of the frozen table, in its perfect hash slot. */
+			struct Slot
+			{
+				uint64_t hash;
+				Atom name;
+				Element* element;
+			};
+
+			/* A slot of the constant pool, found again by the hash of its bytes. */
+			struct PoolSlot
+			{
+				const TypeInfo* type;
+				size_t offset;
+			};
+
+			std::map<Atom, Element, Atom::NameLess> _elems;
+			std::vector<uint64_t> _pool;
+			std::unordered_multimap<uint64_t, PoolSlot> _poolSlots;
+			size_t _poolUsed;
+			std::vector<Function*> _functions;
+			std::vector<bool> _changedFunctions;
+			bool _laidOut;
+
+			std::vector<Slot> _slots;
+			std::vector<uint32_t> _displacements;
 
 		public:
 			NameTable();
 			~NameTable();
 
-			Element& createNewElement(const std::string& name);
+			/* The new element is an import until defined with one of its create functions (see Linker). */
+			Element& createNewElement(const Atom& name);
 
 			Element& getElement(const std::string& name);
 			const Element& getElement(const std::string& name) const;
-
+			Element& getElement(const Atom& name);
+			const Element& getElement(const Atom& name) const;
+			inline Element& getElement(const char* name) { return getElement(std::string{ name }); }
+			inline const Element& getElement(const char* name) const { return getElement(std::string{ name }); }
+
+			/*
+			 * Numbers the functions and packs every constant into one pool, largest types
+			 * first and each naturally aligned (up to 8 bytes). Constants of equal type and
+			 * bytes share one slot, so their values must not be written past this point:
+			 * define the element again to change one.
+			 *
+			 * Once laid out, later calls only place the dirty elements. Unchanged constants
+			 * and functions keep their offsets; new and redefined constants take new slots
+			 * at the end of the pool, and new functions the next numbers. The slots of
+			 * replaced constants are not reused. Only an element that had a function number
+			 * and is now something else makes the whole table be laid out again.
+			 */
 			void buildReferences();
 
-			inline bool hasName(const std::string& name) const { return _elems.find(name) != _elems.end(); }
+			/* In name order. */
+			inline const std::map<Atom, Element, Atom::NameLess>& elements() const { return _elems; }
+
+			inline bool hasName(const std::string& name) const { return _find(name) != nullptr; }
+			inline bool hasName(const Atom& name) const { return _find(name) != nullptr; }
+			inline bool hasName(const char* name) const { return _find(std::string{ name }) != nullptr; }
+
+			inline size_t functionCount() const { return _functions.size(); }
+
+			/* True if the last buildReferences gave function 'index' its number or a new Function. */
+			inline bool functionChanged(const size_t index) const { return _changedFunctions[index]; }
+
+			/* Bytes used by the constant pool, padding included. */
+			inline size_t poolSize() const { return _pool.size() * sizeof(uint64_t); }
+
+			/*
+			 * Indexes the names with a minimal perfect hash, which getElement and hasName use
+			 * instead of the map until a new element is created. Called by buildReferences.
+			 */
+			void freeze();
+
+			inline bool frozen() const { return !_displacements.empty(); }
+
+		private:
+			Element* _find(const std::string& name) const;
+			Element* _find(const Atom& name) const;
+			const Slot& _slot(const uint64_t hash) const;
 
 		public:
-			data_ptr_t* fastDataAccessor;
+			/* Base of the constant pool; a constant lies at its offset() from here. */
+			data_ptr_t fastDataAccessor;
+			Function* const* fastFunctionAccessor;
 		};
 
+		/* Holds its own bytes until NameTable::buildReferences moves them into the pool. */
 		class ConstantValue
 		{
 		private:
-			const Type		 _type;
-			data_ptr_t const _data;
+			const Type _type;
+			data_ptr_t _data;
+			bool	   _pooled;
 
 		public:
 			ConstantValue(const Type& type);
@@ -126,23 +282,24 @@ namespace ksp
 			class VariableInfo
 			{
 			private:
-				Type		_type;
-				std::string _name;
-				bool		_param;
+				Type _type;
+				Atom _name;
+				bool _param;
 
 			public:
 				VariableInfo() = default;
-				VariableInfo(const Type& type, const std::string& name, const bool is_parameter);
+				VariableInfo(const Type& type, const Atom& name, const bool is_parameter);
 				~VariableInfo();
 
 				inline Type type() const { return _type; }
-				inline const std::string& name() const { return _name; }
+				inline const std::string& name() const { return _name.str(); }
+				inline Atom atom() const { return _name; }
 				inline bool isParameter() const { return _param; }
 
 				friend class Function;
 			};
 
-			class ParameterOrVariableAlreadyExists : std::exception
+			class ParameterOrVariableAlreadyExists : exception
 			{
 			public:
 				inline ParameterOrVariableAlreadyExists(const std::string& name) :
@@ -158,6 +315,13 @@ namespace ksp
 			Type _returnType;
 			std::vector<VariableInfo> _vars;
 			std::vector<opcode_t> _code;
+			std::vector<bytecode::Instruction> _instructions;
+			bytecode::FusionReport _fusion;
+			std::vector<size_t> _heapOffsets;
+			std::vector<bytecode::ArrayOperands> _arrayOperands;
+			std::vector<size_t> _callees;
+			bool _dirty;
+			const Module* _lazyModule;
 
 		public:
 			Function();
@@ -171,10 +335,10 @@ namespace ksp
 			void build();
 
 
-			inline void addVariable(const Type& type, const std::string& name) { _insertVar(type, name, false); }
-			inline void addParameter(const Type& type, const std::string& name) { _insertVar(type, name, true); }
+			inline void addVariable(const Type& type, const Atom& name) { _insertVar(type, name, false); }
+			inline void addParameter(const Type& type, const Atom& name) { _insertVar(type, name, true); }
 
-			inline Type returnType() const { _returnType; }
+			inline Type returnType() const { return _returnType; }
 
 			inline size_t parameterCount() const { return _paramCount; }
 			inline const VariableInfo& parameter(const size_t index) const { return _vars[index]; }
@@ -188,34 +352,125 @@ namespace ksp
 			inline opcode_t opcode(const size_t index) const { return _code[index]; }
 			inline const std::vector<opcode_t>& opcodes() const { return _code; }
 
+			inline const bytecode::FusionReport& fusionReport() const { return _fusion; }
+
+			/* Decoded code, valid after build(). */
+			inline const std::vector<bytecode::Instruction>& instructions() const { return _instructions; }
+
+			/* Operands of the bulk array instructions, indexed by their k. Valid after build(). */
+			inline const std::vector<bytecode::ArrayOperands>& arrayOperands() const { return _arrayOperands; }
+
+			/* Functions the CALL and TAILCALL instructions name, each once. Valid after build(). */
+			inline const std::vector<size_t>& callees() const { return _callees; }
+
+			/*
+			 * True when a call of this function in 'module' can run a YIELD, in its own code or in a
+			 * function its calls reach. Stubs among those count as yielding, their code being unknown.
+			 */
+			bool reachesYield(const Module& module) const;
+
+			/* Changed since the last build(), or never built. */
+			inline bool dirty() const { return _dirty; }
+
+			/*
+			 * Builds a function left as a stub by a lazy Module::build, and checks its calls.
+			 * Called by execute, CALL and TAILCALL before the function runs; thread safe.
+			 * Throws bytecode::InvalidBytecode, leaving the stub to fail again on its next call.
+			 */
+			inline void materialize() const
+			{
+				if (!fastMaterialized.load(std::memory_order_acquire))
+					_materialize();
+			}
+
+			/* Where the extra storage of variable 'index' (an array or a struct) starts in the frame heap. Valid after build(). */
+			inline size_t variableHeapOffset(const size_t index) const { return _heapOffsets[index]; }
+
 		public:
 			uint8_t fastRegisterCount;
 			uint8_t fastParameterCount;
 			bytecode_t fastCodeAccessor;
+			const bytecode::Instruction* fastInstructionAccessor;
+			const bytecode::ArrayOperands* fastArrayOperandAccessor;
 			size_t fastExtraStackSize;
 
+			/* Set by the binding function of aot::emit output; cleared by build(). */
+			aot_code_t fastAotCode;
+
+			// JIT state, updated by execute. The only members changed after build() //
+			mutable std::atomic<size_t> fastInvocationCount;
+			mutable std::atomic<native_code_t> fastNativeCode;
+
+			/* Set once the fast members above are valid; false for stubs. */
+			mutable std::atomic<bool> fastMaterialized;
+
 		private:
-			void _insertVar(const Type& type, const std::string& name, bool is_param);
+			void _insertVar(const Type& type, const Atom& name, bool is_param);
+
+			void _build();
+			void _stub(const Module& module);
+			void _materialize() const;
+			void _checkCalls(const Module& module);
+
+			friend struct ksp::Module;
+
+			void _resolveArrayOperands();
+			void _resolveFields();
 		};
 	}
 
+	/*
+	 * Thread safety: a Module, its NameTable and its Functions are built by one thread.
+	 * Once build() has returned they are immutable and may be read, and their functions
+	 * executed, from any number of threads without locking (the JIT counters of Function
+	 * are atomic, and stubs materialize under a lock). Every thread must use its own
+	 * RuntimeState and KSP_State.
+	 */
 	struct Module
 	{
 		module_info::NameTable content;
 
 		// Fast Accessors //
-		module_info::Function* fastFunctionAccessor;
-		data_ptr_t* fastConstantAccessor;
+		module_info::Function* const* fastFunctionAccessor;
+		data_ptr_t fastConstantAccessor;
 
+	private:
+		mutable std::atomic<size_t> _materialized;
+
+	public:
 		Module();
 		~Module();
 
-		void build();
+		/*
+		 * Numbers the functions (the CALL and TAILCALL operand is the callee's offset()),
+		 * builds them and checks every call. Functions attached from another module are
+		 * numbered but not built: that module must be built first (see Linker). Throws
+		 * bytecode::InvalidBytecode for an unknown callee or arguments past the caller's
+		 * registers.
+		 *
+		 * Building again is incremental (see NameTable::buildReferences): only dirty
+		 * functions are built, and only their calls and the calls to them are checked.
+		 *
+		 * With 'lazy' the functions to build are left as stubs instead, each built and
+		 * checked on its first call (see Function::materialize), so that the cost of a
+		 * module follows the functions that run rather than its size. Errors in a stub
+		 * surface from that call.
+		 */
+		void build(const bool lazy = false);
+
+		/* Functions this module has built, eagerly or on their first call. */
+		inline size_t materializedCount() const { return _materialized.load(std::memory_order_relaxed); }
+
+		friend class module_info::Function;
 	};
 
 	struct KSP_State
 	{
+		/* Filled by execute<policy::Trace>. */
+		TraceBuffer trace;
 
+		/* Filled by execute<policy::Profile>. */
+		OpcodeProfile profile;
 	};
 
 	namespace bytecode
@@ -238,6 +493,10 @@ namespace ksp
 			std::vector<opcode_t> build() const;
 
 			void push_opcode(const ksp::OpcodeInfo& op, const std::vector<opcode_t>& bytes);
+
+			void push_instruction(const ksp::OpcodeInfo& op, const std::vector<uint64_t>& args);
 		};
 	}
 }
+
+std::ostream& operator<< (std::ostream& os, const ksp::bytecode::FusionReport& report);
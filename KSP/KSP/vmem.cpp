@@ -0,0 +1,133 @@
+#include "vmem.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+size_t ksp::vmem::page_size()
+{
+	static const size_t page = []() {
+#if defined(_WIN32)
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		return static_cast<size_t>(info.dwPageSize);
+#else
+		return static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
+	}();
+	return page;
+}
+
+void* ksp::vmem::reserve(const size_t size, const size_t guard)
+{
+	const size_t usable = round_to_pages(size);
+	const size_t total = usable + round_to_pages(guard);
+
+#if defined(_WIN32)
+	void* base = VirtualAlloc(nullptr, total, MEM_RESERVE, PAGE_NOACCESS);
+	if (!base)
+		return nullptr;
+	if (usable > 0 && !VirtualAlloc(base, usable, MEM_COMMIT, PAGE_READWRITE))
+	{
+		VirtualFree(base, 0, MEM_RELEASE);
+		return nullptr;
+	}
+	return base;
+#else
+	void* base = mmap(nullptr, total, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (base == MAP_FAILED)
+		return nullptr;
+	if (usable > 0 && mprotect(base, usable, PROT_READ | PROT_WRITE) != 0)
+	{
+		munmap(base, total);
+		return nullptr;
+	}
+	return base;
+#endif
+}
+
+void ksp::vmem::release(void* base, const size_t size, const size_t guard)
+{
+	if (!base)
+		return;
+#if defined(_WIN32)
+	VirtualFree(base, 0, MEM_RELEASE);
+#else
+	munmap(base, round_to_pages(size) + round_to_pages(guard));
+#endif
+}
+
+void ksp::vmem::discard(void* base, const size_t size)
+{
+	if (!base || size == 0)
+		return;
+#if defined(_WIN32)
+	VirtualAlloc(base, size, MEM_RESET, PAGE_READWRITE);
+#else
+	madvise(base, size, MADV_DONTNEED);
+#endif
+}
+
+const void* ksp::vmem::map_file(const std::string& path, size_t& size)
+{
+#if defined(_WIN32)
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return nullptr;
+
+	LARGE_INTEGER length;
+	if (!GetFileSizeEx(file, &length) || length.QuadPart == 0)
+	{
+		CloseHandle(file);
+		return nullptr;
+	}
+
+	HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	CloseHandle(file);
+	if (!mapping)
+		return nullptr;
+
+	const void* base = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping);
+	if (!base)
+		return nullptr;
+
+	size = static_cast<size_t>(length.QuadPart);
+	return base;
+#else
+	const int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return nullptr;
+
+	struct stat info;
+	if (fstat(fd, &info) != 0 || info.st_size == 0)
+	{
+		close(fd);
+		return nullptr;
+	}
+
+	void* base = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return nullptr;
+
+	size = static_cast<size_t>(info.st_size);
+	return base;
+#endif
+}
+
+void ksp::vmem::unmap_file(const void* base, const size_t size)
+{
+	if (!base)
+		return;
+#if defined(_WIN32)
+	UnmapViewOfFile(base);
+#else
+	munmap(const_cast<void*>(base), size);
+#endif
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "support.h"
+
+namespace ksp
+{
+	/* Page level memory: reserved regions backed on first touch, with no-access guard bands. */
+	namespace vmem
+	{
+		size_t page_size();
+
+		inline size_t round_to_pages(const size_t size)
+		{
+			const size_t page = page_size();
+			return (size + page - 1) & ~(page - 1);
+		}
+
+		/*
+		 * Reserves round_to_pages(size) read/write bytes followed by round_to_pages(guard)
+		 * no-access bytes. Physical pages are only used once touched. Returns nullptr on failure.
+		 */
+		void* reserve(const size_t size, const size_t guard);
+
+		/* 'size' and 'guard' must be the values given to reserve. */
+		void release(void* base, const size_t size, const size_t guard);
+
+		/* Returns the physical pages of [base, base + size) to the system, keeping the range usable. Its contents are lost. */
+		void discard(void* base, const size_t size);
+
+		/*
+		 * Maps the whole file at 'path' read only, with pages read in on first touch.
+		 * Returns nullptr, leaving 'size' untouched, if it can not be opened or is empty.
+		 */
+		const void* map_file(const std::string& path, size_t& size);
+
+		/* 'size' must be the value map_file gave. */
+		void unmap_file(const void* base, const size_t size);
+	}
+}